@@ -1,5 +1,6 @@
 import operator
 import math
+import weakref
 from functools import reduce
 import numpy as np
 from . import ndarray_backend_numpy
@@ -11,6 +12,15 @@ def prod(x):
     return reduce(operator.mul, x, 1)
 
 
+# Winograd-transformed conv filters, keyed by id() of the filter storage; see
+# NDArray.winograd_filters
+_WINOGRAD_FILTERS = {}
+
+# Number of in-place writes made to each array storage, for caches of values derived from an
+# array; see NDArray.version
+_HANDLE_VERSIONS = weakref.WeakKeyDictionary()
+
+
 class BackendDevice:
     """A backend device, wrapps the implementation module."""
 
@@ -30,16 +40,38 @@ class BackendDevice:
     def enabled(self):
         return self.mod is not None
 
-    def randn(self, *shape, dtype="float32"):
+    def _native_random(self, stream):
+        """ Whether to draw from the backend's counter-based generator (see random_fill) rather
+        than np.random: when a stream is given, or when the backend has been switched to it. """
+        if not hasattr(self.mod, "random_fill"):
+            return False
+        return stream is not None or self.mod.get_native_random()
+
+    def _random(self, shape, dist, a, b, stream):
+        out = self.empty(shape)
+        self.mod.random_fill(out._handle, dist, a, b, 0 if stream is None else stream)
+        return out
+
+    def randn(self, *shape, dtype="float32", stream=None):
+        if self._native_random(stream):
+            return self._random(shape, "normal", 0.0, 1.0, stream)
         # note: numpy doesn't support types within standard random routines, and
         # .astype("float32") does work if we're generating a singleton
         return NDArray(np.random.randn(*shape).astype(dtype), device=self)
 
-    def rand(self, *shape, dtype="float32"):
+    def rand(self, *shape, dtype="float32", stream=None):
+        if self._native_random(stream):
+            return self._random(shape, "uniform", 0.0, 1.0, stream)
         # note: numpy doesn't support types within standard random routines, and
         # .astype("float32") does work if we're generating a singleton
         return NDArray(np.random.rand(*shape).astype(dtype), device=self)
 
+    def randb(self, *shape, p=0.5, dtype="float32", stream=None):
+        """ 1.0 with probability p, else 0.0 """
+        if self._native_random(stream):
+            return self._random(shape, "bernoulli", p, 1.0, stream)
+        return self.rand(*shape, dtype=dtype) <= p
+
     def one_hot(self, n, i, dtype="float32"):
         return NDArray(np.eye(n, dtype=dtype)[i], device=self)
 
@@ -175,6 +207,15 @@ class NDArray:
     def size(self):
         return prod(self._shape)
 
+    @property
+    def version(self):
+        """Number of in-place writes (fill, __setitem__) made so far to the
+        storage of this array, which all of its views share."""
+        return _HANDLE_VERSIONS.get(self._handle, 0)
+
+    def _bump_version(self):
+        _HANDLE_VERSIONS[self._handle] = self.version + 1
+
     def __repr__(self):
         return "NDArray(" + self.numpy().__str__() + f", device={self.device})"
 
@@ -185,6 +226,7 @@ class NDArray:
     def fill(self, value):
         """Fill (in place) with a constant value."""
         self._device.fill(self._handle, value)
+        self._bump_version()
 
     def to(self, device):
         """Convert between devices, using to/from numpy calls as the unifying bridge."""
@@ -426,24 +468,50 @@ class NDArray:
                 view.strides,
                 view._offset,
             )
+        self._bump_version()
 
     ### Collection of elementwise and scalar function: add, multiply, boolean, etc
 
-    def ewise_or_scalar(self, other, ewise_func, scalar_func):
+    def ewise_or_scalar(self, other, ewise_func, scalar_func, op=None):
         """Run either an elementwise or scalar version of a function,
-        depending on whether "other" is an NDArray or scalar
+        depending on whether "other" is an NDArray or scalar.
+
+        On devices with strided kernels, `op` names the function and
+        non-compact operands (broadcast_to, permute and slice views) are read
+        in place rather than compacted into full-size copies first.
         """
         out = NDArray.make(self.shape, device=self.device)
+        strided = op is not None and hasattr(self.device, "ewise_strided")
         if isinstance(other, NDArray):
             assert self.shape == other.shape, "operation needs two equal-sized arrays"
-            ewise_func(self.compact()._handle, other.compact()._handle, out._handle)
+            if strided and not (self.is_compact() and other.is_compact()):
+                self.device.ewise_strided(
+                    op, self._handle, self._strides, self._offset,
+                    other._handle, other._strides, other._offset, out._handle, self._shape)
+            else:
+                ewise_func(self.compact()._handle, other.compact()._handle, out._handle)
+        else:
+            if strided and not self.is_compact():
+                self.device.scalar_strided(
+                    op, self._handle, self._strides, self._offset, other, out._handle, self._shape)
+            else:
+                scalar_func(self.compact()._handle, other, out._handle)
+        return out
+
+    def ewise_unary(self, ewise_func, op=None):
+        """Run an elementwise function, reading a non-compact self in place
+        on devices with strided kernels (see ewise_or_scalar)."""
+        out = NDArray.make(self.shape, device=self.device)
+        if op is not None and hasattr(self.device, "scalar_strided") and not self.is_compact():
+            self.device.scalar_strided(
+                op, self._handle, self._strides, self._offset, 0.0, out._handle, self._shape)
         else:
-            scalar_func(self.compact()._handle, other, out._handle)
+            ewise_func(self.compact()._handle, out._handle)
         return out
 
     def __add__(self, other):
         return self.ewise_or_scalar(
-            other, self.device.ewise_add, self.device.scalar_add
+            other, self.device.ewise_add, self.device.scalar_add, "add"
         )
 
     __radd__ = __add__
@@ -456,35 +524,33 @@ class NDArray:
 
     def __mul__(self, other):
         return self.ewise_or_scalar(
-            other, self.device.ewise_mul, self.device.scalar_mul
+            other, self.device.ewise_mul, self.device.scalar_mul, "mul"
         )
 
     __rmul__ = __mul__
 
     def __truediv__(self, other):
         return self.ewise_or_scalar(
-            other, self.device.ewise_div, self.device.scalar_div
+            other, self.device.ewise_div, self.device.scalar_div, "div"
         )
 
     def __neg__(self):
         return self * (-1)
 
     def __pow__(self, other):
-        out = NDArray.make(self.shape, device=self.device)
-        self.device.scalar_power(self.compact()._handle, other, out._handle)
-        return out
+        return self.ewise_or_scalar(other, None, self.device.scalar_power, "power")
 
     def maximum(self, other):
         return self.ewise_or_scalar(
-            other, self.device.ewise_maximum, self.device.scalar_maximum
+            other, self.device.ewise_maximum, self.device.scalar_maximum, "maximum"
         )
 
     ### Binary operators all return (0.0, 1.0) floating point values, could of course be optimized
     def __eq__(self, other):
-        return self.ewise_or_scalar(other, self.device.ewise_eq, self.device.scalar_eq)
+        return self.ewise_or_scalar(other, self.device.ewise_eq, self.device.scalar_eq, "eq")
 
     def __ge__(self, other):
-        return self.ewise_or_scalar(other, self.device.ewise_ge, self.device.scalar_ge)
+        return self.ewise_or_scalar(other, self.device.ewise_ge, self.device.scalar_ge, "ge")
 
     def __ne__(self, other):
         return 1 - (self == other)
@@ -501,29 +567,34 @@ class NDArray:
     ### Elementwise functions
 
     def log(self):
-        out = NDArray.make(self.shape, device=self.device)
-        self.device.ewise_log(self.compact()._handle, out._handle)
-        return out
+        return self.ewise_unary(self.device.ewise_log, "log")
 
     def exp(self):
-        out = NDArray.make(self.shape, device=self.device)
-        self.device.ewise_exp(self.compact()._handle, out._handle)
-        return out
+        return self.ewise_unary(self.device.ewise_exp, "exp")
 
     def tanh(self):
-        out = NDArray.make(self.shape, device=self.device)
-        self.device.ewise_tanh(self.compact()._handle, out._handle)
-        return out
+        return self.ewise_unary(self.device.ewise_tanh, "tanh")
+
+    def gelu(self):
+        """ GELU, tanh approximation: 0.5 * x * (1 + tanh(sqrt(2 / pi) * (x + 0.044715 * x^3))). """
+        if hasattr(self.device, "ewise_gelu"):
+            return self.ewise_unary(self.device.ewise_gelu, "gelu")
+        return 0.5 * self * (1 + (self * (math.sqrt(2 / math.pi) + 0.044715 * math.sqrt(2 / math.pi) * self * self)).tanh())
+
+    def gelu_grad(self, out_grad):
+        """ out_grad * GELU'(self), the input gradient of self.gelu(). """
+        if hasattr(self.device, "ewise_gelu_grad"):
+            return self.ewise_or_scalar(out_grad, self.device.ewise_gelu_grad, None, "gelu_grad")
+        k = math.sqrt(2 / math.pi)
+        x2 = self * self
+        t = (self * (k + 0.044715 * k * x2)).tanh()
+        return out_grad * (0.5 * (1 + t) + 0.5 * self * (1 - t * t) * (k + 3 * 0.044715 * k * x2))
 
     def sign(self):
-        out = NDArray.make(self.shape, device=self.device)
-        self.device.ewise_sign(self.compact()._handle, out._handle)
-        return out
+        return self.ewise_unary(self.device.ewise_sign, "sign")
 
     def abs(self):
-        out = NDArray.make(self.shape, device=self.device)
-        self.device.ewise_abs(self.compact()._handle, out._handle)
-        return out
+        return self.ewise_unary(self.device.ewise_abs, "abs")
 
     ### Matrix multiplication
     def __matmul__(self, other):
@@ -531,13 +602,10 @@ class NDArray:
         be 2D (i.e., we don't handle batch matrix multiplication), and that the
         sizes match up properly for matrix multiplication.
 
-        In the case of the CPU backend, you will implement an efficient "tiled"
-        version of matrix multiplication for the case when all dimensions of
-        the array are divisible by self.device.__tile_size__.  In this case,
-        the code below will restride and compact the matrix into tiled form,
-        and then pass to the relevant CPU backend.  For the CPU version we will
-        just fall back to the naive CPU implementation if the array shape is not
-        a multiple of the tile size
+        The CPU backend's `matmul` packs both operands into cache-sized panels
+        internally (see `Gemm` in ndarray_backend_cpu.cc), so every shape goes
+        straight to the device kernel; `matmul_tiled` remains available for
+        callers that already hold arrays in the 4D tiled layout.
 
         The GPU (and numpy) versions don't have any tiled version (or rather,
         the GPU version will just work natively by tiling any input size).
@@ -548,36 +616,302 @@ class NDArray:
 
         m, n, p = self.shape[0], self.shape[1], other.shape[1]
 
-        # if the matrix is aligned, use tiled matrix multiplication
-        if hasattr(self.device, "matmul_tiled") and all(
-            d % self.device.__tile_size__ == 0 for d in (m, n, p)
-        ):
-
-            def tile(a, tile):
-                return a.as_strided(
-                    (a.shape[0] // tile, a.shape[1] // tile, tile, tile),
-                    (a.shape[1] * tile, tile, a.shape[1], 1),
-                )
-
-            t = self.device.__tile_size__
-            a = tile(self.compact(), t).compact()
-            b = tile(other.compact(), t).compact()
-            out = NDArray.make((a.shape[0], b.shape[1], t, t), device=self.device)
-            self.device.matmul_tiled(a._handle, b._handle, out._handle, m, n, p)
-
-            return (
-                out.permute((0, 2, 1, 3))
-                .compact()
-                .reshape((self.shape[0], other.shape[1]))
-            )
+        out = NDArray.make((m, p), device=self.device)
+        self.device.matmul(
+            self.compact()._handle, other.compact()._handle, out._handle, m, n, p
+        )
+        return out
+
+    def bmm(self, other, transpose_a=False, transpose_b=False):
+        """Batched matrix multiplication over the last two axes.
+
+        Computes op(self) @ op(other) for every matrix in the leading (batch)
+        axes, where op() transposes the last two axes when the corresponding
+        flag is set.  The batch axes broadcast as in numpy; an operand whose
+        batch is a single matrix is shared across the batch without being
+        copied.  On the CPU backend the transposes are folded into the GEMM
+        strides, so only the output is materialized.
+        """
+        assert self.ndim >= 2 and other.ndim >= 2
+        m, n = self.shape[-2:] if not transpose_a else self.shape[-2:][::-1]
+        n_b, p = other.shape[-2:] if not transpose_b else other.shape[-2:][::-1]
+        assert n == n_b, "Inner dimensions do not match: %d vs %d" % (n, n_b)
+
+        a_batch, b_batch = self.shape[:-2], other.shape[:-2]
+        batch_ndim = max(len(a_batch), len(b_batch))
+        a_batch = (1,) * (batch_ndim - len(a_batch)) + a_batch
+        b_batch = (1,) * (batch_ndim - len(b_batch)) + b_batch
+        batch_shape = tuple(max(x, y) for x, y in zip(a_batch, b_batch))
+        batch = prod(batch_shape)
+
+        def batched(x, x_batch):
+            # returns a compact operand and the distance between its matrices
+            if prod(x_batch) == 1:
+                return x.compact(), 0
+            if x_batch != batch_shape:
+                x = x.reshape(x_batch + x.shape[-2:]).broadcast_to(batch_shape + x.shape[-2:])
+            return x.compact(), prod(x.shape[-2:])
+
+        a, a_stride = batched(self, a_batch)
+        b, b_stride = batched(other, b_batch)
+        out = NDArray.make(batch_shape + (m, p), device=self.device)
+
+        if hasattr(self.device, "bmm"):
+            self.device.bmm(a._handle, b._handle, out._handle, batch, m, n, p,
+                            a_stride, b_stride, transpose_a, transpose_b)
+            return out
+
+        a = a.reshape((prod(a.shape[:-2]),) + a.shape[-2:])
+        b = b.reshape((prod(b.shape[:-2]),) + b.shape[-2:])
+        out_view = out.reshape((batch, m, p))
+        for i in range(batch):
+            a_i = a[i if a_stride else 0].compact().reshape(a.shape[-2:])
+            b_i = b[i if b_stride else 0].compact().reshape(b.shape[-2:])
+            a_i = a_i.permute((1, 0)) if transpose_a else a_i
+            b_i = b_i.permute((1, 0)) if transpose_b else b_i
+            out_view[i] = (a_i @ b_i).reshape((1, m, p))
+        return out
 
+    def _attention_operands(self, k, v, bias):
+        """Flatten the batch axes of q (self), k, v and bias for the attention
+        kernels.  The bias keeps only the trailing batch axes it actually has
+        (batch entry b reads bias matrix b % bias.shape[0]), so a bias shared
+        by the leading batch axes is not copied out to the full batch.  Also
+        returns the unflattened shape of the bias operand, which is the shape
+        of its gradient."""
+        batch_shape, (n, d) = self.shape[:-2], self.shape[-2:]
+        m, dv = k.shape[-2], v.shape[-1]
+        assert k.shape == batch_shape + (m, d) and v.shape == batch_shape + (m, dv)
+        batch = prod(batch_shape)
+        q = self.compact().reshape((batch, n, d))
+        k = k.compact().reshape((batch, m, d))
+        v = v.compact().reshape((batch, m, dv))
+        bias_shape = None
+        if bias is not None:
+            if bias.ndim < len(batch_shape) + 2:
+                bias = bias.compact().reshape((1,) * (len(batch_shape) + 2 - bias.ndim) + bias.shape)
+            bias_batch = bias.shape[:-2]
+            lead = next((i for i, s in enumerate(bias_batch) if s != 1), len(batch_shape))
+            if bias_batch[lead:] != batch_shape[lead:]:
+                lead = 0
+            bias_shape = (1,) * lead + batch_shape[lead:] + (n, m)
+            if bias.shape != bias_shape:
+                bias = bias.broadcast_to(bias_shape)
+            bias = bias.compact().reshape((prod(batch_shape[lead:]), n, m))
+        return q, k, v, bias, bias_shape
+
+    def _attention_probs(self, k, bias, scale, causal):
+        """ Unfused softmax(q @ k^T * scale + bias) for devices without attention kernels. """
+        batch, n, m = self.shape[0], self.shape[1], k.shape[1]
+        logits = self.bmm(k, transpose_b=True) * scale
+        if bias is not None:
+            bias_batch = bias.shape[0]
+            logits = logits + bias.reshape((1, bias_batch, n, m)).broadcast_to(
+                (batch // bias_batch, bias_batch, n, m)).compact().reshape(logits.shape)
+        if causal:
+            mask = np.triu(np.ones((1, n, m), dtype=np.float32), m - n + 1)
+            mask = NDArray(-np.finfo(np.float32).max * mask, device=self.device)
+            logits = logits + mask.broadcast_to(logits.shape)
+        row_max = logits.max(axis=2, keepdims=True)
+        probs = (logits - row_max.broadcast_to(logits.shape)).exp()
+        row_sum = probs.sum(axis=2, keepdims=True)
+        probs = probs / row_sum.broadcast_to(probs.shape)
+        return probs, (row_max + row_sum.log()).reshape((batch, n))
+
+    def flash_attention(self, k, v, bias=None, scale=1.0, causal=False):
+        """Fused softmax(q @ k^T * scale + bias) @ v with q = self.
+
+        q, k and v are (..., n, d), (..., m, d) and (..., m, dv) with the same
+        leading batch axes; bias broadcasts to (..., n, m).  Returns the
+        (..., n, dv) output and the (..., n) log-sum-exp of the score rows,
+        which flash_attention_backward needs.  On the CPU backend the scores
+        are never materialized.
+        """
+        batch_shape, n, m, dv = self.shape[:-2], self.shape[-2], k.shape[-2], v.shape[-1]
+        q, k, v, bias, _ = self._attention_operands(k, v, bias)
+        batch, d = q.shape[0], q.shape[2]
+
+        if hasattr(self.device, "flash_attention"):
+            out = NDArray.make((batch, n, dv), device=self.device)
+            lse = NDArray.make((batch, n), device=self.device)
+            self.device.flash_attention(
+                q._handle, k._handle, v._handle, (bias if bias is not None else q)._handle,
+                out._handle, lse._handle, batch, n, m, d, dv,
+                bias.shape[0] if bias is not None else 1, scale, bias is not None, causal)
         else:
-            out = NDArray.make((m, p), device=self.device)
-            self.device.matmul(
-                self.compact()._handle, other.compact()._handle, out._handle, m, n, p
-            )
+            probs, lse = q._attention_probs(k, bias, scale, causal)
+            out = probs.bmm(v)
+        return out.reshape(batch_shape + (n, dv)), lse.reshape(batch_shape + (n,))
+
+    def flash_attention_backward(self, q, k, v, bias, out, lse, scale=1.0, causal=False):
+        """Gradients of flash_attention with respect to q, k, v and bias, with
+        self as the output gradient.  The bias gradient is None when bias is
+        None; otherwise it is already summed over the leading batch axes the
+        bias is shared by and has one axis per axis of q's scores."""
+        batch_shape, n, m, d, dv = q.shape[:-2], q.shape[-2], k.shape[-2], q.shape[-1], v.shape[-1]
+        q, k, v, bias, bias_shape = q._attention_operands(k, v, bias)
+        batch = q.shape[0]
+        out_grad = self.compact().reshape((batch, n, dv))
+        out = out.compact().reshape((batch, n, dv))
+        lse = lse.compact().reshape((batch, n))
+
+        if hasattr(self.device, "flash_attention_backward"):
+            q_grad = NDArray.make(q.shape, device=self.device)
+            k_grad = NDArray.make(k.shape, device=self.device)
+            v_grad = NDArray.make(v.shape, device=self.device)
+            bias_grad = NDArray.make(bias.shape, device=self.device) if bias is not None else None
+            self.device.flash_attention_backward(
+                out_grad._handle, q._handle, k._handle, v._handle,
+                (bias if bias is not None else q)._handle, out._handle, lse._handle,
+                q_grad._handle, k_grad._handle, v_grad._handle,
+                (bias_grad if bias_grad is not None else q_grad)._handle,
+                batch, n, m, d, dv, bias.shape[0] if bias is not None else 1, scale,
+                bias is not None, causal)
+        else:
+            probs, _ = q._attention_probs(k, bias, scale, causal)
+            v_grad = probs.bmm(out_grad, transpose_a=True)
+            probs_grad = out_grad.bmm(v, transpose_b=True)
+            delta = (out_grad * out).sum(axis=2, keepdims=True).broadcast_to(probs.shape)
+            logits_grad = probs * (probs_grad - delta)
+            bias_grad = None
+            if bias is not None:
+                bias_grad = logits_grad.reshape((batch // bias.shape[0],) + bias.shape).sum(axis=0)
+            q_grad = logits_grad.bmm(k) * scale
+            k_grad = logits_grad.bmm(q, transpose_a=True) * scale
+
+        grads = (q_grad.reshape(batch_shape + (n, d)), k_grad.reshape(batch_shape + (m, d)),
+                 v_grad.reshape(batch_shape + (m, dv)))
+        if bias_grad is not None:
+            grads += (bias_grad.reshape(bias_shape),)
+        return grads
+
+    def conv2d(self, weight, bias=None, stride=1, padding=0, groups=1):
+        """2D convolution of the NHWC array self with a K x K x (C_in / groups)
+        x C_out filter, plus an optional (C_out,) bias.  With groups > 1 the
+        g-th block of output channels only sees the g-th block of input
+        channels.  The result is N x H_out x W_out x C_out with
+        H_out = (H + 2 * padding - K) // stride + 1.  On the CPU backend the
+        padding is implicit and the im2col matrix is built in bounded blocks,
+        so neither is materialized in full.
+        """
+        N, H, W, C_in = self.shape
+        K, _, _, C_out = weight.shape
+        assert C_in % groups == 0 and C_out % groups == 0, "groups must divide the channel counts"
+        assert weight.shape[2] * groups == C_in, "Input channels do not match: %d vs %d" % (C_in, weight.shape[2] * groups)
+        H_out = max(0, (H + 2 * padding - K) // stride + 1)
+        W_out = max(0, (W + 2 * padding - K) // stride + 1)
+        a = self.compact()
+
+        # 3x3 stride-1 layers with enough channels go through Winograd F(4x4, 3x3), or F(2x2, 3x3)
+        # for outputs under 8 pixels a side, where 4x4 tiles would mostly be padding; with only a
+        # few input channels or tiny images the transforms cost more than they save
+        if (hasattr(self.device, "conv2d_winograd") and K == 3 and stride == 1 and groups == 1
+                and C_in >= 8 and C_out >= 8 and min(H_out, W_out) >= 4):
+            tile = 4 if min(H_out, W_out) >= 8 else 2
+            out = NDArray.make((N, H_out, W_out, C_out), device=self.device)
+            u = weight.winograd_filters(tile)
+            bias = bias.compact() if bias is not None else None
+            self.device.conv2d_winograd(
+                a._handle, u._handle, (bias if bias is not None else u)._handle, out._handle,
+                N, H, W, C_in, C_out, padding, tile, bias is not None)
+            return out
+
+        weight = weight.compact()
+        if hasattr(self.device, "conv2d"):
+            out = NDArray.make((N, H_out, W_out, C_out), device=self.device)
+            bias = bias.compact() if bias is not None else None
+            self.device.conv2d(
+                a._handle, weight._handle, (bias if bias is not None else weight)._handle,
+                out._handle, N, H, W, C_in, K, C_out, stride, padding, groups, bias is not None)
+            return out
+
+        if groups > 1:
+            out = NDArray.make((N, H_out, W_out, C_out), device=self.device)
+            cg_in, cg_out = C_in // groups, C_out // groups
+            for g in range(groups):
+                o = slice(g * cg_out, (g + 1) * cg_out)
+                out[:, :, :, o] = a[:, :, :, g * cg_in:(g + 1) * cg_in].conv2d(
+                    weight[:, :, :, o], None if bias is None else bias[o], stride=stride, padding=padding)
             return out
 
+        a = a.pad(((0, 0), (padding, padding), (padding, padding), (0, 0)))
+        Ns, Hs, Ws, Cs = a.strides
+        cols = a.as_strided(shape=(N, H_out, W_out, K, K, C_in),
+                            strides=(Ns, Hs * stride, Ws * stride, Hs, Ws, Cs))
+        out = cols.compact().reshape((N * H_out * W_out, K * K * C_in)) @ weight.reshape((K * K * C_in, C_out))
+        if bias is not None:
+            out = out + bias.reshape((1, C_out)).broadcast_to(out.shape)
+        return out.reshape((N, H_out, W_out, C_out))
+
+    def winograd_filters(self, tile):
+        """Winograd transform of the 3 x 3 x C_in x C_out filters self for
+        output tiles of tile x tile (2 or 4), as a (tile + 2)^2 x C_in x C_out
+        array.  The result is cached per weight version, i.e. per storage
+        handle, view and count of in-place writes to the storage, so a layer
+        transforms its filters once per optimizer step rather than on every
+        call; the entry goes away with the storage.
+        """
+        key = id(self._handle)
+        version = (self.version, self._offset, self.shape, self.strides, tile)
+        entry = _WINOGRAD_FILTERS.get(key)
+        if entry is not None and entry[0]() is self._handle and entry[1] == version:
+            return entry[2]
+
+        C_in, C_out = self.shape[2], self.shape[3]
+        u = NDArray.make(((tile + 2) ** 2, C_in, C_out), device=self.device)
+        self.device.winograd_filter_transform(self.compact()._handle, u._handle, C_in, C_out, tile)
+        handle = weakref.ref(self._handle, lambda _, key=key: _WINOGRAD_FILTERS.pop(key, None))
+        _WINOGRAD_FILTERS[key] = (handle, version, u)
+        return u
+
+    def conv2d_backward(self, a, weight, stride=1, padding=0, groups=1):
+        """Gradients of conv2d(a, weight) with respect to a and weight, with
+        self as the N x H_out x W_out x C_out output gradient.  The bias
+        gradient is self summed over (N, H_out, W_out) and is left to the
+        caller."""
+        N, H, W, C_in = a.shape
+        K, _, _, C_out = weight.shape
+        out_grad, a, weight = self.compact(), a.compact(), weight.compact()
+
+        if hasattr(self.device, "conv2d_backward"):
+            a_grad = NDArray.make(a.shape, device=self.device)
+            weight_grad = NDArray.make(weight.shape, device=self.device)
+            self.device.conv2d_backward(
+                out_grad._handle, a._handle, weight._handle, a_grad._handle, weight_grad._handle,
+                N, H, W, C_in, K, C_out, stride, padding, groups)
+            return a_grad, weight_grad
+
+        if groups > 1:
+            a_grad = NDArray.make(a.shape, device=self.device)
+            weight_grad = NDArray.make(weight.shape, device=self.device)
+            cg_in, cg_out = C_in // groups, C_out // groups
+            for g in range(groups):
+                i, o = slice(g * cg_in, (g + 1) * cg_in), slice(g * cg_out, (g + 1) * cg_out)
+                a_grad[:, :, :, i], weight_grad[:, :, :, o] = out_grad[:, :, :, o].conv2d_backward(
+                    a[:, :, :, i], weight[:, :, :, o], stride=stride, padding=padding)
+            return a_grad, weight_grad
+
+        # a_grad: full convolution of the dilated gradient with the flipped, transposed filters;
+        # the dilated gradient spans H + 2P - K + 1 rows so that the result is exactly H x W
+        _, H_out, W_out, _ = out_grad.shape
+        dilated = full((N, H + 2 * padding - K + 1, W + 2 * padding - K + 1, C_out), 0,
+                       dtype=self.dtype, device=self.device)
+        dilated[:, :(H_out - 1) * stride + 1:stride, :(W_out - 1) * stride + 1:stride, :] = out_grad
+        ks = weight.strides
+        flipped = NDArray.make((K, K, C_out, C_in), strides=(-ks[0], -ks[1], ks[3], ks[2]),
+                               device=self.device, handle=weight._handle,
+                               offset=(K - 1) * (ks[0] + ks[1]))
+        a_grad = dilated.conv2d(flipped, padding=K - 1 - padding)
+
+        # weight_grad: im2col(a)^T @ out_grad
+        a_pad = a.pad(((0, 0), (padding, padding), (padding, padding), (0, 0)))
+        Ns, Hs, Ws, Cs = a_pad.strides
+        cols = a_pad.as_strided(shape=(N, H_out, W_out, K, K, C_in),
+                                strides=(Ns, Hs * stride, Ws * stride, Hs, Ws, Cs))
+        cols = cols.compact().reshape((N * H_out * W_out, K * K * C_in))
+        weight_grad = cols.permute((1, 0)) @ out_grad.reshape((N * H_out * W_out, C_out))
+        return a_grad, weight_grad.reshape(weight.shape)
+
     ### Reductions, i.e., sum/max over all element or over given axis
     def reduce_view_out(self, axis, keepdims=False):
         """ Return a view to the array set up for reduction functions and output array. """
@@ -605,16 +939,223 @@ class NDArray:
             )
         return view, out
 
+    def reduce(self, op, axis=None, keepdims=False):
+        """ Reduce ("sum" or "max") over one axis, a tuple of axes, or everything (axis=None).
+        Devices with a strided reduction kernel reduce the view in place in one pass; others
+        reduce one axis at a time through reduce_view_out. """
+        if axis is None:
+            axes = tuple(range(self.ndim))
+        elif isinstance(axis, (tuple, list)):
+            if not axis:
+                raise ValueError("Empty axis in reduce")
+            axes = tuple(sorted(set(a % self.ndim for a in axis)))
+        else:
+            axes = (axis % self.ndim,)
+        kept_shape = tuple(s for i, s in enumerate(self.shape) if i not in axes)
+        keep_shape = tuple(1 if i in axes else s for i, s in enumerate(self.shape))
+        # axis=None without keepdims returns shape (1,); explicit axes drop every reduced axis, so
+        # reducing all of them gives shape (), as in numpy
+        out_shape = keep_shape if keepdims else ((1,) if axis is None else kept_shape)
+
+        if hasattr(self.device, "reduce_strided"):
+            out = NDArray.make(out_shape, device=self.device)
+            self.device.reduce_strided(op, self._handle, self.shape, self.strides, self._offset, axes, out._handle)
+            return out
+
+        out = self
+        for ax in axes:
+            view, res = out.reduce_view_out(ax, keepdims=True)
+            getattr(self.device, "reduce_" + op)(view.compact()._handle, res._handle, view.shape[-1])
+            out = res
+        return out.reshape(out_shape)
+
     def sum(self, axis=None, keepdims=False):
-        view, out = self.reduce_view_out(axis, keepdims=keepdims)
-        self.device.reduce_sum(view.compact()._handle, out._handle, view.shape[-1])
-        return out
+        return self.reduce("sum", axis=axis, keepdims=keepdims)
 
     def max(self, axis=None, keepdims=False):
-        view, out = self.reduce_view_out(axis, keepdims=keepdims)
-        self.device.reduce_max(view.compact()._handle, out._handle, view.shape[-1])
+        return self.reduce("max", axis=axis, keepdims=keepdims)
+
+    def arg_reduce(self, op, axis=None, keepdims=False):
+        """ Index of the largest ("argmax") or smallest ("argmin") element along one axis, or of
+        the flattened array for axis=None, as float32 values. Ties go to the first index. """
+        if axis is None:
+            view, axis = self.compact().reshape((self.size,)), 0
+            out_shape = (1,) * self.ndim if keepdims else (1,)
+        else:
+            view, axis = self, axis % self.ndim
+            kept_shape = tuple(s for i, s in enumerate(self.shape) if i != axis)
+            out_shape = self.shape[:axis] + (1,) + self.shape[axis + 1:] if keepdims else (kept_shape or (1,))
+
+        if not hasattr(self.device, "arg_reduce"):
+            idx = getattr(np, op)(view.numpy(), axis=axis)
+            return NDArray(np.asarray(idx, dtype=np.float32).reshape(out_shape), device=self.device)
+        out = NDArray.make(out_shape, device=self.device)
+        self.device.arg_reduce(op, view._handle, view.shape, view.strides, view._offset, axis, out._handle)
         return out
 
+    def argmax(self, axis=None, keepdims=False):
+        return self.arg_reduce("argmax", axis=axis, keepdims=keepdims)
+
+    def argmin(self, axis=None, keepdims=False):
+        return self.arg_reduce("argmin", axis=axis, keepdims=keepdims)
+
+    def topk(self, k, axis=-1, largest=True):
+        """ The k largest (or smallest) elements along axis in rank order, and their indices as
+        float32 values. Returns (values, indices), both with axis resized to k. """
+        axis = axis % self.ndim
+        if hasattr(self.device, "topk"):
+            out_shape = tuple(s for i, s in enumerate(self.shape) if i != axis) + (k,)
+            values = NDArray.make(out_shape, device=self.device)
+            indices = NDArray.make(out_shape, device=self.device)
+            self.device.topk(self._handle, self.shape, self.strides, self._offset, axis, k, largest,
+                             values._handle, indices._handle)
+        else:
+            a = np.moveaxis(self.numpy(), axis, -1)
+            order = np.argsort(-a if largest else a, axis=-1, kind="stable")[..., :k]
+            values = NDArray(np.take_along_axis(a, order, axis=-1), device=self.device)
+            indices = NDArray(order.astype(np.float32), device=self.device)
+        # the selected elements come out last; move them back to axis
+        perm = tuple(range(axis)) + (self.ndim - 1,) + tuple(range(axis, self.ndim - 1))
+        return values.permute(perm).compact(), indices.permute(perm).compact()
+
+    def gather(self, index, axis=0):
+        """ The slices of self at the integer positions in index (stored as floats) along axis, as
+        numpy.take: the result has shape self.shape[:axis] + index.shape + self.shape[axis + 1:]. """
+        axis = axis % self.ndim
+        a, index = self.compact(), index.to(self.device).compact()
+        out_shape = self.shape[:axis] + index.shape + self.shape[axis + 1:]
+        if hasattr(self.device, "gather"):
+            out = NDArray.make(out_shape, device=self.device)
+            self.device.gather(a._handle, index._handle, out._handle, prod(self.shape[:axis]),
+                               self.shape[axis], prod(self.shape[axis + 1:]))
+            return out
+        return NDArray(np.take(a.numpy(), index.numpy().astype(np.int64), axis=axis), device=self.device)
+
+    def scatter_add(self, index, size, axis=0):
+        """ The adjoint of gather: a zero array with the index dimensions of self (those at axis)
+        replaced by one of length size, into which each slice of self is added at its position
+        in index. Slices sharing a position are added in order. """
+        axis = axis % self.ndim
+        src, index = self.compact(), index.to(self.device).compact()
+        rest = self.shape[axis + index.ndim:]
+        out_shape = self.shape[:axis] + (size,) + rest
+        if hasattr(self.device, "scatter_add"):
+            out = NDArray.make(out_shape, device=self.device)
+            self.device.scatter_add(src._handle, index._handle, out._handle, prod(self.shape[:axis]),
+                                    size, prod(rest))
+            return out
+        out = np.zeros(out_shape, dtype=np.float32)
+        idx = (slice(None),) * axis + (index.numpy().astype(np.int64),)
+        np.add.at(out, idx, src.numpy())
+        return NDArray(out, device=self.device)
+
+    def _rows_along(self, axis):
+        """ (compact array with axis moved last, permutation that moves it back or None) """
+        axis = axis % self.ndim
+        if axis == self.ndim - 1:
+            return self.compact(), None
+        perm = tuple(i for i in range(self.ndim) if i != axis) + (axis,)
+        back = tuple(range(axis)) + (self.ndim - 1,) + tuple(range(axis, self.ndim - 1))
+        return self.permute(perm).compact(), back
+
+    def softmax(self, axis=-1, log=False):
+        """ Softmax (or log-softmax) along axis. Devices with a softmax kernel make one pass per
+        row; others compose max / exp / sum. """
+        a, back = self._rows_along(axis)
+        last = a.ndim - 1
+        if hasattr(self.device, "softmax"):
+            out = self.device.empty(a.shape, dtype=self.dtype)
+            self.device.softmax(a._handle, out._handle, a.shape[-1], log)
+        else:
+            z = a - a.max(axis=last, keepdims=True).broadcast_to(a.shape)
+            if log:
+                out = z - z.exp().sum(axis=last, keepdims=True).log().broadcast_to(a.shape)
+            else:
+                out = z.exp()
+                out = out / out.sum(axis=last, keepdims=True).broadcast_to(a.shape)
+        return out if back is None else out.permute(back).compact()
+
+    def softmax_backward(self, out, axis=-1, log=False):
+        """ Gradient of softmax(axis, log) with respect to its input, with self as the output
+        gradient and out as the forward output. """
+        dy, back = self._rows_along(axis)
+        y, _ = out._rows_along(axis)
+        last = y.ndim - 1
+        if hasattr(self.device, "softmax_backward"):
+            a_grad = self.device.empty(y.shape, dtype=self.dtype)
+            self.device.softmax_backward(dy._handle, y._handle, a_grad._handle, y.shape[-1], log)
+        elif log:
+            a_grad = dy - y.exp() * dy.sum(axis=last, keepdims=True).broadcast_to(y.shape)
+        else:
+            a_grad = y * (dy - (dy * y).sum(axis=last, keepdims=True).broadcast_to(y.shape))
+        return a_grad if back is None else a_grad.permute(back).compact()
+
+    def softmax_cross_entropy(self, labels):
+        """ Mean cross-entropy of the softmax over the last axis against integer class labels (one
+        per row, stored as floats). Returns (loss of shape (1,), gradient of the loss with respect
+        to self); devices with a softmax_cross_entropy kernel never build a one-hot matrix. """
+        a = self.compact()
+        labels = labels.to(self.device).compact()
+        k = a.shape[-1]
+        rows = a.size // k
+        if hasattr(self.device, "softmax_cross_entropy"):
+            loss = self.device.empty((1,), dtype=self.dtype)
+            grad = self.device.empty(a.shape, dtype=self.dtype)
+            self.device.softmax_cross_entropy(a._handle, labels._handle, loss._handle, grad._handle, k)
+            return loss, grad
+        log_p = a.reshape((rows, k)).softmax(log=True)
+        one_hot = self.device.one_hot(k, labels.numpy().astype("int64").reshape(rows))
+        loss = (log_p * one_hot).sum() * (-1 / rows)
+        grad = (log_p.exp() - one_hot) / rows
+        return loss, grad.reshape(a.shape)
+
+    def layer_norm(self, weight, bias, eps=1e-5):
+        """ Normalize over the last axis, then scale by weight and shift by bias (shape[-1]
+        elements each). Returns (out, mean, rstd), the last two with one entry per row, which
+        layer_norm_backward needs. """
+        a, weight, bias = self.compact(), weight.compact(), bias.compact()
+        d = a.shape[-1]
+        rows = a.size // d
+        if hasattr(self.device, "layer_norm"):
+            out = self.device.empty(a.shape, dtype=self.dtype)
+            mean = self.device.empty((rows,), dtype=self.dtype)
+            rstd = self.device.empty((rows,), dtype=self.dtype)
+            self.device.layer_norm(a._handle, weight._handle, bias._handle, out._handle, mean._handle,
+                                   rstd._handle, d, eps)
+            return out, mean, rstd
+        x = a.reshape((rows, d))
+        mean = x.sum(axis=1, keepdims=True) / d
+        xc = x - mean.broadcast_to(x.shape)
+        rstd = ((xc * xc).sum(axis=1, keepdims=True) / d + eps) ** -0.5
+        out = xc * rstd.broadcast_to(x.shape) * weight.reshape((1, d)).broadcast_to(x.shape)
+        out = out + bias.reshape((1, d)).broadcast_to(x.shape)
+        return out.reshape(a.shape), mean.reshape((rows,)), rstd.reshape((rows,))
+
+    def layer_norm_backward(self, a, weight, mean, rstd):
+        """ Gradients of layer_norm with respect to a, weight and bias, with self as the output
+        gradient and mean / rstd as returned by the forward pass. """
+        out_grad, a, weight = self.compact(), a.compact(), weight.compact()
+        d = a.shape[-1]
+        rows = a.size // d
+        if hasattr(self.device, "layer_norm_backward"):
+            a_grad = self.device.empty(a.shape, dtype=self.dtype)
+            weight_grad = self.device.empty(weight.shape, dtype=self.dtype)
+            bias_grad = self.device.empty(weight.shape, dtype=self.dtype)
+            self.device.layer_norm_backward(out_grad._handle, a._handle, weight._handle, mean._handle,
+                                            rstd._handle, a_grad._handle, weight_grad._handle,
+                                            bias_grad._handle, d)
+            return a_grad, weight_grad, bias_grad
+        dy = out_grad.reshape((rows, d))
+        rstd = rstd.reshape((rows, 1)).broadcast_to((rows, d))
+        xhat = (a.reshape((rows, d)) - mean.reshape((rows, 1)).broadcast_to((rows, d))) * rstd
+        g = dy * weight.reshape((1, d)).broadcast_to((rows, d))
+        mean_g = (g.sum(axis=1, keepdims=True) / d).broadcast_to((rows, d))
+        mean_gx = ((g * xhat).sum(axis=1, keepdims=True) / d).broadcast_to((rows, d))
+        a_grad = (g - mean_g - xhat * mean_gx) * rstd
+        weight_grad = (dy * xhat).sum(axis=0).reshape(weight.shape)
+        bias_grad = dy.sum(axis=0).reshape(weight.shape)
+        return a_grad.reshape(a.shape), weight_grad, bias_grad
+
     def flip(self, axes):
         """
         Flip this ndarray along the specified axes.
@@ -641,22 +1182,25 @@ class NDArray:
     def grid_sample(self, grid, mode='bilinear', padding_mode='zeros', align_corners=False):
         assert len(self.shape) == 4
         assert len(grid.shape) == 4
+        self, grid = self.compact(), grid.compact()
         b, c, h, w = self.shape
         _, h_out, w_out, _ = grid.shape
-        out = self.device.full((b, c, h_out, w_out), 0, dtype=self.dtype)
-        self.device.grid_sample(self._handle, grid._handle, out._handle, (b, c, h, w), (b, h_out, w_out, 2))
+        out = self.device.empty((b, c, h_out, w_out), dtype=self.dtype)
+        self.device.grid_sample(self._handle, grid._handle, out._handle, (b, c, h, w), (b, h_out, w_out, 2),
+                                mode, padding_mode, align_corners)
         return out
     
     def grid_sample_backward(self, a, grid, mode='bilinear', padding_mode='zeros', align_corners=False):
         assert len(a.shape) == 4
         assert len(grid.shape) == 4
-        self = self.compact()
+        self, a, grid = self.compact(), a.compact(), grid.compact()
         assert len(self.shape) == 4
         b, c, h, w = a.shape
         _, h_out, w_out, _ = grid.shape
-        a_grad = self.device.full(a.shape, 0, dtype=self.dtype)
-        grid_grad = self.device.full(grid.shape, 0, dtype=self.dtype)
-        self.device.grid_sample_backward(self._handle, a._handle, grid._handle, a_grad._handle, grid_grad._handle, (b, c, h, w), (b, h_out, w_out, 2))
+        a_grad = self.device.empty(a.shape, dtype=self.dtype)
+        grid_grad = self.device.empty(grid.shape, dtype=self.dtype)
+        self.device.grid_sample_backward(self._handle, a._handle, grid._handle, a_grad._handle, grid_grad._handle,
+                                         (b, c, h, w), (b, h_out, w_out, 2), mode, padding_mode, align_corners)
         return a_grad, grid_grad
 
 def array(a, dtype="float32", device=None):
@@ -699,15 +1243,48 @@ def exp(a):
 def tanh(a):
     return a.tanh()
 
+def gelu(a):
+    return a.gelu()
+
 def sign(a):
     return a.sign()
 
 def abs(a):
     return a.abs()
 
+def bmm(a, b, transpose_a=False, transpose_b=False):
+    return a.bmm(b, transpose_a=transpose_a, transpose_b=transpose_b)
+
+def conv2d(a, weight, bias=None, stride=1, padding=0, groups=1):
+    return a.conv2d(weight, bias=bias, stride=stride, padding=padding, groups=groups)
+
 def sum(a, axis=None, keepdims=False):
     return a.sum(axis=axis, keepdims=keepdims)
 
 
+def argmax(a, axis=None, keepdims=False):
+    return a.argmax(axis=axis, keepdims=keepdims)
+
+
+def argmin(a, axis=None, keepdims=False):
+    return a.argmin(axis=axis, keepdims=keepdims)
+
+
+def topk(a, k, axis=-1, largest=True):
+    return a.topk(k, axis=axis, largest=largest)
+
+
+def gather(a, index, axis=0):
+    return a.gather(index, axis=axis)
+
+
+def scatter_add(a, index, size, axis=0):
+    return a.scatter_add(index, size, axis=axis)
+
+
+def softmax(a, axis=-1, log=False):
+    return a.softmax(axis=axis, log=log)
+
+
 def flip(a, axes):
     return a.flip(axes)
@@ -38,6 +38,9 @@ class CPUDevice(Device):
         # .astype("float32") does work if we're generating a singleton
         return numpy.random.rand(*shape)
 
+    def randb(self, *shape, p=0.5):
+        return numpy.random.rand(*shape) <= p
+
     def one_hot(self, n, i, dtype="float32"):
         return numpy.eye(n, dtype=dtype)[i]
 
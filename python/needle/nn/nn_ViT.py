@@ -57,8 +57,10 @@ class PatchEmbedding(nn.Module):
         
 
 class VisionTransformerBlock(nn.Module):
-    def __init__(self, embed_dim=768, num_head=12, dim_head=128, hidden_size=3072, dropout=0., device=None, dtype="float32"):
+    def __init__(self, embed_dim=768, num_head=12, dim_head=128, hidden_size=3072, dropout=0., device=None, dtype="float32", activation="relu"):
         super().__init__()
+        if activation not in ("relu", "gelu"):
+            raise ValueError("unsupported activation %r" % (activation,))
 
         self.device = device
         self.dtype = dtype
@@ -86,7 +88,7 @@ class VisionTransformerBlock(nn.Module):
 
         self.mlp = nn.Sequential(
             nn.Linear(embed_dim, hidden_size, device=device, dtype=dtype),
-            nn.ReLU(),  # Note: Could be changed to GELU
+            nn.GELU() if activation == "gelu" else nn.ReLU(),
             nn.Dropout(dropout),
             nn.Linear(hidden_size, embed_dim, device=device, dtype=dtype),
             nn.Dropout(dropout)
@@ -118,7 +120,7 @@ class VisionTransformer(nn.Module):
     def __init__(
         self, img_size=[224, 224], patch_size=16, in_channels=3, num_classes=1000, embed_dim=768, num_blocks=6,
         num_heads=12, dim_head=128, mlp_hidden_dim=3072, dropout=0.1, device=None, dtype="float32",
-        deform_attn_activate=False, dattn_dim_head=1, dattn_heads=1, dattn_offset_groups=1
+        deform_attn_activate=False, dattn_dim_head=1, dattn_heads=1, dattn_offset_groups=1, activation="relu"
     ):
         super().__init__()
         self.patch_embed = PatchEmbedding(img_size, patch_size, in_channels, embed_dim, device, dtype)
@@ -141,7 +143,8 @@ class VisionTransformer(nn.Module):
                 hidden_size=mlp_hidden_dim,
                 dropout=dropout,
                 device=device,
-                dtype=dtype
+                dtype=dtype,
+                activation=activation
             ) for _ in range(num_blocks)]
         )
         self.head = nn.Linear(embed_dim, num_classes, device=device, dtype=dtype)
@@ -169,6 +169,12 @@ class ReLU(Module):
         return ops.relu(x)
         ### END YOUR SOLUTION
 
+
+class GELU(Module):
+    """GELU, tanh approximation."""
+    def forward(self, x: Tensor) -> Tensor:
+        return ops.gelu(x)
+
 class Sequential(Module):
     def __init__(self, *modules):
         super().__init__()
@@ -186,16 +192,7 @@ class Sequential(Module):
 class SoftmaxLoss(Module):
     def forward(self, logits: Tensor, y: Tensor):
         ### BEGIN YOUR SOLUTION
-        k = logits.shape[1]
-        n = logits.shape[0]
-        logsumexp = ops.logsumexp(logits, axes=1)
-        y_one_hot = init.one_hot(k, y, device=logits.device, dtype=logits.dtype, requires_grad=False)
-        neg_part = ops.summation(ops.multiply(logits, y_one_hot), axes=(1,))
-        neg_part_minus = ops.mul_scalar(neg_part, -1)
-        pos_neg_part = ops.add(logsumexp, neg_part_minus)
-        pos_neg_sum = ops.summation(pos_neg_part, axes=(0,))
-        pos_neg_mean = ops.divide_scalar(pos_neg_sum, n)
-        return pos_neg_mean
+        return ops.softmax_cross_entropy(logits, y)
         ### END YOUR SOLUTION
 
 
@@ -285,26 +282,8 @@ class LayerNorm1d(Module):
 
     def forward(self, x: Tensor) -> Tensor:
         ### BEGIN YOUR SOLUTION
-        #n, d = x.shape
-        restore_shape = ops.restoreShape(x.shape, input_axes=(1,))
-        usum          = ops.summation(x, axes=(1,))
-        ux_div        = ops.divide_scalar(usum, self.dim)
-        ux            = ops.reshape(ux_div, restore_shape)
-        ux_broad      = ops.broadcast_to(ux, x.shape)
-        x_minus_ux    = x - ux_broad
-        x_minus_sq   = ops.multiply(x_minus_ux, x_minus_ux)
-        var_sum      = ops.summation(x_minus_sq, axes=(1,))
-        var_div      = ops.divide_scalar(var_sum, self.dim)
-        var_resh     = ops.reshape(var_div, restore_shape)
-        var_broad    = ops.broadcast_to(var_resh, x.shape)
-        var_eps      = ops.add_scalar(var_broad, self.eps)
-        var_sqrt     = ops.power_scalar(var_eps, 0.5)
-        x_div_var    = ops.divide(x_minus_ux, var_sqrt)
-        weight_broad = ops.broadcast_to(self.weight, x_div_var.shape)
-        bias_broad   = ops.broadcast_to(self.bias, x_div_var.shape)
-        wx           = ops.multiply(weight_broad, x_div_var)
-        wx_b         = ops.add(wx, bias_broad)
-        return wx_b
+        # one fused op: Welford row statistics, normalization and the affine transform
+        return ops.layer_norm(x, self.weight, self.bias, eps=self.eps)
         ### END YOUR SOLUTION
 
 
@@ -60,12 +60,8 @@ class Conv(Module):
         # Calculate the appropriate padding to ensure input and output dimensions are the same
         padding = (self.kernel_size-1)//2
 
-        # Calculate the convolution, then add the properly-broadcasted bias term if present
-        x_out_nhwc = ops.conv(a=x_nhwc, b=self.weight, stride=self.stride, padding=padding)
-        if self.bias:
-            bias_reshape = ops.reshape(self.bias, (1, 1, 1, self.out_channels))
-            bias_broadcast = ops.broadcast_to(bias_reshape, x_out_nhwc.shape)
-            x_out_nhwc = x_out_nhwc + bias_broadcast
+        # Calculate the convolution; the bias term (if present) is added inside the conv kernel
+        x_out_nhwc = ops.conv(a=x_nhwc, b=self.weight, stride=self.stride, padding=padding, bias=self.bias)
         x_out_nhcw = ops.transpose(x_out_nhwc, (2, 3))
         x_out_nchw = ops.transpose(x_out_nhcw, (1, 2))
 
@@ -144,51 +140,15 @@ class ConvGp(Module):
         # Calculate the appropriate padding to ensure input and output dimensions are the same
         padding = (self.kernel_size-1)//2
 
-        # Split input into groups along the channel axis
-        x_groups = ops.split(x_nhwc, axis=3)  # Each has shape (N, H, W, 1)
+        # Reshape weight for NHWC format
+        w_kiok = ops.transpose(self.weight, (0, 2))  # Shape: (K, in_channels_per_group, out_channels, K)
+        w_kkoi = ops.transpose(w_kiok, (1, 3))  # Shape: (K, K, out_channels, in_channels_per_group)
+        w_kkio = ops.transpose(w_kkoi, (2, 3))  # Shape: (K, K, in_channels_per_group, out_channels)
 
-        # Split weights into groups along the output channel axis
-        w_groups = ops.split(self.weight, axis=0)  # Each has shape (1, in_channels_per_group, K, K)
-
-        group_outputs = []
-
-        # Perform convolution for each group
-        for group_idx in range(self.groups):
-            # Stack the required slices for x_group
-            x_group = ops.stack(
-                [x_groups[group_idx * self.in_channels_per_group + i] for i in range(self.in_channels_per_group)],
-                axis=3,
-            )  # Shape: (N, H, W, in_channels_per_group)
-
-
-            # Stack the required slices for w_group
-            w_group = ops.stack(
-                [w_groups[group_idx * self.out_channels_per_group + i] for i in range(self.out_channels_per_group)],
-                axis=0,
-            )  # Shape: (out_channels_per_group, in_channels_per_group, K, K)
-
-            # Reshape weight for NHWC format
-            w_group_kiok = ops.transpose(w_group, (0, 2))  # Shape: (K, in_channels_per_group, out_channels_per_group, K)
-            w_group_kkoi = ops.transpose(w_group_kiok, (1, 3))  # Shape: (K, K, out_channels_per_group, in_channels_per_group)
-            w_group_kkio = ops.transpose(w_group_kkoi, (2, 3))  # Shape: (K, K, out_channels_per_group, in_channels_per_group)
-
-            # Perform convolution using ops.conv
-            group_out = ops.conv(a=x_group, b=w_group_kkio, stride=self.stride, padding=padding)  # Shape: (N, H_out, W_out, out_channels_per_group)
-            group_outputs.append(group_out)
-
-        # Stack group outputs along the last dimension (channels)
-        out_nhwc_list = []
-        for group_out in group_outputs:
-            x_groups = ops.split(group_out, axis=3)  # Each has shape (N, H, W, 1)
-            for x in x_groups:
-                out_nhwc_list.append(x)
-
-        out_nhwc = ops.stack(out_nhwc_list, axis=3) #(N, H_out, W_out, C_out)
-
-        # Add bias if present
-        if self.bias:
-            bias_broadcast = ops.reshape(self.bias, (1, 1, 1, self.out_channels))  # Shape: (1, 1, 1, C_out)
-            out_nhwc = out_nhwc + ops.broadcast_to(bias_broadcast, out_nhwc.shape)# Shape: (N, H, W, C_out)
+        # A single grouped convolution; group g of the output channels only sees group g of the
+        # input channels, and the bias (if present) is added inside the conv kernel
+        out_nhwc = ops.conv(a=x_nhwc, b=w_kkio, stride=self.stride, padding=padding,
+                            bias=self.bias, groups=self.groups)  # Shape: (N, H_out, W_out, C_out)
 
         # Transform output back from NHWC -> NCHW
         out_nhcw = ops.transpose(out_nhwc, (2, 3))  # Shape: (N, H, C_out, W)
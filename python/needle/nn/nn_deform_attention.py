@@ -9,6 +9,7 @@ from .nn_basic import (
     Parameter, 
     Module, 
     ReLU,
+    GELU,
     Tanh,
     Dropout,
     LayerNorm1d,
@@ -63,18 +64,6 @@ class Scale(Module):
     def forward(self, x):
         return x * self.scale
 
-# Only support tanh approximation
-class GELU(Module):
-    def forward(self, X: Tensor) -> Tensor:
-        x_cubed = ops.power_scalar(X, 3)  # x^3 = x * x * x
-        scaled_x_cubed = ops.mul_scalar(x_cubed, 0.044715)
-        z = ops.add(X, scaled_x_cubed)  # z = x + 0.044715 * x^3
-        z_scaled = ops.mul_scalar(z, np.sqrt(2/np.pi))
-        tanh_z = ops.tanh(z_scaled)  # Tanh(sqrt(2/pi)*(x+0.044715*x^3))
-        w = ops.add_scalar(tanh_z, 1)
-        gelu = ops.mul_scalar(ops.multiply(X, w), 0.5)  # GELU(x) = 0.5 * x * (1 + tanh(...))
-        return gelu
-
 def MLPBlock(dim, device=None, dtype='float32'):
     ### BEGIN YOUR SOLUTION
     two_layer_linear = Sequential(Linear(in_features=dim, out_features=dim, device=device, dtype=dtype), 
@@ -161,6 +150,7 @@ class DeformableAttention(Module):
         to_out_bias = True,
         device = None,
         dtype = "float32",
+        fused = True,
         return_out_only=False
     ):
 
@@ -172,6 +162,7 @@ class DeformableAttention(Module):
 
         self.device = device
         self.dtype = dtype
+        self.fused = fused
 
         offset_scale = default(offset_scale, downsample_factor)
         assert offset_kernel_size >= downsample_factor, 'offset kernel size must be greater than or equal to the downsample factor'
@@ -218,45 +209,15 @@ class DeformableAttention(Module):
 
     def matmul(self, a, b_transpose):
         """
-        batched matrix multiplication;
+        batched matrix multiplication a @ b_transpose^T over the last two axes;
         """
-        a_shape = (*a.shape[:-1], 1, *a.shape[-1:])
-        a = a.reshape(a_shape)
-
-        b_transpose_shape = (*b_transpose.shape[:-2], 1, *b_transpose.shape[-2:])
-        b_transpose = b_transpose.reshape(b_transpose_shape)
-
-        broadcast_shape = list(a_shape)
-        broadcast_shape[-2] = b_transpose_shape[-2]
-        a = a.broadcast_to(broadcast_shape)
-
-        broadcast_shape = list(b_transpose_shape)
-        broadcast_shape[-3] = a_shape[-3]
-        b_transpose = b_transpose.broadcast_to(broadcast_shape)
-
-        return (a * b_transpose).sum(len(a.shape) - 1)
+        return ops.bmm(a, b_transpose, transpose_b=True)
 
     def softmax(self, logit):
         """
-        The softmax function; 
+        The softmax function over the last axis, fused in one pass per row;
         """
-        max_val = Tensor(
-            logit.realize_cached_data().max(axis=3),
-            device=logit.device,
-            dtype=logit.dtype,
-            requires_grad=False
-        )
-
-        max_val = max_val.reshape((*logit.shape[:-1], 1))
-        max_val = max_val.broadcast_to(logit.shape)
-
-        probs = ops.exp(logit - max_val)
-
-        denom = probs.sum(axes=3)
-        denom = denom.reshape((*logit.shape[:-1], 1))
-        denom = denom.broadcast_to(logit.shape)
-
-        return probs / denom
+        return ops.softmax(logit, axis=-1)
 
     def forward(
         self,
@@ -322,22 +283,29 @@ class DeformableAttention(Module):
             v = v.reshape((Bin, self.heads, self.dim_head, v_hin*v_win))
             v = v.transpose((2, 3)) #(Bin, self.heads, Win/down_sample_factor*Hin/downsample_factor, self.dim_head)
         
-            # similarity
-            sim = self.matmul(q, k) #(Bin, self.heads, Win*Hin, Win/down_sample_factor*Hin/downsample_factor)
-
             # calculate relative positional encoding
             grid_x = create_grid_like(x) #(2, Hin, Win)
             grid_x_scaled = normalize_grid(grid_x, dim=0, out_dim=2) #(Hin, Win, 2)
             rel_pos_bias, pos_back, bias_back, bias_to, bias_from = self.rel_pos_bias(grid_x_scaled, vgrid_scaled) #(Bin, self.heads, Win*Hin, Win/down_sample_factor*Hin/downsample_factor)
-            sim_broad = ops.broadcast_to(sim, rel_pos_bias.shape) #(Bin, self.heads, Win*Hin, Win/down_sample_factor*Hin/downsample_factor)
-            sim_rel_pos = sim_broad + rel_pos_bias #(Bin, self.heads, Win*Hin, Win/down_sample_factor*Hin/downsample_factor)
-
-            # softmax + dropout
-            attn = self.softmax(sim_rel_pos)
-            attn = self.dropout(attn) #(Bin, self.heads, Win*Hin, Win/down_sample_factor*Hin/downsample_factor) == (b, h, i, j)
 
-            # aggregate and combin heads
-            out = self.matmul(attn, v.transpose((2, 3))) #(Bin, self.heads, Win*Hin, self.dim_head) == (b, h, i, d)
+            # the fused kernel never builds sim / attn, so it is skipped when they are requested
+            fused = self.fused and (self.dropout.p == 0 or not self.training) \
+                and not (return_attn or return_pos_encoding or return_kv_feat)
+            if fused:
+                # q is already scaled; aggregate with the relative position bias added to the scores
+                out = ops.flash_attention(q, k, v, rel_pos_bias) #(Bin, self.heads, Win*Hin, self.dim_head) == (b, h, i, d)
+            else:
+                # similarity
+                sim = self.matmul(q, k) #(Bin, self.heads, Win*Hin, Win/down_sample_factor*Hin/downsample_factor)
+                sim_broad = ops.broadcast_to(sim, rel_pos_bias.shape) #(Bin, self.heads, Win*Hin, Win/down_sample_factor*Hin/downsample_factor)
+                sim_rel_pos = sim_broad + rel_pos_bias #(Bin, self.heads, Win*Hin, Win/down_sample_factor*Hin/downsample_factor)
+
+                # softmax + dropout
+                attn = self.softmax(sim_rel_pos)
+                attn = self.dropout(attn) #(Bin, self.heads, Win*Hin, Win/down_sample_factor*Hin/downsample_factor) == (b, h, i, j)
+
+                # aggregate and combin heads
+                out = ops.bmm(attn, v) #(Bin, self.heads, Win*Hin, self.dim_head) == (b, h, i, d)
             out = out.transpose((2, 3)) #(b, h, d, i)
             out = out.reshape((Bin, self.heads*self.dim_head, Hin, Win)) #(Bin, self.heads*self.dim_head, Hin, Win)
             out = self.to_out(out) #(Bin, Cin, Hin, Win)
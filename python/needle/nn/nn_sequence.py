@@ -390,7 +390,7 @@ class Embedding(Module):
 
     def forward(self, x: Tensor) -> Tensor:
         """
-        Maps word indices to one-hot vectors, and projects to embedding vectors
+        Maps word indices to embedding vectors (a row lookup in weight)
 
         Input:
         x of shape (seq_len, bs)
@@ -399,10 +399,5 @@ class Embedding(Module):
         output of shape (seq_len, bs, embedding_dim)
         """
         ### BEGIN YOUR SOLUTION
-        seq_len, bs = x.shape
-        x_one_hot = init.one_hot(self.num_embeddings, x, device=self.device, dtype=self.dtype, requires_grad=True) #(seq_len, bs, num_embeddings)
-        x_one_hot_reshape = ops.reshape(x_one_hot, (seq_len*bs, self.num_embeddings))
-        x_embedding = x_one_hot_reshape @ self.weight # (seq_len*bs, embedding_dim)
-        x_embedding_reshape = ops.reshape(x_embedding, (seq_len, bs, self.embedding_dim))
-        return x_embedding_reshape
+        return ops.gather(self.weight, x, axis=0)  # rows of weight, (seq_len, bs, embedding_dim)
         ### END YOUR SOLUTION
\ No newline at end of file
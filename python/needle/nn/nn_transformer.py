@@ -26,6 +26,7 @@ class MultiHeadAttention(Module):
         *,
         dropout = 0.,
         causal = False,
+        fused = False,
         device = None,
         dtype = "float32",
     ):
@@ -36,6 +37,7 @@ class MultiHeadAttention(Module):
         self.dtype = dtype
 
         self.causal = causal
+        self.fused = fused
         self.dropout = Dropout(dropout)
 
     def create_causal_mask(self, i, j, device):
@@ -50,45 +52,15 @@ class MultiHeadAttention(Module):
 
     def matmul(self, a, b_transpose):
         """
-        batched matrix multiplication;
+        batched matrix multiplication a @ b_transpose^T over the last two axes;
         """
-        a_shape = (*a.shape[:-1], 1, *a.shape[-1:])
-        a = a.reshape(a_shape)
-
-        b_transpose_shape = (*b_transpose.shape[:-2], 1, *b_transpose.shape[-2:])
-        b_transpose = b_transpose.reshape(b_transpose_shape)
-
-        broadcast_shape = list(a_shape)
-        broadcast_shape[-2] = b_transpose_shape[-2]
-        a = a.broadcast_to(broadcast_shape)
-
-        broadcast_shape = list(b_transpose_shape)
-        broadcast_shape[-3] = a_shape[-3]
-        b_transpose = b_transpose.broadcast_to(broadcast_shape)
-
-        return (a * b_transpose).sum(len(a.shape) - 1)
+        return ops.bmm(a, b_transpose, transpose_b=True)
 
     def softmax(self, logit):
         """
-        The softmax function; 
+        The softmax function over the last axis, fused in one pass per row;
         """
-        max_val = Tensor(
-            logit.realize_cached_data().max(axis=3),
-            device=logit.device,
-            dtype=logit.dtype,
-            requires_grad=False
-        )
-
-        max_val = max_val.reshape((*logit.shape[:-1], 1))
-        max_val = max_val.broadcast_to(logit.shape)
-
-        probs = ops.exp(logit - max_val)
-
-        denom = probs.sum(axes=3)
-        denom = denom.reshape((*logit.shape[:-1], 1))
-        denom = denom.broadcast_to(logit.shape)
-
-        return probs / denom
+        return ops.softmax(logit, axis=-1)
 
     def forward(
         self,
@@ -98,6 +70,8 @@ class MultiHeadAttention(Module):
         The forward function of the MultiHeadAttention activation function.
         Input: three states q, k, v, with shape (batch_size, num_head, seq_len, dim_head)
         Output: the activation output `result` and attention softmax probability `probs` (with dropout applied)
+                When `fused` is set and dropout is inactive, `result` comes from the fused attention kernel
+                and `probs` is None.
         """
         batch_size, num_head, queries_len, q_dim = q.shape
         _, _, keys_values_len, k_dim = k.shape
@@ -108,6 +82,10 @@ class MultiHeadAttention(Module):
         result = None
         probs = None
 
+        if self.fused and (self.dropout.p == 0 or not self.training):
+            result = ops.flash_attention(q, k, v, scale=1 / np.sqrt(q_dim), causal=self.causal)
+            return result, probs
+
         ### BEGIN YOUR SOLUTION
         # Compute scaled dot-product attention scores
         attn_scores = self.matmul(q, k) / np.sqrt(q_dim)
@@ -125,7 +103,7 @@ class MultiHeadAttention(Module):
         probs = self.dropout(probs)
     
         # Compute the final output
-        result = self.matmul(probs, v.transpose((2, 3)))
+        result = ops.bmm(probs, v)
         ### END YOUR SOLUTION
 
         return result, probs
@@ -187,8 +165,9 @@ class AttentionLayer(Module):
             v_features, inner_dim, bias=False,
             device=device, dtype=dtype)
 
+        # the layer only needs the attention output, so the fused kernel can be used
         self.attn = MultiHeadAttention(
-            dropout=dropout, causal=causal,
+            dropout=dropout, causal=causal, fused=True,
             device=device, dtype=dtype)
 
         self.out_projection = Linear(
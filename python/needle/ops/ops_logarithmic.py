@@ -19,20 +19,84 @@ def restoreShape(input_shape, input_axes):
             restore_shape[input_axes] = 1
     return restore_shape
 
+class Softmax(TensorOp):
+    """Softmax along axis; the CPU backend makes one fused pass per row."""
+    def __init__(self, axis: int = -1):
+        self.axis = axis
+
+    def compute(self, Z):
+        return Z.softmax(axis=self.axis)
+
+    def gradient(self, out_grad, node):
+        return SoftmaxBackward(self.axis, False)(out_grad, node)
+
+
+def softmax(a, axis=-1):
+    return Softmax(axis)(a)
+
+
 class LogSoftmax(TensorOp):
+    def __init__(self, axis: int = -1):
+        self.axis = axis
+
     def compute(self, Z):
         ### BEGIN YOUR SOLUTION
-        raise NotImplementedError()
+        return Z.softmax(axis=self.axis, log=True)
         ### END YOUR SOLUTION
 
     def gradient(self, out_grad, node):
         ### BEGIN YOUR SOLUTION
-        raise NotImplementedError()
+        return SoftmaxBackward(self.axis, True)(out_grad, node)
         ### END YOUR SOLUTION
 
 
-def logsoftmax(a):
-    return LogSoftmax()(a)
+def logsoftmax(a, axis=-1):
+    return LogSoftmax(axis)(a)
+
+
+class SoftmaxBackward(TensorOp):
+    """Input gradient of Softmax / LogSoftmax from the output gradient and the forward output."""
+    def __init__(self, axis: int, log: bool):
+        self.axis = axis
+        self.log = log
+
+    def compute(self, out_grad, out):
+        return out_grad.softmax_backward(out, axis=self.axis, log=self.log)
+
+    def gradient(self, out_grad, node):
+        raise NotImplementedError
+
+
+class SoftmaxCrossEntropy(TensorOp):
+    """Mean cross-entropy of softmax(logits) over the last axis against integer class labels, in one
+    pass per row; the gradient with respect to the logits is produced alongside the loss and kept
+    for the backward pass. The labels are not differentiable."""
+    def __init__(self):
+        self.grad = None
+
+    def compute(self, logits, labels):
+        loss, self.grad = logits.softmax_cross_entropy(labels)
+        return loss
+
+    def gradient(self, out_grad, node):
+        return SoftmaxCrossEntropyBackward(self.grad)(out_grad), init.zeros_like(node.inputs[1])
+
+
+def softmax_cross_entropy(logits, labels):
+    return SoftmaxCrossEntropy()(logits, labels)
+
+
+class SoftmaxCrossEntropyBackward(TensorOp):
+    """Logits gradient of SoftmaxCrossEntropy: the gradient saved by the forward pass scaled by the
+    (1,) output gradient of the loss."""
+    def __init__(self, grad):
+        self.grad = grad
+
+    def compute(self, out_grad):
+        return self.grad * out_grad.reshape((1,) * self.grad.ndim).broadcast_to(self.grad.shape)
+
+    def gradient(self, out_grad, node):
+        raise NotImplementedError
 
 
 class LogSumExp(TensorOp):
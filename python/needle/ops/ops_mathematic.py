@@ -31,21 +31,13 @@ def setToOriginalShape(var, dvar):
 
     extra_dims = new_ndim - original_ndim
     if extra_dims > 0:
-        #summed = dvar.sum(axes=tuple(range(extra_dims)))
-        extra_axes = tuple(range(extra_dims))
-        summed = None
-        if extra_axes is None:
-            summed =  dvar.sum(axis = None)
-        elif isinstance(extra_axes, int) or (isinstance(extra_axes, (list, tuple)) and len(extra_axes) == 1):
-            return dvar.sum(extra_axes)
-        else:
-            for axis in reversed(sorted(extra_axes)):
-                summed = dvar.sum(axis = axis)
-        dvar = reduceSameShape(var, summed)
-        return dvar.reshape(var.shape)
-    else:
-        dvar = reduceSameShape(var, dvar)
-        return dvar
+        # leading broadcast dims and stretched size-1 dims are summed in a single reduction
+        reduced_dim = list(range(extra_dims))
+        for i in range(original_ndim):
+            if var.shape[i] != dvar.shape[extra_dims + i]:
+                reduced_dim.append(extra_dims + i)
+        return summation(dvar, tuple(reduced_dim)).reshape(var.shape)
+    return reduceSameShape(var, dvar)
 
 
 class EWiseAdd(TensorOp):
@@ -274,14 +266,9 @@ class Summation(TensorOp):
 
     def compute(self, a):
         ### BEGIN YOUR SOLUTION
-        if self.axes is None:
-            return a.sum(axis = None)
-        elif isinstance(self.axes, int) or (isinstance(self.axes, (list, tuple)) and len(self.axes) == 1):
-            return a.sum(self.axes)
-        else:
-            for axis in reversed(sorted(self.axes)):
-                a = a.sum(axis = axis)
-            return a        
+        if isinstance(self.axes, (list, tuple)) and len(self.axes) == 0:
+            return a
+        return a.sum(axis = self.axes)
         ### END YOUR SOLUTION
 
     def gradient(self, out_grad, node):
@@ -338,6 +325,45 @@ def matmul(a, b):
     return MatMul()(a, b)
 
 
+class BatchMatMul(TensorOp):
+    """op(a) @ op(b) over the last two axes, where op() optionally transposes
+    them; leading axes are batch axes and broadcast against each other."""
+    def __init__(self, transpose_a=False, transpose_b=False):
+        self.transpose_a = transpose_a
+        self.transpose_b = transpose_b
+
+    def compute(self, a, b):
+        return a.bmm(b, transpose_a=self.transpose_a, transpose_b=self.transpose_b)
+
+    def gradient(self, out_grad, node):
+        a, b = node.inputs
+        ta, tb = self.transpose_a, self.transpose_b
+        if ta:
+            da = bmm(b, out_grad, transpose_a=tb, transpose_b=True)
+        else:
+            da = bmm(out_grad, b, transpose_a=False, transpose_b=not tb)
+        if tb:
+            db = bmm(out_grad, a, transpose_a=True, transpose_b=ta)
+        else:
+            db = bmm(a, out_grad, transpose_a=not ta, transpose_b=False)
+        return reduceBatchShape(a, da), reduceBatchShape(b, db)
+
+
+def reduceBatchShape(var, dvar):
+    """Sum a batched gradient back over the batch axes `var` was broadcast along."""
+    if dvar.shape == var.shape:
+        return dvar
+    extra_dims = len(dvar.shape) - len(var.shape)
+    axes = tuple(range(extra_dims)) + tuple(
+        i + extra_dims for i, s in enumerate(var.shape[:-2]) if s != dvar.shape[i + extra_dims]
+    )
+    return summation(dvar, axes).reshape(var.shape)
+
+
+def bmm(a, b, transpose_a=False, transpose_b=False):
+    return BatchMatMul(transpose_a, transpose_b)(a, b)
+
+
 class Negate(TensorOp):
     def compute(self, a):
         ### BEGIN YOUR SOLUTION
@@ -441,6 +467,28 @@ def tanh(a):
     return Tanh()(a)
 
 
+class GELU(TensorOp):
+    """GELU with the tanh approximation, as one elementwise kernel."""
+    def compute(self, a):
+        return a.gelu()
+
+    def gradient(self, out_grad, node):
+        return GELUBackward()(out_grad, node.inputs[0])
+
+
+def gelu(a):
+    return GELU()(a)
+
+
+class GELUBackward(TensorOp):
+    """Input gradient of GELU from the output gradient and the forward input."""
+    def compute(self, out_grad, a):
+        return a.gelu_grad(out_grad)
+
+    def gradient(self, out_grad, node):
+        raise NotImplementedError
+
+
 class Stack(TensorOp):
     def __init__(self, axis: int):
         """
@@ -624,58 +672,45 @@ def undilate(a, axes, dilation):
 
 
 class Conv(TensorOp):
-    def __init__(self, stride: Optional[int] = 1, padding: Optional[int] = 0):
+    def __init__(self, stride: Optional[int] = 1, padding: Optional[int] = 0, groups: Optional[int] = 1):
         self.stride = stride
         self.padding = padding
+        self.groups = groups
 
-    def compute(self, A, B):
+    def compute(self, A, B, bias=None):
         ### BEGIN YOUR SOLUTION
-        A_pad = A.pad(((0, 0), (self.padding, self.padding), (self.padding, self.padding), (0, 0)))
-        N, H, W, C_in  = A_pad.shape #N x H x W x C_in
-        K, _, _, C_out = B.shape #K x K x C_in x C_out
-        Ns, Hs, Ws, Cs = A_pad.strides
-
-        inner_dim = K*K*C_in
-        H_out = (H-K+1)//self.stride
-        W_out = (W-K+1)//self.stride
-        A_stride = A_pad.as_strided(shape   = (N , H_out         , W_out         , K , K , C_in),
-                                    strides = (Ns, Hs*self.stride, Ws*self.stride, Hs, Ws, Cs  )).compact().reshape((N*H_out*W_out, inner_dim))
-        B_reshape = B.compact().reshape((inner_dim, C_out)) 
-        out = A_stride @ B_reshape
-        return out.compact().reshape((N, H_out, W_out, C_out))
+        # NHWC input, K x K x (C_in / groups) x C_out filter; the optional bias is added inside the kernel
+        return A.conv2d(B, bias=bias, stride=self.stride, padding=self.padding, groups=self.groups)
         ### END YOUR SOLUTION
 
     def gradient(self, out_grad, node):
         ### BEGIN YOUR SOLUTION
-        X = node.inputs[0] #A, N x H x W x C_in
-        W = node.inputs[1] #B, K x K x C_in x C_out
-        K, K_, C_in, C_out = W.shape
-        P = self.padding
-
-        #------------------ Grad X---------------------#
-        # Dilate
-        out_grad = dilate(out_grad, axes=(1, 2), dilation=self.stride-1) #N x (H+2P-K+1) x (W+2P-K+1) x C_out 
-
-        # Flip the kernel vertically and horizontally
-        W_kernel_flip = flip(W, (0, 1)) # K x K x C_in x C_out
-        W_trans       = transpose(W_kernel_flip, (2, 3)) # K x K x C_out x C_in
-
-        # Convolution: gradient of X = out_grad @ W.T
-        grad_X = conv(out_grad, W_trans, stride=1, padding=K-1-P)
-        #------------------ Grad W---------------------#
-        # Make summation along Batches: N
-        X_trans = transpose(X, (0, 3)) # C_in x H x W x N
-        out_grad_trans = transpose(transpose(out_grad, (0, 1)), (1, 2)) # (H+2P-K+1) x (W+2P-K+1) x N x C_out
-
-        # Convolution: gradient of W = X.T @ out_grad
-        grad_W_trans = conv(X_trans, out_grad_trans, stride=1, padding=self.padding) # C_in x K x K x C_out
-        grad_W = transpose(transpose(grad_W_trans, (0, 1)), (1, 2)) #K x K x C_in x C_out
+        grad_X, grad_W = tuple(ConvBackward(self.stride, self.padding, self.groups)(out_grad, node.inputs[0], node.inputs[1]))
+        if len(node.inputs) == 3:
+            return grad_X, grad_W, summation(out_grad, axes=(0, 1, 2))
         return grad_X, grad_W
         ### END YOUR SOLUTION
 
 
-def conv(a, b, stride=1, padding=1):
-    return Conv(stride, padding)(a, b)
+class ConvBackward(TensorTupleOp):
+    """(grad_X, grad_W) of Conv for an output gradient; the CPU backend
+    computes both directly instead of through dilate / flip / conv."""
+    def __init__(self, stride: int, padding: int, groups: int = 1):
+        self.stride = stride
+        self.padding = padding
+        self.groups = groups
+
+    def compute(self, out_grad, A, B):
+        return out_grad.conv2d_backward(A, B, stride=self.stride, padding=self.padding, groups=self.groups)
+
+    def gradient(self, out_grad, node):
+        raise NotImplementedError
+
+
+def conv(a, b, stride=1, padding=1, bias=None, groups=1):
+    if bias is not None:
+        return Conv(stride, padding, groups)(a, b, bias)
+    return Conv(stride, padding, groups)(a, b)
 
 class Sign(TensorOp):
     def compute(self, a):
@@ -709,3 +744,86 @@ def abs(a):
     return Abs()(a)
 
 
+
+class Argmax(TensorOp):
+    """Index of the largest element along axis (of the flattened input for axis=None), as
+    float32. Not differentiable."""
+    def __init__(self, axis: Optional[int] = None, keepdims: bool = False):
+        self.axis = axis
+        self.keepdims = keepdims
+
+    def compute(self, a):
+        return a.argmax(axis=self.axis, keepdims=self.keepdims)
+
+    def gradient(self, out_grad, node):
+        return init.zeros_like(node.inputs[0])
+
+def argmax(a, axis=None, keepdims=False):
+    return Argmax(axis, keepdims)(a)
+
+class Argmin(TensorOp):
+    """Index of the smallest element along axis (of the flattened input for axis=None), as
+    float32. Not differentiable."""
+    def __init__(self, axis: Optional[int] = None, keepdims: bool = False):
+        self.axis = axis
+        self.keepdims = keepdims
+
+    def compute(self, a):
+        return a.argmin(axis=self.axis, keepdims=self.keepdims)
+
+    def gradient(self, out_grad, node):
+        return init.zeros_like(node.inputs[0])
+
+def argmin(a, axis=None, keepdims=False):
+    return Argmin(axis, keepdims)(a)
+
+class TopK(TensorTupleOp):
+    """(values, indices) of the k largest (or smallest) elements along axis, in rank order.
+    Not differentiable."""
+    def __init__(self, k: int, axis: int = -1, largest: bool = True):
+        self.k = k
+        self.axis = axis
+        self.largest = largest
+
+    def compute(self, a):
+        return a.topk(self.k, axis=self.axis, largest=self.largest)
+
+    def gradient(self, out_grad, node):
+        return init.zeros_like(node.inputs[0])
+
+def topk(a, k, axis=-1, largest=True):
+    return TopK(k, axis, largest)(a)
+
+class Gather(TensorOp):
+    """Slices of a at the integer positions index along axis (numpy.take); the result has shape
+    a.shape[:axis] + index.shape + a.shape[axis + 1:]. The index is not differentiable."""
+    def __init__(self, axis: int = 0):
+        self.axis = axis
+
+    def compute(self, a, index):
+        return a.gather(index, axis=self.axis)
+
+    def gradient(self, out_grad, node):
+        a, index = node.inputs
+        axis = self.axis % len(a.shape)
+        return scatter_add(out_grad, index, a.shape[axis], axis), init.zeros_like(index)
+
+def gather(a, index, axis=0):
+    return Gather(axis)(a, index)
+
+class ScatterAdd(TensorOp):
+    """Adjoint of Gather: adds the slices of src into a zero array of length size along axis, at
+    the positions in index. The index is not differentiable."""
+    def __init__(self, size: int, axis: int = 0):
+        self.size = size
+        self.axis = axis
+
+    def compute(self, src, index):
+        return src.scatter_add(index, self.size, axis=self.axis)
+
+    def gradient(self, out_grad, node):
+        index = node.inputs[1]
+        return gather(out_grad, index, self.axis), init.zeros_like(index)
+
+def scatter_add(src, index, size, axis=0):
+    return ScatterAdd(size, axis)(src, index)
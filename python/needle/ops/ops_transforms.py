@@ -7,6 +7,7 @@ from ..autograd import TensorTuple, TensorTupleOp
 
 from ..backend_selection import array_api, BACKEND
 from .ops_tuple import *
+from .ops_mathematic import summation
 
 class GridSample(TensorOp):
     def __init__(self, mode: str, padding_mode: str, align_corners: bool):
@@ -38,4 +39,72 @@ class GridSampleBackward(TensorTupleOp):
         raise NotImplementedError
 
 def grid_sample_backward(out_grad, a, grid, mode='bilinear', padding_mode='zeros', align_corners=False):
-    return GridSampleBackward(mode, padding_mode, align_corners)(out_grad, a, grid)
\ No newline at end of file
+    return GridSampleBackward(mode, padding_mode, align_corners)(out_grad, a, grid)
+
+class FlashAttention(TensorOp):
+    """softmax(q @ k^T * scale + bias) @ v over the last two axes, with an
+    optional additive bias and causal mask; the score matrix is never built
+    on the CPU backend."""
+    def __init__(self, scale: float, causal: bool):
+        self.scale = scale
+        self.causal = causal
+        self.lse = None
+    def compute(self, q: NDArray, k: NDArray, v: NDArray, bias: NDArray = None):
+        out, self.lse = q.flash_attention(k, v, bias, scale=self.scale, causal=self.causal)
+        return out
+    def gradient(self, out_grad: Tensor, node: Tensor):
+        grads = tuple(FlashAttentionBackward(self.scale, self.causal, self.lse)(out_grad, node, *node.inputs))
+        if len(node.inputs) == 4 and grads[3].shape != node.inputs[3].shape:
+            # the kernels sum the bias gradient over shared leading batch axes only; sum it over
+            # the remaining broadcast axes (size-1 query / key axes or inner batch axes)
+            bias = node.inputs[3]
+            extra_dims = len(grads[3].shape) - len(bias.shape)
+            axes = tuple(range(extra_dims)) + tuple(
+                i + extra_dims for i, s in enumerate(bias.shape) if s != grads[3].shape[i + extra_dims])
+            grads = grads[:3] + (summation(grads[3], axes).reshape(bias.shape),)
+        return grads
+
+def flash_attention(q, k, v, bias=None, scale=1.0, causal=False):
+    if bias is None:
+        return FlashAttention(scale, causal)(q, k, v)
+    return FlashAttention(scale, causal)(q, k, v, bias)
+
+
+class FlashAttentionBackward(TensorTupleOp):
+    def __init__(self, scale: float, causal: bool, lse: NDArray):
+        self.scale = scale
+        self.causal = causal
+        self.lse = lse
+    def compute(self, out_grad: NDArray, out: NDArray, q: NDArray, k: NDArray, v: NDArray, bias: NDArray = None):
+        return out_grad.flash_attention_backward(q, k, v, bias, out, self.lse, scale=self.scale, causal=self.causal)
+    def gradient(self, out_grad: Tensor, node: Tensor):
+        raise NotImplementedError
+
+
+class LayerNorm(TensorOp):
+    """Normalization over the last axis followed by weight * x + bias (shape[-1] elements each),
+    as one kernel; the row means and inverse standard deviations are kept for the backward pass."""
+    def __init__(self, eps: float):
+        self.eps = eps
+        self.mean = None
+        self.rstd = None
+    def compute(self, x: NDArray, weight: NDArray, bias: NDArray):
+        out, self.mean, self.rstd = x.layer_norm(weight, bias, eps=self.eps)
+        return out
+    def gradient(self, out_grad: Tensor, node: Tensor):
+        x, weight, bias = node.inputs
+        x_grad, weight_grad, bias_grad = tuple(LayerNormBackward(self.mean, self.rstd)(out_grad, x, weight))
+        return x_grad, weight_grad, bias_grad.reshape(bias.shape)
+
+def layer_norm(x, weight, bias, eps=1e-5):
+    return LayerNorm(eps)(x, weight, bias)
+
+
+class LayerNormBackward(TensorTupleOp):
+    def __init__(self, mean: NDArray, rstd: NDArray):
+        self.mean = mean
+        self.rstd = rstd
+    def compute(self, out_grad: NDArray, x: NDArray, weight: NDArray):
+        return out_grad.layer_norm_backward(x, weight, self.mean, self.rstd)
+    def gradient(self, out_grad: Tensor, node: Tensor):
+        raise NotImplementedError
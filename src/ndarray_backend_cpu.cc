@@ -2,9 +2,26 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
+#if defined(__x86_64__) || defined(_M_X64)
+#define NEEDLE_X86 1
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 
 namespace needle {
 namespace cpu {
@@ -41,19 +58,512 @@ struct AlignedArray {
   size_t size;
 };
 
+/**
+ * Persistent thread pool shared by all kernels in this backend.
+ *
+ * Workers are started once and sleep on a condition variable between jobs.  ParallelFor splits an
+ * index range into contiguous chunks of at least `grain` indices, hands them out through an atomic
+ * counter, and runs chunks on the calling thread as well, so a pool of N threads uses N - 1
+ * workers.  Calls made from inside a running job execute serially, which keeps nested kernels
+ * (e.g. a GEMM issued per batch element) from oversubscribing the machine.
+ */
+#define PARALLEL_GRAIN 32768        // elements per task for memory-bound loops
+#define PARALLEL_GRAIN_HEAVY 4096   // elements per task for transcendental / gather loops
+
+class ThreadPool {
+ public:
+  static ThreadPool& Instance() {
+    static ThreadPool pool;
+    return pool;
+  }
+
+  size_t NumThreads() const { return num_threads_; }
+
+  void SetNumThreads(size_t n) {
+    if (n == 0) n = DefaultNumThreads();
+    if (n == num_threads_) return;
+    StopWorkers();
+    num_threads_ = n;
+    StartWorkers();
+  }
+
+  void ParallelFor(size_t begin, size_t end, size_t grain,
+                   const std::function<void(size_t, size_t)>& fn) {
+    if (end <= begin) return;
+    size_t total = end - begin;
+    grain = std::max<size_t>(grain, 1);
+    size_t num_chunks = std::min(num_threads_, (total + grain - 1) / grain);
+    if (num_chunks <= 1 || in_parallel_region_) {
+      fn(begin, end);
+      return;
+    }
+
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->fn = &fn;
+    job->begin = begin;
+    job->end = end;
+    job->chunk = (total + num_chunks - 1) / num_chunks;
+    job->num_chunks = (total + job->chunk - 1) / job->chunk;
+    job->next = 0;
+    job->done = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job_ = job;
+      ++generation_;
+    }
+    wake_.notify_all();
+
+    RunChunks(job.get());
+    {
+      std::unique_lock<std::mutex> lock(job->mutex);
+      job->finished.wait(lock, [&] { return job->done == job->num_chunks; });
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (job_ == job) job_.reset();
+  }
+
+ private:
+  struct Job {
+    const std::function<void(size_t, size_t)>* fn;
+    size_t begin, end, chunk, num_chunks;
+    std::atomic<size_t> next;
+    size_t done;
+    std::mutex mutex;
+    std::condition_variable finished;
+  };
+
+  ThreadPool() : num_threads_(DefaultNumThreads()), generation_(0), stop_(false) { StartWorkers(); }
+  ~ThreadPool() { StopWorkers(); }
+
+  static size_t DefaultNumThreads() {
+    const char* env = std::getenv("NEEDLE_NUM_THREADS");
+    if (env != nullptr && std::atoi(env) > 0) return std::atoi(env);
+    return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  }
+
+  static void RunChunks(Job* job) {
+    bool outer = in_parallel_region_;
+    in_parallel_region_ = true;
+    size_t finished = 0;
+    for (size_t c = job->next++; c < job->num_chunks; c = job->next++) {
+      size_t lo = job->begin + c * job->chunk;
+      size_t hi = std::min(job->end, lo + job->chunk);
+      (*job->fn)(lo, hi);
+      ++finished;
+    }
+    in_parallel_region_ = outer;
+    if (finished > 0) {
+      std::lock_guard<std::mutex> lock(job->mutex);
+      job->done += finished;
+      if (job->done == job->num_chunks) job->finished.notify_all();
+    }
+  }
+
+  void WorkerLoop() {
+    uint64_t seen = 0;
+    while (true) {
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+        if (stop_) return;
+        seen = generation_;
+        job = job_;
+      }
+      if (job) RunChunks(job.get());
+    }
+  }
+
+  void StartWorkers() {
+    stop_ = false;
+    for (size_t i = 1; i < num_threads_; ++i) workers_.emplace_back(&ThreadPool::WorkerLoop, this);
+  }
+
+  void StopWorkers() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& t : workers_) t.join();
+    workers_.clear();
+  }
+
+  size_t num_threads_;
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::shared_ptr<Job> job_;
+  uint64_t generation_;
+  bool stop_;
+  static thread_local bool in_parallel_region_;
+};
+
+thread_local bool ThreadPool::in_parallel_region_ = false;
+
+inline void ParallelFor(size_t begin, size_t end, size_t grain,
+                        const std::function<void(size_t, size_t)>& fn) {
+  ThreadPool::Instance().ParallelFor(begin, end, grain, fn);
+}
+
+void SetNumThreads(size_t n) {
+  /**
+   * Resize the backend thread pool; n == 0 restores the default (NEEDLE_NUM_THREADS or the number
+   * of hardware threads).
+   */
+  ThreadPool::Instance().SetNumThreads(n);
+}
+
+size_t GetNumThreads() { return ThreadPool::Instance().NumThreads(); }
+
 
 
 void Fill(AlignedArray* out, scalar_t val) {
   /**
    * Fill the values of an aligned array with val
    */
-  for (int i = 0; i < out->size; i++) {
-    out->ptr[i] = val;
+  ParallelFor(0, out->size, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+    std::fill(out->ptr + begin, out->ptr + end, val);
+  });
+}
+
+/**
+ * Counter-based random numbers (Philox4x32-10, Salmon et al., SC'11).
+ *
+ * Every random stream has a 64-bit seed (the Philox key) and a 64-bit offset; block j of a draw
+ * hashes the counter (offset + j, stream id) and yields the four values for elements 4j .. 4j + 3.
+ * Blocks are generated PHILOX_LANES at a time.
+ * Values therefore depend only on (seed, stream, offset, element index), so fills run in parallel
+ * and give the same result for any number of threads.  Each draw advances its stream's offset by
+ * the number of blocks it used.
+ *
+ * The generator is opt-in: device.rand / randn / randb keep drawing from np.random (so
+ * np.random.seed still governs weight init and dropout) until native random numbers are turned on
+ * with set_native_random, set_random_seed or NEEDLE_RANDOM_SEED, or a stream is passed explicitly.
+ */
+#define PHILOX_LANES 16
+
+inline void PhiloxLanes(uint64_t counter, uint64_t stream, uint64_t seed, uint32_t* out) {
+  /**
+   * Philox4x32-10 of the PHILOX_LANES counters (counter + i, stream) under the key seed; word t of
+   * lane i goes to out[4 * i + t].  The lanes are independent, so each round vectorizes.
+   */
+  uint32_t c0[PHILOX_LANES], c1[PHILOX_LANES], c2[PHILOX_LANES], c3[PHILOX_LANES];
+  for (int i = 0; i < PHILOX_LANES; ++i) {
+    c0[i] = (uint32_t)(counter + i);
+    c1[i] = (uint32_t)((counter + i) >> 32);
+    c2[i] = (uint32_t)stream;
+    c3[i] = (uint32_t)(stream >> 32);
+  }
+  uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+  for (int round = 0; round < 10; ++round) {
+    for (int i = 0; i < PHILOX_LANES; ++i) {
+      uint64_t p0 = (uint64_t)0xD2511F53u * c0[i];
+      uint64_t p1 = (uint64_t)0xCD9E8D57u * c2[i];
+      uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1[i] ^ k0;
+      uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3[i] ^ k1;
+      c1[i] = (uint32_t)p1;
+      c3[i] = (uint32_t)p0;
+      c0[i] = n0;
+      c2[i] = n2;
+    }
+    k0 += 0x9E3779B9u;
+    k1 += 0xBB67AE85u;
+  }
+  for (int i = 0; i < PHILOX_LANES; ++i) {
+    out[4 * i] = c0[i];
+    out[4 * i + 1] = c1[i];
+    out[4 * i + 2] = c2[i];
+    out[4 * i + 3] = c3[i];
+  }
+}
+
+struct RandomStream {
+  uint64_t seed;
+  uint64_t offset;
+};
+
+uint64_t DefaultRandomSeed() {
+  const char* env = std::getenv("NEEDLE_RANDOM_SEED");
+  return env != nullptr ? std::strtoull(env, nullptr, 10) : 0;
+}
+
+uint64_t random_seed = DefaultRandomSeed();
+bool native_random = std::getenv("NEEDLE_RANDOM_SEED") != nullptr;
+std::map<uint64_t, RandomStream> random_streams;
+std::mutex random_mutex;
+
+void SetRandomSeed(uint64_t seed) {
+  /**
+   * Reseed every random stream with seed, rewind it, and turn native random numbers on.
+   * NEEDLE_RANDOM_SEED does the same when the module is loaded.
+   */
+  std::lock_guard<std::mutex> lock(random_mutex);
+  random_seed = seed;
+  random_streams.clear();
+  native_random = true;
+}
+
+uint64_t GetRandomSeed() { return random_seed; }
+
+void SetNativeRandom(bool enabled) {
+  /**
+   * Make device.rand / randn / randb draw from the streams here (true) or from np.random (false,
+   * the default).
+   */
+  native_random = enabled;
+}
+
+bool GetNativeRandom() { return native_random; }
+
+void SeedRandomStream(uint64_t stream, uint64_t seed) {
+  /**
+   * Give one random stream its own seed and rewind it; the other streams are unaffected.
+   */
+  std::lock_guard<std::mutex> lock(random_mutex);
+  random_streams[stream] = RandomStream{seed, 0};
+}
+
+void RandomFill(AlignedArray* out, const std::string& dist, scalar_t a, scalar_t b, uint64_t stream) {
+  /**
+   * Fill out with the next out->size draws of a random stream.
+   *
+   * Args:
+   *   dist: "uniform" (in [a, b)), "normal" (mean a, standard deviation b, by Box-Muller on pairs
+   *         of uniforms) or "bernoulli" (b with probability a, else 0)
+   *   stream: id of the stream to draw from; streams that were never seeded use the global seed
+   */
+  int kind = dist == "uniform" ? 0 : dist == "normal" ? 1 : dist == "bernoulli" ? 2 : -1;
+  if (kind < 0) throw std::invalid_argument("unknown distribution: " + dist);
+  size_t blocks = (out->size + 3) / 4;
+  uint64_t seed, offset;
+  {
+    std::lock_guard<std::mutex> lock(random_mutex);
+    auto it = random_streams.find(stream);
+    if (it == random_streams.end()) it = random_streams.emplace(stream, RandomStream{random_seed, 0}).first;
+    seed = it->second.seed;
+    offset = it->second.offset;
+    it->second.offset += blocks;
+  }
+  ParallelFor(0, (blocks + PHILOX_LANES - 1) / PHILOX_LANES, PARALLEL_GRAIN / (4 * PHILOX_LANES),
+              [&](size_t begin, size_t end) {
+    uint32_t bits[4 * PHILOX_LANES];
+    scalar_t v[4 * PHILOX_LANES];
+    for (size_t g = begin; g < end; ++g) {
+      PhiloxLanes(offset + g * PHILOX_LANES, stream, seed, bits);
+      // 24-bit uniforms in [0, 1)
+      for (int t = 0; t < 4 * PHILOX_LANES; ++t) v[t] = (bits[t] >> 8) * (1.0f / 16777216.0f);
+      if (kind == 0) {
+        for (int t = 0; t < 4 * PHILOX_LANES; ++t) v[t] = a + (b - a) * v[t];
+      } else if (kind == 1) {
+        for (int t = 0; t < 4 * PHILOX_LANES; t += 2) {
+          scalar_t r = std::sqrt(-2.0f * std::log(1.0f - v[t]));
+          scalar_t theta = 6.28318531f * v[t + 1];
+          v[t] = a + b * r * std::cos(theta);
+          v[t + 1] = a + b * r * std::sin(theta);
+        }
+      } else {
+        for (int t = 0; t < 4 * PHILOX_LANES; ++t) v[t] = v[t] < a ? b : 0.0f;
+      }
+      size_t first = g * 4 * PHILOX_LANES;
+      std::memcpy(out->ptr + first, v, std::min<size_t>(4 * PHILOX_LANES, out->size - first) * ELEM_SIZE);
+    }
+  });
+}
+
+/**
+ * Strided iteration engine shared by Compact / *Setitem and the strided elementwise ops.
+ *
+ * StridedShape describes up to two strided operands over a common row-major shape (the compact
+ * side of a copy needs no strides).  Size-1 dimensions are dropped and dimensions that are
+ * contiguous in every operand are merged, so e.g. a slice of whole rows becomes a single run.
+ * StridedBlocks then walks the outer dimensions with an odometer specialized for ranks 1-6 and
+ * hands the innermost dimension to a kernel in blocks, parallelizing over (row, block) pairs.
+ */
+#define STRIDED_MAX_RANK 6
+
+struct StridedShape {
+  StridedShape(const std::vector<int64_t>& shape, const std::vector<int64_t>& strides0,
+               size_t offset0, const std::vector<int64_t>* strides1 = nullptr, size_t offset1 = 0) {
+    offset[0] = offset0;
+    offset[1] = offset1;
+    for (size_t d = 0; d < shape.size(); d++) {
+      if (shape[d] == 1) continue;
+      ptrdiff_t s0 = strides0[d], s1 = strides1 != nullptr ? (*strides1)[d] : 0;
+      if (!dims.empty() && strides[0].back() == s0 * shape[d] && strides[1].back() == s1 * shape[d]) {
+        dims.back() *= shape[d];
+        strides[0].back() = s0;
+        strides[1].back() = s1;
+      } else {
+        dims.push_back(shape[d]);
+        strides[0].push_back(s0);
+        strides[1].push_back(s1);
+      }
+    }
+    if (dims.empty()) {
+      dims.push_back(1);
+      strides[0].push_back(0);
+      strides[1].push_back(0);
+    }
+  }
+
+  size_t Inner() const { return dims.back(); }
+  size_t Rows() const {
+    size_t rows = 1;
+    for (size_t d = 0; d + 1 < dims.size(); d++) rows *= dims[d];
+    return rows;
+  }
+
+  std::vector<size_t> dims;
+  std::vector<ptrdiff_t> strides[2];
+  ptrdiff_t offset[2];
+};
+
+template <int R, typename F>
+void StridedBlocksRange(const StridedShape& s, size_t block, size_t t_begin, size_t t_end, F& fn) {
+  /**
+   * Run fn(out_pos, pos0, pos1, len) for tasks [t_begin, t_end), task t being block t % blocks of
+   * row t / blocks.  R is the number of outer dimensions, or -1 to take it from s at run time.
+   */
+  const size_t nd = R >= 0 ? R : s.dims.size() - 1;
+  size_t idx_fixed[R > 0 ? R : 1];
+  std::vector<size_t> idx_dynamic(R >= 0 ? 0 : nd);
+  size_t* idx = R >= 0 ? idx_fixed : idx_dynamic.data();
+
+  size_t n = s.Inner(), blocks = (n + block - 1) / block;
+  ptrdiff_t si0 = s.strides[0].back(), si1 = s.strides[1].back();
+  size_t row = t_begin / blocks, rem = row;
+  ptrdiff_t pos0 = s.offset[0], pos1 = s.offset[1];
+  for (size_t d = nd; d-- > 0;) {
+    idx[d] = rem % s.dims[d];
+    rem /= s.dims[d];
+    pos0 += (ptrdiff_t)idx[d] * s.strides[0][d];
+    pos1 += (ptrdiff_t)idx[d] * s.strides[1][d];
+  }
+
+  for (size_t t = t_begin; t < t_end; t++) {
+    if (t / blocks != row) {
+      row++;
+      for (size_t d = nd; d-- > 0;) {
+        pos0 += s.strides[0][d];
+        pos1 += s.strides[1][d];
+        if (++idx[d] < s.dims[d]) break;
+        pos0 -= s.strides[0][d] * (ptrdiff_t)s.dims[d];
+        pos1 -= s.strides[1][d] * (ptrdiff_t)s.dims[d];
+        idx[d] = 0;
+      }
+    }
+    size_t j0 = t % blocks * block;
+    fn(row * n + j0, pos0 + (ptrdiff_t)j0 * si0, pos1 + (ptrdiff_t)j0 * si1,
+       std::min(block, n - j0));
+  }
+}
+
+template <typename F>
+void StridedBlocksSerial(const StridedShape& s, size_t block, size_t t_begin, size_t t_end, F& fn) {
+  // StridedBlocksRange with the rank dispatched at run time, on the calling thread.
+  switch (s.dims.size()) {
+    case 1: StridedBlocksRange<0>(s, block, t_begin, t_end, fn); break;
+    case 2: StridedBlocksRange<1>(s, block, t_begin, t_end, fn); break;
+    case 3: StridedBlocksRange<2>(s, block, t_begin, t_end, fn); break;
+    case 4: StridedBlocksRange<3>(s, block, t_begin, t_end, fn); break;
+    case 5: StridedBlocksRange<4>(s, block, t_begin, t_end, fn); break;
+    case STRIDED_MAX_RANK: StridedBlocksRange<STRIDED_MAX_RANK - 1>(s, block, t_begin, t_end, fn); break;
+    default: StridedBlocksRange<-1>(s, block, t_begin, t_end, fn); break;
+  }
+}
+
+template <typename F>
+void StridedBlocks(const StridedShape& s, size_t block, size_t grain, F fn) {
+  /**
+   * Call fn(out_pos, pos0, pos1, len) for every block of at most `block` elements of the inner
+   * dimension, where out_pos is the block's position in compact order and pos0 / pos1 its
+   * positions in the two strided operands (whose inner strides are s.strides[k].back()).  grain
+   * is the minimum number of elements per parallel task.
+   */
+  size_t n = s.Inner();
+  size_t blocks = (n + block - 1) / block;
+  size_t grain_tasks = std::max<size_t>(1, grain / std::min(block, std::max<size_t>(n, 1)));
+  ParallelFor(0, s.Rows() * blocks, grain_tasks, [&](size_t t_begin, size_t t_end) {
+    StridedBlocksSerial(s, block, t_begin, t_end, fn);
+  });
+}
+
+#define COPY_BLOCK 16384  // elements per strided copy call
+#define TRANSPOSE_TILE 32  // tile edge for the blocked transpose path of Compact
+
+bool CompactTransposed(const AlignedArray& a, AlignedArray* out, const StridedShape& s) {
+  /**
+   * Blocked transpose path of Compact, taken when the source is unit-stride along some outer
+   * dimension p of the collapsed shape but not along the inner one.  This covers plain 2-D
+   * transposes as well as NCHW <-> NHWC (which collapse to a batch of (H*W, C) / (C, H*W)
+   * transposes); the remaining dimensions are treated as a batch.  Every task copies a tile of
+   * roughly TRANSPOSE_TILE^2 elements, so the reads (along p) and the writes (along the inner
+   * dimension) both stay within a few dozen cache lines.  Returns false if the path doesn't apply.
+   */
+  size_t nd = s.dims.size();
+  ptrdiff_t col_stride = s.strides[0].back();
+  if (nd < 2 || col_stride == 0 || col_stride == 1) return false;
+  size_t p = nd;
+  for (size_t d = 0; d + 1 < nd; d++) {
+    if (s.strides[0][d] == 1) p = d;
+  }
+  if (p == nd) return false;
+
+  std::vector<size_t> out_strides(nd);
+  size_t acc = 1;
+  for (size_t d = nd; d-- > 0;) {
+    out_strides[d] = acc;
+    acc *= s.dims[d];
   }
+  std::vector<size_t> batch_dims, batch_out;
+  std::vector<ptrdiff_t> batch_strides;
+  size_t batch = 1;
+  for (size_t d = 0; d + 1 < nd; d++) {
+    if (d == p) continue;
+    batch_dims.push_back(s.dims[d]);
+    batch_strides.push_back(s.strides[0][d]);
+    batch_out.push_back(out_strides[d]);
+    batch *= s.dims[d];
+  }
+
+  // Tiles stay square unless one side is short (e.g. 3 input channels), in which case the other
+  // side grows so a task still covers about TRANSPOSE_TILE^2 elements.
+  size_t rows = s.dims[p], cols = s.dims[nd - 1], row_out = out_strides[p];
+  size_t tr = std::min<size_t>(rows, TRANSPOSE_TILE), tc = std::min<size_t>(cols, TRANSPOSE_TILE);
+  if (tr < TRANSPOSE_TILE) {
+    tc = std::min(cols, TRANSPOSE_TILE * TRANSPOSE_TILE / tr);
+  } else if (tc < TRANSPOSE_TILE) {
+    tr = std::min(rows, TRANSPOSE_TILE * TRANSPOSE_TILE / tc);
+  }
+  size_t row_tiles = (rows + tr - 1) / tr, col_tiles = (cols + tc - 1) / tc;
+  size_t grain = std::max<size_t>(1, PARALLEL_GRAIN / (tr * tc));
+
+  ParallelFor(0, batch * row_tiles * col_tiles, grain, [&](size_t begin, size_t end) {
+    for (size_t t = begin; t < end; t++) {
+      size_t b = t / (row_tiles * col_tiles);
+      size_t r0 = t / col_tiles % row_tiles * tr, c0 = t % col_tiles * tc;
+      ptrdiff_t src_pos = s.offset[0];
+      size_t out_pos = 0;
+      for (size_t d = batch_dims.size(); d-- > 0;) {
+        size_t i = b % batch_dims[d];
+        b /= batch_dims[d];
+        src_pos += (ptrdiff_t)i * batch_strides[d];
+        out_pos += i * batch_out[d];
+      }
+      const scalar_t* src = a.ptr + src_pos + r0 + (ptrdiff_t)c0 * col_stride;
+      scalar_t* dst = out->ptr + out_pos + r0 * row_out + c0;
+      size_t nr = std::min(tr, rows - r0), nc = std::min(tc, cols - c0);
+      for (size_t i = 0; i < nr; i++) {
+        for (size_t j = 0; j < nc; j++) dst[i * row_out + j] = src[i + (ptrdiff_t)j * col_stride];
+      }
+    }
+  });
+  return true;
 }
 
-void Compact(const AlignedArray& a, AlignedArray* out, std::vector<int32_t> shape,
-             std::vector<int32_t> strides, size_t offset) {
+void Compact(const AlignedArray& a, AlignedArray* out, std::vector<int64_t> shape,
+             std::vector<int64_t> strides, size_t offset) {
   /**
    * Compact an array in memory
    *
@@ -68,39 +578,24 @@ void Compact(const AlignedArray& a, AlignedArray* out, std::vector<int32_t> shap
    *  void (you need to modify out directly, rather than returning anything; this is true for all the
    *  function will implement here, so we won't repeat this note.)
    */
-  /// BEGIN SOLUTION
-  std::vector<int> shape_dimen_idx(shape.size(), 0);
-
-  int total_element_num = 1;
-  for(int i=0; i<shape.size(); ++i){
-    total_element_num *= shape[i];
-  }
-
-  for (int i=0; i<total_element_num; ++i){
-    long int pos = (long int)(offset);
-    for(int j=0; j<shape.size(); ++j){
-        pos += shape_dimen_idx[j]*strides[j];
-    }
-    out->ptr[i] = a.ptr[pos];
-
-    //Increment the shape_dimen_idx
-    //Do not use size_t type, as it is non-negative type, would wrap around to max positive size_t when k==0 and decrease further 1.
-    for(int k=shape.size()-1; k >= 0; --k){
-      shape_dimen_idx[k]++;
-      if(shape_dimen_idx[k] >= shape[k]){
-        shape_dimen_idx[k] = 0;
-        continue;
-      }else{
-        break;
-      }
+  StridedShape s(shape, strides, offset);
+  if (CompactTransposed(a, out, s)) return;
+  ptrdiff_t inner = s.strides[0].back();
+  StridedBlocks(s, COPY_BLOCK, PARALLEL_GRAIN, [&](size_t i, ptrdiff_t pos, ptrdiff_t, size_t len) {
+    const scalar_t* src = a.ptr + pos;
+    scalar_t* dst = out->ptr + i;
+    if (inner == 1) {
+      std::memcpy(dst, src, len * ELEM_SIZE);
+    } else if (inner == 0) {
+      std::fill(dst, dst + len, *src);
+    } else {
+      for (size_t j = 0; j < len; j++) dst[j] = src[(ptrdiff_t)j * inner];
     }
-  }
-
-  /// END SOLUTION
+  });
 }
 
-void EwiseSetitem(const AlignedArray& a, AlignedArray* out, std::vector<int32_t> shape,
-                  std::vector<int32_t> strides, size_t offset) {
+void EwiseSetitem(const AlignedArray& a, AlignedArray* out, std::vector<int64_t> shape,
+                  std::vector<int64_t> strides, size_t offset) {
   /**
    * Set items in a (non-compact) array
    *
@@ -111,40 +606,21 @@ void EwiseSetitem(const AlignedArray& a, AlignedArray* out, std::vector<int32_t>
    *   strides: strides of the *out* array (not a, which has compact strides)
    *   offset: offset of the *out* array (not a, which has zero offset, being compact)
    */
-
-  /// BEGIN SOLUTION
-  std::vector<int> shape_dimen_idx(shape.size(), 0);
-  int total_element_num = 1;
-  for(int i=0; i<shape.size(); ++i){
-    total_element_num *= shape[i];
-  }
-
-  int cnt = 0;
-  for (int i=0; i<total_element_num; ++i){
-    long int pos = (long int)offset;
-    for(int j=0; j<shape.size(); ++j){
-        pos += shape_dimen_idx[j]*strides[j];
-    }
-    out->ptr[pos] = a.ptr[cnt];
-
-    //Increment the shape_dimen_idx
-    //Do not use size_t type, as it is non-negative type, would wrap around to max positive size_t when k==0 and decrease further 1.
-    for(int k=shape.size()-1; k >= 0; --k){
-      shape_dimen_idx[k]++;
-      if(shape_dimen_idx[k] >= shape[k]){
-        shape_dimen_idx[k] = 0;
-        continue;
-      }else{
-        break;
-      }
+  StridedShape s(shape, strides, offset);
+  ptrdiff_t inner = s.strides[0].back();
+  StridedBlocks(s, COPY_BLOCK, PARALLEL_GRAIN, [&](size_t i, ptrdiff_t pos, ptrdiff_t, size_t len) {
+    const scalar_t* src = a.ptr + i;
+    scalar_t* dst = out->ptr + pos;
+    if (inner == 1) {
+      std::memmove(dst, src, len * ELEM_SIZE);  // a may be a compact view of out itself
+    } else {
+      for (size_t j = 0; j < len; j++) dst[(ptrdiff_t)j * inner] = src[j];
     }
-    cnt++;
-  }
-  /// END SOLUTION
+  });
 }
 
-void ScalarSetitem(const size_t size, scalar_t val, AlignedArray* out, std::vector<int32_t> shape,
-                   std::vector<int32_t> strides, size_t offset) {
+void ScalarSetitem(const size_t size, scalar_t val, AlignedArray* out, std::vector<int64_t> shape,
+                   std::vector<int64_t> strides, size_t offset) {
   /**
    * Set items is a (non-compact) array
    *
@@ -158,208 +634,2082 @@ void ScalarSetitem(const size_t size, scalar_t val, AlignedArray* out, std::vect
    *   strides: strides of the out array
    *   offset: offset of the out array
    */
-
-  /// BEGIN SOLUTION
-  std::vector<int> shape_dimen_idx(shape.size(), 0);
-  //std::cout<<"shape = "<<shape<<std::endl;
-  //std::cout<<"stride = "<<strides<<std::endl;
-  //std::cout<<"size = "<<size<<std::endl;
-
-  int total_element_num = 1;
-  for(int i=0; i<shape.size(); ++i){
-    total_element_num *= shape[i];
-  }
-  //std::cout<<"total_element_num = "<<total_element_num<<std::endl;
-
-  for (int i=0; i<total_element_num; ++i){
-    //std::cout<<"--------- i = "<<i<<"-----------"<<std::endl;
-    //std::cout<<"shape_dimen_idx = "<<shape_dimen_idx<<std::endl;
-    long int pos = (long int)offset;
-    for(int j=0; j<shape.size(); ++j){
-        pos += shape_dimen_idx[j]*strides[j];
-    }
-    out->ptr[pos] = val;
-
-    //Increment the shape_dimen_idx
-    //Do not use size_t type, as it is non-negative type, would wrap around to max positive size_t when k==0 and decrease further 1.
-    for(int k=shape.size()-1; k >= 0; --k){
-      //std::cout<<"k = "<<k<<std::endl;
-      shape_dimen_idx[k]++;
-      if(shape_dimen_idx[k] >= shape[k]){
-        shape_dimen_idx[k] = 0;
-        //std::cout<<"here1"<<std::endl;
-        continue;
-      }else{
-        //std::cout<<"here2"<<std::endl;
-        break;
-      }
+  StridedShape s(shape, strides, offset);
+  ptrdiff_t inner = s.strides[0].back();
+  StridedBlocks(s, COPY_BLOCK, PARALLEL_GRAIN, [&](size_t, ptrdiff_t pos, ptrdiff_t, size_t len) {
+    scalar_t* dst = out->ptr + pos;
+    if (inner == 1) {
+      std::fill(dst, dst + len, val);
+    } else {
+      for (size_t j = 0; j < len; j++) dst[(ptrdiff_t)j * inner] = val;
     }
+  });
+}
+
+/**
+ * SIMD elementwise kernels.
+ *
+ * All Ewise* / Scalar* ops run through one generic kernel written on GCC vector types and stamped
+ * out for four instruction sets: SSE2 (the x86-64 baseline) and SSE4.1 with 4 floats per vector,
+ * AVX2+FMA with 8 and AVX-512F with 16.  Each variant carries its own target attribute on top of
+ * the baseline the module is compiled for (so a portable build, without -march=native, is what
+ * keeps the SSE2 variant SSE2-only); the widest one the CPU supports is picked through CPUID when
+ * the module is loaded.  NEEDLE_SIMD (or set_simd_isa) forces a narrower one.  Other
+ * architectures get a single "generic" variant with 4 floats per vector.
+ *
+ * exp, log and tanh use the Cephes range reductions and minimax polynomials, so the
+ * transcendental ops run at full vector width as well.  The tail of a range is processed as one
+ * zero-padded vector, so every element goes through the same code.
+ */
+// Vectors never cross a call below (everything is inlined), so the vector ABI notes are moot.
+// Templates are instantiated at the end of the file, so the warning stays off from here on.
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+#define SIMD_INLINE inline __attribute__((always_inline))
+
+#ifdef NEEDLE_X86
+#define SIMD_TARGET(TARGET) __attribute__((target(TARGET)))
+#else
+#define SIMD_TARGET(TARGET)
+#endif
+
+enum SimdOp {
+  kSimdAdd, kSimdMul, kSimdDiv, kSimdMaximum, kSimdEq, kSimdGe, kSimdPower,
+  kSimdLog, kSimdExp, kSimdTanh, kSimdSign, kSimdAbs, kSimdGelu, kSimdGeluGrad
+};
+
+template <int W>
+struct SimdVec {
+  typedef float F __attribute__((vector_size(W * sizeof(float))));
+  typedef int32_t I __attribute__((vector_size(W * sizeof(float))));
+};
+
+template <int W>
+SIMD_INLINE typename SimdVec<W>::F SimdSplat(float s) {
+  typename SimdVec<W>::F v = {};
+  return v + s;
+}
+
+template <int W>
+SIMD_INLINE typename SimdVec<W>::F SimdSelect(typename SimdVec<W>::I mask, typename SimdVec<W>::F a,
+                                              typename SimdVec<W>::F b) {
+  return mask ? a : b;
+}
+
+template <int W>
+SIMD_INLINE typename SimdVec<W>::F SimdFloor(typename SimdVec<W>::F x) {
+  // valid for |x| < 2^31, which covers every caller below
+  typedef typename SimdVec<W>::F F;
+  typedef typename SimdVec<W>::I I;
+  F t = __builtin_convertvector(__builtin_convertvector(x, I), F);
+  return t - SimdSelect<W>(t > x, SimdSplat<W>(1), SimdSplat<W>(0));
+}
+
+template <int W>
+SIMD_INLINE typename SimdVec<W>::F SimdCopySign(typename SimdVec<W>::F mag, typename SimdVec<W>::F sgn) {
+  typedef typename SimdVec<W>::F F;
+  typedef typename SimdVec<W>::I I;
+  return (F)(((I)mag & 0x7fffffff) | ((I)sgn & (int32_t)0x80000000));
+}
+
+template <int W>
+SIMD_INLINE typename SimdVec<W>::F SimdExp(typename SimdVec<W>::F x) {
+  /**
+   * exp(x) = 2^n * exp(r) with n = round(x / ln 2) and |r| <= ln(2) / 2; exp(r) is a degree-7
+   * polynomial (Cephes expf).  2^n is applied as two halves so that the denormal and the largest
+   * finite results do not overflow the exponent field.
+   */
+  typedef typename SimdVec<W>::F F;
+  typedef typename SimdVec<W>::I I;
+  const float kMax = 88.72283905206835f, kMin = -103.97207708f;
+  F xc = SimdSelect<W>(x > kMax, SimdSplat<W>(kMax), x);
+  xc = SimdSelect<W>(xc < kMin, SimdSplat<W>(kMin), xc);
+
+  F n = SimdFloor<W>(xc * 1.44269504088896341f + 0.5f);
+  F r = xc - n * 0.693359375f + n * 2.12194440e-4f;
+  F y = SimdSplat<W>(1.9875691500e-4f);
+  y = y * r + 1.3981999507e-3f;
+  y = y * r + 8.3334519073e-3f;
+  y = y * r + 4.1665795894e-2f;
+  y = y * r + 1.6666665459e-1f;
+  y = y * r + 5.0000001201e-1f;
+  y = y * r * r + r + 1.0f;
+
+  I ni = __builtin_convertvector(n, I);
+  I n1 = ni >> 1, n2 = ni - n1;
+  y = y * (F)((n1 + 127) << 23) * (F)((n2 + 127) << 23);
+
+  y = SimdSelect<W>(x > kMax, SimdSplat<W>(INFINITY), y);
+  y = SimdSelect<W>(x < kMin, SimdSplat<W>(0), y);
+  return SimdSelect<W>(x != x, x, y);
+}
+
+template <int W>
+SIMD_INLINE typename SimdVec<W>::F SimdLog(typename SimdVec<W>::F x) {
+  /**
+   * log(x) = e * ln 2 + log(m) with x = m * 2^e and sqrt(1/2) <= m < sqrt(2); log(m) is a
+   * degree-9 polynomial in m - 1 (Cephes logf).  Denormals are scaled into the normal range first.
+   */
+  typedef typename SimdVec<W>::F F;
+  typedef typename SimdVec<W>::I I;
+  I denormal = x < FLT_MIN;
+  F xs = SimdSelect<W>(denormal, x * 8388608.0f, x);
+  I bits = (I)xs;
+  F e = __builtin_convertvector((bits >> 23) - 126, F) - SimdSelect<W>(denormal, SimdSplat<W>(23), SimdSplat<W>(0));
+  F m = (F)((bits & (int32_t)0x807fffff) | 0x3f000000);  // [0.5, 1)
+
+  I small = m < 0.707106781186547524f;
+  e = e - SimdSelect<W>(small, SimdSplat<W>(1), SimdSplat<W>(0));
+  m = m + SimdSelect<W>(small, m, SimdSplat<W>(0)) - 1.0f;
+
+  F z = m * m;
+  F y = SimdSplat<W>(7.0376836292e-2f);
+  y = y * m - 1.1514610310e-1f;
+  y = y * m + 1.1676998740e-1f;
+  y = y * m - 1.2420140846e-1f;
+  y = y * m + 1.4249322787e-1f;
+  y = y * m - 1.6668057665e-1f;
+  y = y * m + 2.0000714765e-1f;
+  y = y * m - 2.4999993993e-1f;
+  y = y * m + 3.3333331174e-1f;
+  y = y * m * z;
+  y = y - e * 2.12194440e-4f - 0.5f * z;
+  F r = m + y + e * 0.693359375f;
+
+  r = SimdSelect<W>(x == 0.0f, SimdSplat<W>(-INFINITY), r);
+  r = SimdSelect<W>(x < 0.0f, SimdSplat<W>(NAN), r);
+  r = SimdSelect<W>(x == INFINITY, x, r);
+  return SimdSelect<W>(x != x, x, r);
+}
+
+template <int W>
+SIMD_INLINE typename SimdVec<W>::F SimdTanh(typename SimdVec<W>::F x) {
+  /**
+   * Odd polynomial for |x| < 0.625 (Cephes tanhf), 1 - 2 / (exp(2|x|) + 1) with the sign of x
+   * elsewhere.
+   */
+  typedef typename SimdVec<W>::F F;
+  typedef typename SimdVec<W>::I I;
+  F ax = (F)((I)x & 0x7fffffff);
+  F z = x * x;
+  F p = SimdSplat<W>(-5.70498872745e-3f);
+  p = p * z + 2.06390887954e-2f;
+  p = p * z - 5.37397155531e-2f;
+  p = p * z + 1.33314422036e-1f;
+  p = p * z - 3.33332819422e-1f;
+  F small = x + x * z * p;
+  F big = SimdCopySign<W>(1.0f - 2.0f / (SimdExp<W>(ax + ax) + 1.0f), x);
+  return SimdSelect<W>(ax < 0.625f, small, big);
+}
+
+template <int W>
+SIMD_INLINE typename SimdVec<W>::F SimdPowInt(typename SimdVec<W>::F x, int p) {
+  // x^p by repeated squaring; p is the same for every lane
+  typename SimdVec<W>::F r = SimdSplat<W>(1), base = x;
+  for (int k = p < 0 ? -p : p; k > 0; k >>= 1) {
+    if (k & 1) r = r * base;
+    base = base * base;
   }
-  //std::cout<<"shape_dimen_idx = "<<shape_dimen_idx<<std::endl;
-  //std::cout<<"end"<<std::endl;
-  /// END SOLUTION
+  return p < 0 ? 1.0f / r : r;
 }
 
-void EwiseAdd(const AlignedArray& a, const AlignedArray& b, AlignedArray* out) {
+template <int W>
+SIMD_INLINE typename SimdVec<W>::F SimdPow(typename SimdVec<W>::F x, float p) {
+  // x^p = exp(p * log|x|): negative x gives NaN for a fractional p and takes the sign of x for
+  // an odd integer p
+  typedef typename SimdVec<W>::F F;
+  typedef typename SimdVec<W>::I I;
+  F ax = (F)((I)x & 0x7fffffff);
+  F r = SimdExp<W>(SimdLog<W>(ax) * p);
+  if (p != std::floor(p)) return SimdSelect<W>((x < 0.0f) & (x != -INFINITY), SimdSplat<W>(NAN), r);
+  if (std::fmod(p, 2.0f) != 0) return SimdCopySign<W>(r, x);
+  return r;
+}
+
+template <int W>
+SIMD_INLINE typename SimdVec<W>::F SimdGelu(typename SimdVec<W>::F x) {
+  // tanh approximation: 0.5 * x * (1 + tanh(sqrt(2 / pi) * (x + 0.044715 * x^3)))
+  typename SimdVec<W>::F t = SimdTanh<W>(x * (0.7978845608028654f + 0.035677408136300125f * x * x));
+  return 0.5f * x * (1.0f + t);
+}
+
+template <int W>
+SIMD_INLINE typename SimdVec<W>::F SimdGeluGrad(typename SimdVec<W>::F x, typename SimdVec<W>::F dy) {
+  // dy * d/dx of SimdGelu
+  typedef typename SimdVec<W>::F F;
+  F x2 = x * x;
+  F t = SimdTanh<W>(x * (0.7978845608028654f + 0.035677408136300125f * x2));
+  F du = 0.7978845608028654f + 0.10703222440890037f * x2;
+  return dy * (0.5f * (1.0f + t) + 0.5f * x * (1.0f - t * t) * du);
+}
+
+// Every op maps a vector of a (and of b, or the broadcast scalar) to a vector of out; s is the raw
+// scalar operand.
+#define SIMD_OP(NAME, EXPR)                                                            \
+  struct NAME {                                                                        \
+    template <int W>                                                                   \
+    static SIMD_INLINE typename SimdVec<W>::F Apply(typename SimdVec<W>::F x,          \
+                                                    typename SimdVec<W>::F y, float s) { \
+      typedef typename SimdVec<W>::F F __attribute__((unused));                        \
+      typedef typename SimdVec<W>::I I __attribute__((unused));                        \
+      return EXPR;                                                                     \
+    }                                                                                  \
+  };
+
+SIMD_OP(SimdAddOp, x + y)
+SIMD_OP(SimdMulOp, x * y)
+SIMD_OP(SimdDivOp, x / y)
+SIMD_OP(SimdMaximumOp, SimdSelect<W>(x < y, y, x))
+SIMD_OP(SimdEqOp, (F)((x == y) & (I)SimdSplat<W>(1)))
+SIMD_OP(SimdGeOp, (F)((x >= y) & (I)SimdSplat<W>(1)))
+SIMD_OP(SimdPowIntOp, SimdPowInt<W>(x, (int)s))
+SIMD_OP(SimdPowOp, SimdPow<W>(x, s))
+SIMD_OP(SimdLogOp, SimdLog<W>(x))
+SIMD_OP(SimdExpOp, SimdExp<W>(x))
+SIMD_OP(SimdTanhOp, SimdTanh<W>(x))
+SIMD_OP(SimdSignOp, (F)((x > 0.0f) & (I)SimdSplat<W>(1)) - (F)((x < 0.0f) & (I)SimdSplat<W>(1)))
+SIMD_OP(SimdAbsOp, (F)((I)x & 0x7fffffff))
+SIMD_OP(SimdGeluOp, SimdGelu<W>(x))
+SIMD_OP(SimdGeluGradOp, SimdGeluGrad<W>(x, y))
+
+template <int W, typename Op>
+SIMD_INLINE void SimdMap(const scalar_t* a, const scalar_t* b, scalar_t val, scalar_t* out, size_t n) {
   /**
-   * Set entries in out to be the sum of correspondings entires in a and b.
+   * out[i] = Op(a[i], b[i]) for i < n, or Op(a[i], val) when b is null.
    */
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = a.ptr[i] + b.ptr[i];
+  typedef typename SimdVec<W>::F F;
+  F x, y = SimdSplat<W>(val);
+  size_t i = 0;
+  for (; i + W <= n; i += W) {
+    std::memcpy(&x, a + i, sizeof(F));
+    if (b) std::memcpy(&y, b + i, sizeof(F));
+    x = Op::template Apply<W>(x, y, val);
+    std::memcpy(out + i, &x, sizeof(F));
+  }
+  if (i < n) {
+    x = SimdSplat<W>(0);
+    std::memcpy(&x, a + i, (n - i) * ELEM_SIZE);
+    if (b) {
+      y = SimdSplat<W>(0);
+      std::memcpy(&y, b + i, (n - i) * ELEM_SIZE);
+    }
+    x = Op::template Apply<W>(x, y, val);
+    std::memcpy(out + i, &x, (n - i) * ELEM_SIZE);
   }
 }
 
-void ScalarAdd(const AlignedArray& a, scalar_t val, AlignedArray* out) {
+template <int W>
+SIMD_INLINE void SimdRun(SimdOp op, const scalar_t* a, const scalar_t* b, scalar_t val,
+                         scalar_t* out, size_t n) {
+  switch (op) {
+    case kSimdAdd: SimdMap<W, SimdAddOp>(a, b, val, out, n); break;
+    case kSimdMul: SimdMap<W, SimdMulOp>(a, b, val, out, n); break;
+    case kSimdDiv: SimdMap<W, SimdDivOp>(a, b, val, out, n); break;
+    case kSimdMaximum: SimdMap<W, SimdMaximumOp>(a, b, val, out, n); break;
+    case kSimdEq: SimdMap<W, SimdEqOp>(a, b, val, out, n); break;
+    case kSimdGe: SimdMap<W, SimdGeOp>(a, b, val, out, n); break;
+    case kSimdPower:
+      if (val == std::floor(val) && std::abs(val) <= 64) {
+        SimdMap<W, SimdPowIntOp>(a, b, val, out, n);
+      } else {
+        SimdMap<W, SimdPowOp>(a, b, val, out, n);
+      }
+      break;
+    case kSimdLog: SimdMap<W, SimdLogOp>(a, b, val, out, n); break;
+    case kSimdExp: SimdMap<W, SimdExpOp>(a, b, val, out, n); break;
+    case kSimdTanh: SimdMap<W, SimdTanhOp>(a, b, val, out, n); break;
+    case kSimdSign: SimdMap<W, SimdSignOp>(a, b, val, out, n); break;
+    case kSimdAbs: SimdMap<W, SimdAbsOp>(a, b, val, out, n); break;
+    case kSimdGelu: SimdMap<W, SimdGeluOp>(a, b, val, out, n); break;
+    case kSimdGeluGrad: SimdMap<W, SimdGeluGradOp>(a, b, val, out, n); break;
+  }
+}
+
+typedef void (*SimdKernel)(SimdOp, const scalar_t*, const scalar_t*, scalar_t, scalar_t*, size_t);
+
+#define SIMD_DEFINE_KERNEL(NAME, TARGET, W)                                               \
+  SIMD_TARGET(TARGET) void NAME(SimdOp op, const scalar_t* a, const scalar_t* b, \
+                                            scalar_t val, scalar_t* out, size_t n) {        \
+    SimdRun<W>(op, a, b, val, out, n);                                                     \
+  }
+
+#ifdef NEEDLE_X86
+SIMD_DEFINE_KERNEL(SimdKernelSse2, "sse2", 4)
+SIMD_DEFINE_KERNEL(SimdKernelSse4, "sse4.1", 4)
+SIMD_DEFINE_KERNEL(SimdKernelAvx2, "avx2,fma", 8)
+SIMD_DEFINE_KERNEL(SimdKernelAvx512, "avx512f", 16)
+#else
+SIMD_DEFINE_KERNEL(SimdKernelGeneric, "", 4)
+#endif
+
+/**
+ * SIMD summation.
+ *
+ * SimdSum adds n contiguous floats with four vector accumulators per SUM_BLOCK elements and
+ * combines the block sums pairwise, keeping one partial sum per level of a binary counter over the
+ * blocks (cascade summation), so the rounding error grows with log(n) rather than n.  With
+ * compensated set it instead carries a Neumaier correction in every lane, which keeps the result
+ * within a few ulps of the exact sum at about half the speed.  SimdAccumulate is the column
+ * version: it adds one row into per-column sums and corrections.
+ */
+#define SUM_BLOCK 256
+
+inline void NeumaierAdd(scalar_t* sum, scalar_t* comp, scalar_t x) {
+  scalar_t t = *sum + x;
+  *comp += std::abs(*sum) >= std::abs(x) ? (*sum - t) + x : (x - t) + *sum;
+  *sum = t;
+}
+
+template <int W>
+SIMD_INLINE void SimdNeumaierAdd(typename SimdVec<W>::F* sum, typename SimdVec<W>::F* comp,
+                                 typename SimdVec<W>::F x) {
+  typedef typename SimdVec<W>::F F;
+  typedef typename SimdVec<W>::I I;
+  F s = *sum, t = s + x;
+  I big = (F)((I)s & 0x7fffffff) >= (F)((I)x & 0x7fffffff);
+  *comp += SimdSelect<W>(big, (s - t) + x, (x - t) + s);
+  *sum = t;
+}
+
+template <int W>
+SIMD_INLINE scalar_t SimdReduceAdd(typename SimdVec<W>::F v) {
+  scalar_t lanes[W];
+  std::memcpy(lanes, &v, sizeof(lanes));
+  for (int w = W / 2; w > 0; w /= 2) {
+    for (int l = 0; l < w; l++) lanes[l] += lanes[l + w];
+  }
+  return lanes[0];
+}
+
+template <int W>
+SIMD_INLINE scalar_t SimdReduceMax(typename SimdVec<W>::F v) {
+  scalar_t lanes[W];
+  std::memcpy(lanes, &v, sizeof(lanes));
+  for (int w = W / 2; w > 0; w /= 2) {
+    for (int l = 0; l < w; l++) lanes[l] = std::max(lanes[l], lanes[l + w]);
+  }
+  return lanes[0];
+}
+
+template <int W>
+SIMD_INLINE scalar_t SimdSum(const scalar_t* p, size_t n, bool compensated) {
+  typedef typename SimdVec<W>::F F;
+  const F zero = SimdSplat<W>(0);
+  size_t body = n / W * W, i = 0;
+  F x0, x1, x2, x3, tail = zero;
+  std::memcpy(&tail, p + body, (n - body) * ELEM_SIZE);
+
+  if (compensated) {
+    F s0 = zero, c0 = zero, s1 = zero, c1 = zero;
+    for (; i + 2 * W <= body; i += 2 * W) {
+      std::memcpy(&x0, p + i, sizeof(F));
+      std::memcpy(&x1, p + i + W, sizeof(F));
+      SimdNeumaierAdd<W>(&s0, &c0, x0);
+      SimdNeumaierAdd<W>(&s1, &c1, x1);
+    }
+    if (i < body) {
+      std::memcpy(&x0, p + i, sizeof(F));
+      SimdNeumaierAdd<W>(&s0, &c0, x0);
+    }
+    SimdNeumaierAdd<W>(&s0, &c0, tail);
+    SimdNeumaierAdd<W>(&s0, &c0, s1);
+    c0 += c1;
+    scalar_t sums[W], comps[W], sum = 0, comp = 0;
+    std::memcpy(sums, &s0, sizeof(F));
+    std::memcpy(comps, &c0, sizeof(F));
+    for (int l = 0; l < W; l++) {
+      NeumaierAdd(&sum, &comp, sums[l]);
+      comp += comps[l];
+    }
+    return sum + comp;
+  }
+
+  F level[64];
+  size_t blocks = 0;
+  for (; i + SUM_BLOCK <= body; i += SUM_BLOCK) {
+    F a0 = zero, a1 = zero, a2 = zero, a3 = zero;
+    for (size_t j = i; j < i + SUM_BLOCK; j += 4 * W) {
+      std::memcpy(&x0, p + j, sizeof(F));
+      std::memcpy(&x1, p + j + W, sizeof(F));
+      std::memcpy(&x2, p + j + 2 * W, sizeof(F));
+      std::memcpy(&x3, p + j + 3 * W, sizeof(F));
+      a0 += x0;
+      a1 += x1;
+      a2 += x2;
+      a3 += x3;
+    }
+    F v = (a0 + a1) + (a2 + a3);
+    int l = 0;
+    for (size_t k = blocks; k & 1; k >>= 1) v = level[l++] + v;
+    level[l] = v;
+    ++blocks;
+  }
+  F total = tail;
+  for (; i < body; i += W) {
+    std::memcpy(&x0, p + i, sizeof(F));
+    total += x0;
+  }
+  for (int l = 0; (blocks >> l) != 0; l++) {
+    if ((blocks >> l) & 1) total = level[l] + total;
+  }
+  return SimdReduceAdd<W>(total);
+}
+
+template <int W>
+SIMD_INLINE void SimdAccumulate(const scalar_t* x, scalar_t* sum, scalar_t* comp, size_t n) {
   /**
-   * Set entries in out to be the sum of corresponding entry in a plus the scalar val.
+   * sum[i] + comp[i] += x[i] for i < n, with a Neumaier correction per column.
    */
-  for (size_t i = 0; i < a.size; i++) {
-    out->ptr[i] = a.ptr[i] + val;
+  typedef typename SimdVec<W>::F F;
+  F v, s, c;
+  size_t i = 0;
+  for (; i + W <= n; i += W) {
+    std::memcpy(&v, x + i, sizeof(F));
+    std::memcpy(&s, sum + i, sizeof(F));
+    std::memcpy(&c, comp + i, sizeof(F));
+    SimdNeumaierAdd<W>(&s, &c, v);
+    std::memcpy(sum + i, &s, sizeof(F));
+    std::memcpy(comp + i, &c, sizeof(F));
+  }
+  if (i < n) {
+    v = s = c = SimdSplat<W>(0);
+    std::memcpy(&v, x + i, (n - i) * ELEM_SIZE);
+    std::memcpy(&s, sum + i, (n - i) * ELEM_SIZE);
+    std::memcpy(&c, comp + i, (n - i) * ELEM_SIZE);
+    SimdNeumaierAdd<W>(&s, &c, v);
+    std::memcpy(sum + i, &s, (n - i) * ELEM_SIZE);
+    std::memcpy(comp + i, &c, (n - i) * ELEM_SIZE);
   }
 }
 
+typedef scalar_t (*SimdSumKernel)(const scalar_t*, size_t, bool);
+typedef void (*SimdAccumulateKernel)(const scalar_t*, scalar_t*, scalar_t*, size_t);
+
+#define SIMD_DEFINE_SUM_KERNELS(SUM, ACCUMULATE, TARGET, W)                                      \
+  SIMD_TARGET(TARGET) scalar_t SUM(const scalar_t* p, size_t n, bool compensated) {  \
+    return SimdSum<W>(p, n, compensated);                                                        \
+  }                                                                                              \
+  SIMD_TARGET(TARGET) void ACCUMULATE(const scalar_t* x, scalar_t* sum,              \
+                                                  scalar_t* comp, size_t n) {                    \
+    SimdAccumulate<W>(x, sum, comp, n);                                                          \
+  }
+
+#ifdef NEEDLE_X86
+SIMD_DEFINE_SUM_KERNELS(SimdSumSse2, SimdAccumulateSse2, "sse2", 4)
+SIMD_DEFINE_SUM_KERNELS(SimdSumSse4, SimdAccumulateSse4, "sse4.1", 4)
+SIMD_DEFINE_SUM_KERNELS(SimdSumAvx2, SimdAccumulateAvx2, "avx2,fma", 8)
+SIMD_DEFINE_SUM_KERNELS(SimdSumAvx512, SimdAccumulateAvx512, "avx512f", 16)
+#else
+SIMD_DEFINE_SUM_KERNELS(SimdSumGeneric, SimdAccumulateGeneric, "", 4)
+#endif
 
 /**
- * In the code the follows, use the above template to create analogous element-wise
- * and and scalar operators for the following functions.  See the numpy backend for
- * examples of how they should work.
- *   - EwiseMul, ScalarMul
- *   - EwiseDiv, ScalarDiv
- *   - ScalarPower
- *   - EwiseMaximum, ScalarMaximum
- *   - EwiseEq, ScalarEq
- *   - EwiseGe, ScalarGe
- *   - EwiseLog
- *   - EwiseExp
- *   - EwiseTanh
+ * SIMD softmax rows.
  *
- * If you implement all these naively, there will be a lot of repeated code, so
- * you are welcome (but not required), to use macros or templates to define these
- * functions (however you want to do so, as long as the functions match the proper)
- * signatures above.
+ * SimdSoftmax writes the softmax (or log-softmax) of one row: a max pass, then exp(x - max) is
+ * stored while it is summed and the row is scaled in place; log-softmax only sums in the second
+ * pass and writes x - max - log(sum) in the third.  The passes after the first read a row that
+ * is already in cache, so each row is read from memory once and written once.  SimdSoftmaxGrad
+ * is the matching backward, given the forward output y:
+ *   softmax:      dx = y * (dy - sum(dy * y))
+ *   log-softmax:  dx = dy - exp(y) * sum(dy)
  */
+template <int W>
+SIMD_INLINE typename SimdVec<W>::F SimdLoadPartial(const scalar_t* p, size_t n, float pad) {
+  // the first n < W lanes from p, the rest pad
+  typename SimdVec<W>::F v = SimdSplat<W>(pad);
+  std::memcpy(&v, p, n * ELEM_SIZE);
+  return v;
+}
 
- void EwiseMul(const AlignedArray &a, const AlignedArray &b, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = a.ptr[i] * b.ptr[i];
+template <int W>
+SIMD_INLINE void SimdSoftmax(const scalar_t* x, scalar_t* y, size_t n, bool log) {
+  typedef typename SimdVec<W>::F F;
+  size_t body = n / W * W, tail = n - body, i;
+  F v, m = SimdSplat<W>(-INFINITY), s = SimdSplat<W>(0);
+  for (i = 0; i < body; i += W) {
+    std::memcpy(&v, x + i, sizeof(F));
+    m = SimdSelect<W>(m < v, v, m);
+  }
+  if (tail > 0) {
+    v = SimdLoadPartial<W>(x + body, tail, -INFINITY);
+    m = SimdSelect<W>(m < v, v, m);
+  }
+  const scalar_t row_max = SimdReduceMax<W>(m);
+
+  for (i = 0; i < body; i += W) {
+    std::memcpy(&v, x + i, sizeof(F));
+    v = SimdExp<W>(v - row_max);
+    s += v;
+    if (!log) std::memcpy(y + i, &v, sizeof(F));
+  }
+  if (tail > 0) {
+    v = SimdExp<W>(SimdLoadPartial<W>(x + body, tail, -INFINITY) - row_max);
+    s += v;
+    if (!log) std::memcpy(y + body, &v, tail * ELEM_SIZE);
   }
+  const scalar_t row_sum = SimdReduceAdd<W>(s);
+
+  if (log) {
+    const scalar_t lse = row_max + std::log(row_sum);
+    for (i = 0; i < body; i += W) {
+      std::memcpy(&v, x + i, sizeof(F));
+      v = v - lse;
+      std::memcpy(y + i, &v, sizeof(F));
+    }
+    if (tail > 0) {
+      v = SimdLoadPartial<W>(x + body, tail, 0) - lse;
+      std::memcpy(y + body, &v, tail * ELEM_SIZE);
+    }
+  } else {
+    const scalar_t scale = 1 / row_sum;
+    for (i = 0; i < body; i += W) {
+      std::memcpy(&v, y + i, sizeof(F));
+      v = v * scale;
+      std::memcpy(y + i, &v, sizeof(F));
+    }
+    if (tail > 0) {
+      v = SimdLoadPartial<W>(y + body, tail, 0) * scale;
+      std::memcpy(y + body, &v, tail * ELEM_SIZE);
+    }
+  }
+}
+
+template <int W>
+SIMD_INLINE void SimdSoftmaxGrad(const scalar_t* y, const scalar_t* dy, scalar_t* dx, size_t n, bool log) {
+  typedef typename SimdVec<W>::F F;
+  size_t body = n / W * W, tail = n - body, i;
+  F yv, dv, acc = SimdSplat<W>(0);
+  for (i = 0; i < body; i += W) {
+    std::memcpy(&dv, dy + i, sizeof(F));
+    if (log) {
+      acc += dv;
+    } else {
+      std::memcpy(&yv, y + i, sizeof(F));
+      acc += dv * yv;
+    }
+  }
+  if (tail > 0) {
+    dv = SimdLoadPartial<W>(dy + body, tail, 0);
+    acc += log ? dv : dv * SimdLoadPartial<W>(y + body, tail, 0);
+  }
+  const scalar_t dot = SimdReduceAdd<W>(acc);
+
+  for (i = 0; i < n; i += W) {
+    size_t len = std::min<size_t>(W, n - i);
+    if (len == W) {
+      std::memcpy(&yv, y + i, sizeof(F));
+      std::memcpy(&dv, dy + i, sizeof(F));
+    } else {
+      yv = SimdLoadPartial<W>(y + i, len, 0);
+      dv = SimdLoadPartial<W>(dy + i, len, 0);
+    }
+    dv = log ? dv - SimdExp<W>(yv) * dot : yv * (dv - dot);
+    std::memcpy(dx + i, &dv, len * ELEM_SIZE);
+  }
+}
+
+typedef void (*SimdSoftmaxKernel)(const scalar_t*, scalar_t*, size_t, bool);
+typedef void (*SimdSoftmaxGradKernel)(const scalar_t*, const scalar_t*, scalar_t*, size_t, bool);
+
+#define SIMD_DEFINE_SOFTMAX_KERNELS(SOFTMAX, GRAD, TARGET, W)                                        \
+  SIMD_TARGET(TARGET) void SOFTMAX(const scalar_t* x, scalar_t* y, size_t n, bool log) {  \
+    SimdSoftmax<W>(x, y, n, log);                                                                    \
+  }                                                                                                  \
+  SIMD_TARGET(TARGET) void GRAD(const scalar_t* y, const scalar_t* dy, scalar_t* dx,     \
+                                            size_t n, bool log) {                                    \
+    SimdSoftmaxGrad<W>(y, dy, dx, n, log);                                                           \
+  }
+
+#ifdef NEEDLE_X86
+SIMD_DEFINE_SOFTMAX_KERNELS(SimdSoftmaxSse2, SimdSoftmaxGradSse2, "sse2", 4)
+SIMD_DEFINE_SOFTMAX_KERNELS(SimdSoftmaxSse4, SimdSoftmaxGradSse4, "sse4.1", 4)
+SIMD_DEFINE_SOFTMAX_KERNELS(SimdSoftmaxAvx2, SimdSoftmaxGradAvx2, "avx2,fma", 8)
+SIMD_DEFINE_SOFTMAX_KERNELS(SimdSoftmaxAvx512, SimdSoftmaxGradAvx512, "avx512f", 16)
+#else
+SIMD_DEFINE_SOFTMAX_KERNELS(SimdSoftmaxGeneric, SimdSoftmaxGradGeneric, "", 4)
+#endif
+
+/**
+ * SIMD layer-norm rows.
+ *
+ * SimdLayerNorm gets the mean and variance of a row in one Welford pass, one running mean and M2
+ * per lane; the lanes (which have all seen the same number of elements) are merged pairwise with
+ * Chan's formula and the tail is added one element at a time.  A second pass over the cached row
+ * writes (x - mean) * rstd * w + b.  SimdLayerNormGrad takes the saved mean and rstd; with
+ * xhat = (x - mean) * rstd and g = dy * w,
+ *   dx = rstd * (g - mean(g) - xhat * mean(g * xhat))
+ * and dy * xhat and dy are added into the running weight / bias gradients.
+ */
+template <int W>
+SIMD_INLINE void SimdLayerNorm(const scalar_t* x, const scalar_t* w, const scalar_t* b, scalar_t* y,
+                               size_t n, scalar_t eps, scalar_t* mean_out, scalar_t* rstd_out) {
+  typedef typename SimdVec<W>::F F;
+  F v, d, m = SimdSplat<W>(0), m2 = SimdSplat<W>(0);
+  size_t i = 0, k = 0;
+  for (; i + W <= n; i += W) {
+    std::memcpy(&v, x + i, sizeof(F));
+    d = v - m;
+    m += d * (1.0f / ++k);
+    m2 += d * (v - m);
+  }
+  scalar_t lm[W], lm2[W];
+  std::memcpy(lm, &m, sizeof(F));
+  std::memcpy(lm2, &m2, sizeof(F));
+  for (int h = W / 2; h > 0; h /= 2, k *= 2) {
+    for (int l = 0; l < h; l++) {
+      scalar_t delta = lm[l + h] - lm[l];
+      lm[l] += delta * 0.5f;
+      lm2[l] += lm2[l + h] + delta * delta * (k * 0.5f);
+    }
+  }
+  scalar_t mean = lm[0], M2 = lm2[0];
+  for (; i < n; ++i) {
+    scalar_t delta = x[i] - mean;
+    mean += delta / ++k;
+    M2 += delta * (x[i] - mean);
+  }
+  const scalar_t rstd = 1 / std::sqrt(M2 / n + eps);
+  *mean_out = mean;
+  *rstd_out = rstd;
+
+  F wv, bv;
+  for (i = 0; i < n; i += W) {
+    size_t len = std::min<size_t>(W, n - i);
+    if (len == W) {
+      std::memcpy(&v, x + i, sizeof(F));
+      std::memcpy(&wv, w + i, sizeof(F));
+      std::memcpy(&bv, b + i, sizeof(F));
+    } else {
+      v = SimdLoadPartial<W>(x + i, len, 0);
+      wv = SimdLoadPartial<W>(w + i, len, 0);
+      bv = SimdLoadPartial<W>(b + i, len, 0);
+    }
+    v = (v - mean) * rstd * wv + bv;
+    std::memcpy(y + i, &v, len * ELEM_SIZE);
+  }
+}
+
+template <int W>
+SIMD_INLINE void SimdLayerNormGrad(const scalar_t* x, const scalar_t* dy, const scalar_t* w, scalar_t mean,
+                                   scalar_t rstd, scalar_t* dx, scalar_t* dw, scalar_t* db, size_t n) {
+  typedef typename SimdVec<W>::F F;
+  F v, dv, wv, xhat, g, sum_g = SimdSplat<W>(0), sum_gx = SimdSplat<W>(0);
+  for (size_t i = 0; i < n; i += W) {
+    size_t len = std::min<size_t>(W, n - i);
+    F dwv, dbv;
+    if (len == W) {
+      std::memcpy(&v, x + i, sizeof(F));
+      std::memcpy(&dv, dy + i, sizeof(F));
+      std::memcpy(&wv, w + i, sizeof(F));
+      std::memcpy(&dwv, dw + i, sizeof(F));
+      std::memcpy(&dbv, db + i, sizeof(F));
+    } else {
+      v = SimdLoadPartial<W>(x + i, len, 0);
+      dv = SimdLoadPartial<W>(dy + i, len, 0);
+      wv = SimdLoadPartial<W>(w + i, len, 0);
+      dwv = SimdLoadPartial<W>(dw + i, len, 0);
+      dbv = SimdLoadPartial<W>(db + i, len, 0);
+    }
+    xhat = (v - mean) * rstd;
+    g = dv * wv;
+    sum_g += g;
+    sum_gx += g * xhat;
+    dwv += dv * xhat;
+    dbv += dv;
+    std::memcpy(dw + i, &dwv, len * ELEM_SIZE);
+    std::memcpy(db + i, &dbv, len * ELEM_SIZE);
+  }
+  const scalar_t mean_g = SimdReduceAdd<W>(sum_g) / n, mean_gx = SimdReduceAdd<W>(sum_gx) / n;
+
+  for (size_t i = 0; i < n; i += W) {
+    size_t len = std::min<size_t>(W, n - i);
+    if (len == W) {
+      std::memcpy(&v, x + i, sizeof(F));
+      std::memcpy(&dv, dy + i, sizeof(F));
+      std::memcpy(&wv, w + i, sizeof(F));
+    } else {
+      v = SimdLoadPartial<W>(x + i, len, 0);
+      dv = SimdLoadPartial<W>(dy + i, len, 0);
+      wv = SimdLoadPartial<W>(w + i, len, 0);
+    }
+    xhat = (v - mean) * rstd;
+    v = (dv * wv - mean_g - xhat * mean_gx) * rstd;
+    std::memcpy(dx + i, &v, len * ELEM_SIZE);
+  }
+}
+
+typedef void (*SimdLayerNormKernel)(const scalar_t*, const scalar_t*, const scalar_t*, scalar_t*, size_t,
+                                    scalar_t, scalar_t*, scalar_t*);
+typedef void (*SimdLayerNormGradKernel)(const scalar_t*, const scalar_t*, const scalar_t*, scalar_t, scalar_t,
+                                        scalar_t*, scalar_t*, scalar_t*, size_t);
+
+#define SIMD_DEFINE_LAYER_NORM_KERNELS(NORM, GRAD, TARGET, W)                                        \
+  SIMD_TARGET(TARGET) void NORM(const scalar_t* x, const scalar_t* w, const scalar_t* b, \
+                                            scalar_t* y, size_t n, scalar_t eps, scalar_t* mean,     \
+                                            scalar_t* rstd) {                                        \
+    SimdLayerNorm<W>(x, w, b, y, n, eps, mean, rstd);                                                \
+  }                                                                                                  \
+  SIMD_TARGET(TARGET) void GRAD(const scalar_t* x, const scalar_t* dy, const scalar_t* w, \
+                                            scalar_t mean, scalar_t rstd, scalar_t* dx, scalar_t* dw, \
+                                            scalar_t* db, size_t n) {                                \
+    SimdLayerNormGrad<W>(x, dy, w, mean, rstd, dx, dw, db, n);                                       \
+  }
+
+#ifdef NEEDLE_X86
+SIMD_DEFINE_LAYER_NORM_KERNELS(SimdLayerNormSse2, SimdLayerNormGradSse2, "sse2", 4)
+SIMD_DEFINE_LAYER_NORM_KERNELS(SimdLayerNormSse4, SimdLayerNormGradSse4, "sse4.1", 4)
+SIMD_DEFINE_LAYER_NORM_KERNELS(SimdLayerNormAvx2, SimdLayerNormGradAvx2, "avx2,fma", 8)
+SIMD_DEFINE_LAYER_NORM_KERNELS(SimdLayerNormAvx512, SimdLayerNormGradAvx512, "avx512f", 16)
+#else
+SIMD_DEFINE_LAYER_NORM_KERNELS(SimdLayerNormGeneric, SimdLayerNormGradGeneric, "", 4)
+#endif
+
+struct SimdIsa {
+  const char* name;
+  SimdKernel kernel;
+  SimdSumKernel sum;
+  SimdAccumulateKernel accumulate;
+  SimdSoftmaxKernel softmax;
+  SimdSoftmaxGradKernel softmax_grad;
+  SimdLayerNormKernel layer_norm;
+  SimdLayerNormGradKernel layer_norm_grad;
+};
+
+// widest first; "sse2" is always available on x86-64
+#ifdef NEEDLE_X86
+const SimdIsa kSimdIsas[] = {
+    {"avx512", SimdKernelAvx512, SimdSumAvx512, SimdAccumulateAvx512, SimdSoftmaxAvx512, SimdSoftmaxGradAvx512,
+     SimdLayerNormAvx512, SimdLayerNormGradAvx512},
+    {"avx2", SimdKernelAvx2, SimdSumAvx2, SimdAccumulateAvx2, SimdSoftmaxAvx2, SimdSoftmaxGradAvx2,
+     SimdLayerNormAvx2, SimdLayerNormGradAvx2},
+    {"sse4", SimdKernelSse4, SimdSumSse4, SimdAccumulateSse4, SimdSoftmaxSse4, SimdSoftmaxGradSse4,
+     SimdLayerNormSse4, SimdLayerNormGradSse4},
+    {"sse2", SimdKernelSse2, SimdSumSse2, SimdAccumulateSse2, SimdSoftmaxSse2, SimdSoftmaxGradSse2,
+     SimdLayerNormSse2, SimdLayerNormGradSse2}};
+
+bool SimdIsaSupported(const std::string& name) {
+  __builtin_cpu_init();
+  if (name == "avx512") return __builtin_cpu_supports("avx512f");
+  if (name == "avx2") return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  if (name == "sse4") return __builtin_cpu_supports("sse4.1");
+  return name == "sse2";
+}
+#else
+const SimdIsa kSimdIsas[] = {
+    {"generic", SimdKernelGeneric, SimdSumGeneric, SimdAccumulateGeneric, SimdSoftmaxGeneric,
+     SimdSoftmaxGradGeneric, SimdLayerNormGeneric, SimdLayerNormGradGeneric}};
+
+bool SimdIsaSupported(const std::string& name) { return name == "generic"; }
+#endif
+
+const SimdIsa* SelectSimdIsa(const std::string& name) {
+  /**
+   * The named instruction set, or the widest supported one for "" / "auto".  Returns nullptr for
+   * an unknown or unsupported name.
+   */
+  for (const SimdIsa& isa : kSimdIsas) {
+    if ((name.empty() || name == "auto" || name == isa.name) && SimdIsaSupported(isa.name))
+      return &isa;
+  }
+  return nullptr;
+}
+
+const SimdIsa* DefaultSimdIsa() {
+  const char* env = std::getenv("NEEDLE_SIMD");
+  const SimdIsa* isa = env != nullptr ? SelectSimdIsa(env) : nullptr;
+  return isa != nullptr ? isa : SelectSimdIsa("auto");
+}
+
+const SimdIsa* simd_isa = DefaultSimdIsa();  // chosen when the module is loaded
+
+void SetSimdIsa(const std::string& name) {
+  /**
+   * Switch the elementwise kernels (and the GEMM micro-kernel) to one of "avx512", "avx2", "sse4",
+   * "sse2" ("generic" off x86); "auto" restores the widest one the CPU supports.
+   */
+  const SimdIsa* isa = SelectSimdIsa(name);
+  if (isa == nullptr) throw std::invalid_argument("SIMD instruction set not supported: " + name);
+  simd_isa = isa;
+}
+
+std::string GetSimdIsa() { return simd_isa->name; }
+
+bool DefaultCompensatedSum() {
+  const char* env = std::getenv("NEEDLE_COMPENSATED_SUM");
+  return env != nullptr && std::atoi(env) > 0;
+}
+
+bool compensated_sum = DefaultCompensatedSum();
+
+void SetCompensatedSum(bool compensated) {
+  /**
+   * Make sum reductions carry Neumaier corrections (slower, but accurate to a few ulps however
+   * many elements are added) instead of summing pairwise.  NEEDLE_COMPENSATED_SUM=1 turns it on
+   * when the module is loaded.
+   */
+  compensated_sum = compensated;
+}
+
+bool GetCompensatedSum() { return compensated_sum; }
+
+void SimdApply(SimdOp op, const AlignedArray& a, const scalar_t* b, scalar_t val, AlignedArray* out,
+               size_t grain) {
+  /**
+   * Run one elementwise op over a.size elements with the selected kernel, split across the pool.
+   */
+  SimdKernel kernel = simd_isa->kernel;
+  ParallelFor(0, a.size, grain, [&](size_t begin, size_t end) {
+    kernel(op, a.ptr + begin, b != nullptr ? b + begin : nullptr, val, out->ptr + begin,
+           end - begin);
+  });
+}
+
+/**
+ * Strided elementwise ops.
+ *
+ * Each operand is described by its own strides and offset over the common output shape, so
+ * broadcast_to views (zero strides), permutations and slices are read in place instead of being
+ * compacted first.  The inner dimension (see StridedShape) is processed in STRIDED_BLOCK-sized
+ * pieces: unit-stride operands go to the SIMD kernel directly, an operand with a zero inner stride
+ * becomes the kernel's scalar (or is splatted), and anything else is gathered into a small buffer.
+ */
+#define STRIDED_BLOCK 2048
+
+SimdOp SimdOpByName(const std::string& name) {
+  static const std::pair<const char*, SimdOp> ops[] = {
+      {"add", kSimdAdd}, {"mul", kSimdMul}, {"div", kSimdDiv}, {"maximum", kSimdMaximum},
+      {"eq", kSimdEq}, {"ge", kSimdGe}, {"power", kSimdPower}, {"log", kSimdLog},
+      {"exp", kSimdExp}, {"tanh", kSimdTanh}, {"sign", kSimdSign}, {"abs", kSimdAbs},
+      {"gelu", kSimdGelu}, {"gelu_grad", kSimdGeluGrad}};
+  for (const auto& op : ops) {
+    if (name == op.first) return op.second;
+  }
+  throw std::invalid_argument("unknown elementwise op: " + name);
+}
+
+const scalar_t* StridedBlock(const scalar_t* p, ptrdiff_t stride, size_t len, scalar_t* buf) {
+  // pointer to len contiguous values of a strided run, gathering into buf when needed
+  if (stride == 1) return p;
+  if (stride == 0) {
+    std::fill(buf, buf + len, *p);
+  } else {
+    for (size_t i = 0; i < len; i++) buf[i] = p[(ptrdiff_t)i * stride];
+  }
+  return buf;
+}
+
+void StridedApply(SimdOp op, const scalar_t* a, std::vector<int64_t> a_strides, size_t a_offset,
+                  const scalar_t* b, std::vector<int64_t> b_strides, size_t b_offset, scalar_t val,
+                  AlignedArray* out, const std::vector<int64_t>& shape, size_t grain) {
+  /**
+   * out = op(a, b) (or op(a, val) when b is null) where out is compact and a / b are strided
+   * views with the shape of out.
+   */
+  StridedShape s(shape, a_strides, a_offset, b != nullptr ? &b_strides : nullptr, b_offset);
+  ptrdiff_t sa_in = s.strides[0].back(), sb_in = s.strides[1].back();
+  SimdKernel kernel = simd_isa->kernel;
+
+  StridedBlocks(s, STRIDED_BLOCK, grain, [&](size_t i, ptrdiff_t pos_a, ptrdiff_t pos_b, size_t len) {
+    static thread_local scalar_t a_buf[STRIDED_BLOCK], b_buf[STRIDED_BLOCK];
+    const scalar_t* pa = StridedBlock(a + pos_a, sa_in, len, a_buf);
+    const scalar_t* pb = nullptr;
+    scalar_t v = val;
+    if (b != nullptr) {
+      if (sb_in == 0) {
+        v = b[pos_b];
+      } else {
+        pb = StridedBlock(b + pos_b, sb_in, len, b_buf);
+      }
+    }
+    kernel(op, pa, pb, v, out->ptr + i, len);
+  });
+}
+
+void EwiseStrided(const std::string& op, const AlignedArray& a, std::vector<int64_t> a_strides,
+                  size_t a_offset, const AlignedArray& b, std::vector<int64_t> b_strides,
+                  size_t b_offset, AlignedArray* out, std::vector<int64_t> shape) {
+  /**
+   * Elementwise binary op ("add", "mul", "div", "maximum", "eq", "ge", "gelu_grad") on two
+   * strided views.
+   *
+   * Args:
+   *   a, a_strides, a_offset: first operand and its strides / offset over shape
+   *   b, b_strides, b_offset: second operand and its strides / offset over shape
+   *   out: compact array with the given shape
+   */
+  SimdOp simd_op = SimdOpByName(op);
+  StridedApply(simd_op, a.ptr, a_strides, a_offset, b.ptr, b_strides, b_offset, 0, out, shape,
+               simd_op == kSimdGeluGrad ? PARALLEL_GRAIN_HEAVY : PARALLEL_GRAIN);
+}
+
+void ScalarStrided(const std::string& op, const AlignedArray& a, std::vector<int64_t> a_strides,
+                   size_t a_offset, scalar_t val, AlignedArray* out, std::vector<int64_t> shape) {
+  /**
+   * Scalar op (the binary ops and "power") or unary function ("log", "exp", "tanh", "gelu",
+   * "sign", "abs"; val is ignored) on a strided view.
+   */
+  SimdOp simd_op = SimdOpByName(op);
+  bool heavy = simd_op == kSimdPower || simd_op == kSimdLog || simd_op == kSimdExp ||
+               simd_op == kSimdTanh || simd_op == kSimdGelu;
+  StridedApply(simd_op, a.ptr, a_strides, a_offset, nullptr, std::vector<int64_t>(), 0, val, out,
+               shape, heavy ? PARALLEL_GRAIN_HEAVY : PARALLEL_GRAIN);
+}
+
+void EwiseAdd(const AlignedArray& a, const AlignedArray& b, AlignedArray* out) {
+  /**
+   * Set entries in out to be the sum of correspondings entires in a and b.
+   */
+  SimdApply(kSimdAdd, a, b.ptr, 0, out, PARALLEL_GRAIN);
+}
+
+void ScalarAdd(const AlignedArray& a, scalar_t val, AlignedArray* out) {
+  /**
+   * Set entries in out to be the sum of corresponding entry in a plus the scalar val.
+   */
+  SimdApply(kSimdAdd, a, nullptr, val, out, PARALLEL_GRAIN);
+}
+
+
+/**
+ * In the code the follows, use the above template to create analogous element-wise
+ * and and scalar operators for the following functions.  See the numpy backend for
+ * examples of how they should work.
+ *   - EwiseMul, ScalarMul
+ *   - EwiseDiv, ScalarDiv
+ *   - ScalarPower
+ *   - EwiseMaximum, ScalarMaximum
+ *   - EwiseEq, ScalarEq
+ *   - EwiseGe, ScalarGe
+ *   - EwiseLog
+ *   - EwiseExp
+ *   - EwiseTanh
+ *
+ * If you implement all these naively, there will be a lot of repeated code, so
+ * you are welcome (but not required), to use macros or templates to define these
+ * functions (however you want to do so, as long as the functions match the proper)
+ * signatures above.
+ */
+
+ void EwiseMul(const AlignedArray &a, const AlignedArray &b, AlignedArray *out){
+  SimdApply(kSimdMul, a, b.ptr, 0, out, PARALLEL_GRAIN);
+}
+
+void ScalarMul(const AlignedArray &a, const scalar_t &val, AlignedArray *out){
+  SimdApply(kSimdMul, a, nullptr, val, out, PARALLEL_GRAIN);
+}
+
+ void EwiseDiv(const AlignedArray &a, const AlignedArray &b, AlignedArray *out){
+  SimdApply(kSimdDiv, a, b.ptr, 0, out, PARALLEL_GRAIN);
+}
+
+void ScalarDiv(const AlignedArray &a, const scalar_t &val, AlignedArray *out){
+  SimdApply(kSimdDiv, a, nullptr, val, out, PARALLEL_GRAIN);
+}
+
+void ScalarPower(const AlignedArray &a, const scalar_t &val, AlignedArray *out){
+  SimdApply(kSimdPower, a, nullptr, val, out, PARALLEL_GRAIN_HEAVY);
+}
+
+void EwiseMaximum(const AlignedArray &a, const AlignedArray &b, AlignedArray *out){
+  SimdApply(kSimdMaximum, a, b.ptr, 0, out, PARALLEL_GRAIN);
+}
+
+void ScalarMaximum(const AlignedArray &a, const scalar_t &val, AlignedArray *out){
+  SimdApply(kSimdMaximum, a, nullptr, val, out, PARALLEL_GRAIN);
+}
+
+void EwiseEq(const AlignedArray &a, const AlignedArray &b, AlignedArray *out){
+  SimdApply(kSimdEq, a, b.ptr, 0, out, PARALLEL_GRAIN);
+}
+
+void ScalarEq(const AlignedArray &a, const scalar_t &val, AlignedArray *out){
+  SimdApply(kSimdEq, a, nullptr, val, out, PARALLEL_GRAIN);
+}
+
+void EwiseGe(const AlignedArray &a, const AlignedArray &b, AlignedArray *out){
+  SimdApply(kSimdGe, a, b.ptr, 0, out, PARALLEL_GRAIN);
+}
+
+void ScalarGe(const AlignedArray &a, const scalar_t &val, AlignedArray *out){
+  SimdApply(kSimdGe, a, nullptr, val, out, PARALLEL_GRAIN);
+}
+
+void EwiseLog(const AlignedArray &a, AlignedArray *out){
+  SimdApply(kSimdLog, a, nullptr, 0, out, PARALLEL_GRAIN_HEAVY);
+}
+
+void EwiseExp(const AlignedArray &a, AlignedArray *out){
+  SimdApply(kSimdExp, a, nullptr, 0, out, PARALLEL_GRAIN_HEAVY);
+}
+
+void EwiseTanh(const AlignedArray &a, AlignedArray *out){
+  SimdApply(kSimdTanh, a, nullptr, 0, out, PARALLEL_GRAIN_HEAVY);
+}
+
+void EwiseGelu(const AlignedArray &a, AlignedArray *out){
+  // GELU, tanh approximation
+  SimdApply(kSimdGelu, a, nullptr, 0, out, PARALLEL_GRAIN_HEAVY);
+}
+
+void EwiseGeluGrad(const AlignedArray &a, const AlignedArray &b, AlignedArray *out){
+  // out = b * GELU'(a): the input gradient of EwiseGelu(a) for an output gradient b
+  SimdApply(kSimdGeluGrad, a, b.ptr, 0, out, PARALLEL_GRAIN_HEAVY);
+}
+
+void EwiseSign(const AlignedArray &a, AlignedArray *out){
+  SimdApply(kSimdSign, a, nullptr, 0, out, PARALLEL_GRAIN);
+}
+
+void EwiseAbs(const AlignedArray &a, AlignedArray *out){
+  SimdApply(kSimdAbs, a, nullptr, 0, out, PARALLEL_GRAIN);
+}
+
+/**
+ * Packed, cache-blocked GEMM.
+ *
+ * C (m x p) = A (m x n) * B (n x p), where A and B are addressed through arbitrary row/column
+ * strides, so that transposed operands never need to be compacted first.  The loop nest follows
+ * the usual BLIS structure:
+ *   - B is split into GEMM_NC-wide column blocks (sized for L3) and GEMM_KC-deep slices, and each
+ *     slice is packed into NR-wide micro-panels (one micro-panel stays in L1),
+ *   - A is split into GEMM_MC-tall row blocks (sized for L2) packed into MR-tall micro-panels,
+ *   - an MR x NR register micro-kernel multiplies one A micro-panel by one B micro-panel.
+ * The micro-kernel (and with it MR x NR) is chosen at run time with the elementwise instruction
+ * set: 6x32 on AVX-512, 6x16 on AVX2/FMA, and a portable 4x16 otherwise.
+ * Packing pads partial panels with zeros, and partial tiles of C are computed into a scratch tile
+ * by the same micro-kernel, so every shape goes through the packed path.
+ */
+#define GEMM_MR_MAX 6   // largest micro-tile of any variant below
+#define GEMM_NR_MAX 32
+#define GEMM_KC 256
+#define GEMM_MC 96      // a multiple of every variant's MR
+#define GEMM_NC 4096
+#define GEMM_PARALLEL_MIN_FLOPS (1 << 18)  // below this much work per task, stay serial
+
+typedef void (*GemmMicroKernelFn)(size_t, const scalar_t*, const scalar_t*, scalar_t*, size_t, bool);
+
+struct GemmKernel {
+  const char* isa;  // elementwise instruction set (SimdIsa::name) this variant goes with
+  size_t mr, nr;    // micro-tile: mr rows of A by nr columns of B
+  GemmMicroKernelFn micro;
+};
+
+#ifdef NEEDLE_X86
+SIMD_TARGET("avx512f")
+void GemmMicroKernelAvx512(size_t kc, const scalar_t* __restrict__ a, const scalar_t* __restrict__ b,
+                           scalar_t* c, size_t ldc, bool accumulate) {
+  /**
+   * 6x32 AVX-512 micro-kernel: c[0:6, 0:32] (+)= a_panel * b_panel.
+   */
+  __m512 acc[6][2];
+#pragma GCC unroll 6
+  for (int r = 0; r < 6; ++r) {
+    acc[r][0] = accumulate ? _mm512_loadu_ps(c + r * ldc) : _mm512_setzero_ps();
+    acc[r][1] = accumulate ? _mm512_loadu_ps(c + r * ldc + 16) : _mm512_setzero_ps();
+  }
+  for (size_t k = 0; k < kc; ++k) {
+    __m512 b0 = _mm512_load_ps(b);
+    __m512 b1 = _mm512_load_ps(b + 16);
+#pragma GCC unroll 6
+    for (int r = 0; r < 6; ++r) {
+      __m512 av = _mm512_set1_ps(a[r]);
+      acc[r][0] = _mm512_fmadd_ps(av, b0, acc[r][0]);
+      acc[r][1] = _mm512_fmadd_ps(av, b1, acc[r][1]);
+    }
+    a += 6;
+    b += 32;
+  }
+#pragma GCC unroll 6
+  for (int r = 0; r < 6; ++r) {
+    _mm512_storeu_ps(c + r * ldc, acc[r][0]);
+    _mm512_storeu_ps(c + r * ldc + 16, acc[r][1]);
+  }
+}
+
+SIMD_TARGET("avx2,fma")
+void GemmMicroKernelAvx2(size_t kc, const scalar_t* __restrict__ a, const scalar_t* __restrict__ b,
+                         scalar_t* c, size_t ldc, bool accumulate) {
+  /**
+   * 6x16 AVX2/FMA micro-kernel: c[0:6, 0:16] (+)= a_panel * b_panel.
+   */
+  __m256 acc[6][2];
+#pragma GCC unroll 6
+  for (int r = 0; r < 6; ++r) {
+    acc[r][0] = accumulate ? _mm256_loadu_ps(c + r * ldc) : _mm256_setzero_ps();
+    acc[r][1] = accumulate ? _mm256_loadu_ps(c + r * ldc + 8) : _mm256_setzero_ps();
+  }
+  for (size_t k = 0; k < kc; ++k) {
+    __m256 b0 = _mm256_load_ps(b);
+    __m256 b1 = _mm256_load_ps(b + 8);
+#pragma GCC unroll 6
+    for (int r = 0; r < 6; ++r) {
+      __m256 av = _mm256_broadcast_ss(a + r);
+      acc[r][0] = _mm256_fmadd_ps(av, b0, acc[r][0]);
+      acc[r][1] = _mm256_fmadd_ps(av, b1, acc[r][1]);
+    }
+    a += 6;
+    b += 16;
+  }
+#pragma GCC unroll 6
+  for (int r = 0; r < 6; ++r) {
+    _mm256_storeu_ps(c + r * ldc, acc[r][0]);
+    _mm256_storeu_ps(c + r * ldc + 8, acc[r][1]);
+  }
+}
+#endif
+
+void GemmMicroKernelPortable(size_t kc, const scalar_t* __restrict__ a, const scalar_t* __restrict__ b,
+                             scalar_t* c, size_t ldc, bool accumulate) {
+  /**
+   * Portable 4x16 micro-kernel; the fixed-size accumulator is left for the compiler to vectorize.
+   */
+  scalar_t acc[4][16];
+  for (int r = 0; r < 4; ++r)
+    for (int j = 0; j < 16; ++j) acc[r][j] = accumulate ? c[r * ldc + j] : 0;
+  for (size_t k = 0; k < kc; ++k) {
+    for (int r = 0; r < 4; ++r)
+      for (int j = 0; j < 16; ++j) acc[r][j] += a[r] * b[j];
+    a += 4;
+    b += 16;
+  }
+  for (int r = 0; r < 4; ++r)
+    for (int j = 0; j < 16; ++j) c[r * ldc + j] = acc[r][j];
+}
+
+// the portable variant comes last and serves every other instruction set
+const GemmKernel kGemmKernels[] = {
+#ifdef NEEDLE_X86
+    {"avx512", 6, 32, GemmMicroKernelAvx512},
+    {"avx2", 6, 16, GemmMicroKernelAvx2},
+#endif
+    {"", 4, 16, GemmMicroKernelPortable}};
+
+const GemmKernel& SelectGemmKernel() {
+  /**
+   * The micro-kernel matching the selected elementwise instruction set (see SetSimdIsa), so that
+   * one binary uses the widest GEMM the CPU runs and set_simd_isa / NEEDLE_SIMD narrow it too.
+   */
+  const size_t count = sizeof(kGemmKernels) / sizeof(kGemmKernels[0]);
+  for (size_t i = 0; i + 1 < count; ++i)
+    if (std::strcmp(kGemmKernels[i].isa, simd_isa->name) == 0) return kGemmKernels[i];
+  return kGemmKernels[count - 1];
+}
+
+inline void GemmEdgeKernel(const GemmKernel& gk, size_t mr, size_t nr, size_t kc, const scalar_t* a,
+                           const scalar_t* b, scalar_t* c, size_t ldc, bool accumulate) {
+  /**
+   * Partial mr x nr tile of C (mr <= gk.mr, nr <= gk.nr): run the full micro-kernel on the
+   * zero-padded panels into a scratch tile and copy back only the valid part.
+   */
+  alignas(64) scalar_t tile[GEMM_MR_MAX * GEMM_NR_MAX];
+  gk.micro(kc, a, b, tile, gk.nr, false);
+  for (size_t r = 0; r < mr; ++r) {
+    for (size_t j = 0; j < nr; ++j) {
+      c[r * ldc + j] = accumulate ? c[r * ldc + j] + tile[r * gk.nr + j] : tile[r * gk.nr + j];
+    }
+  }
+}
+
+void GemmPackA(const scalar_t* a, ptrdiff_t rs, ptrdiff_t cs, size_t mc, size_t kc, size_t mr_max,
+               scalar_t* out) {
+  /**
+   * Pack an mc x kc block of A into mr_max-tall micro-panels, k-major within a panel, padding the
+   * last panel with zero rows.
+   */
+  for (size_t i = 0; i < mc; i += mr_max) {
+    size_t mr = std::min<size_t>(mr_max, mc - i);
+    for (size_t k = 0; k < kc; ++k) {
+      const scalar_t* src = a + i * rs + k * cs;
+      for (size_t r = 0; r < mr; ++r) out[r] = src[r * rs];
+      for (size_t r = mr; r < mr_max; ++r) out[r] = 0;
+      out += mr_max;
+    }
+  }
+}
+
+void GemmPackB(const scalar_t* b, ptrdiff_t rs, ptrdiff_t cs, size_t kc, size_t nc, size_t nr_max,
+               scalar_t* out) {
+  /**
+   * Pack a kc x nc block of B into nr_max-wide micro-panels, k-major within a panel, padding the
+   * last panel with zero columns.
+   */
+  for (size_t j = 0; j < nc; j += nr_max) {
+    size_t nr = std::min<size_t>(nr_max, nc - j);
+    for (size_t k = 0; k < kc; ++k) {
+      const scalar_t* src = b + k * rs + j * cs;
+      if (cs == 1) {
+        std::memcpy(out, src, nr * ELEM_SIZE);
+      } else {
+        for (size_t c = 0; c < nr; ++c) out[c] = src[c * cs];
+      }
+      for (size_t c = nr; c < nr_max; ++c) out[c] = 0;
+      out += nr_max;
+    }
+  }
+}
+
+void Gemm(size_t m, size_t n, size_t p, const scalar_t* a, ptrdiff_t a_rs, ptrdiff_t a_cs,
+          const scalar_t* b, ptrdiff_t b_rs, ptrdiff_t b_cs, scalar_t* out, size_t ldo,
+          bool accumulate = false) {
+  /**
+   * out[i, j] (+)= sum_k a[i * a_rs + k * a_cs] * b[k * b_rs + j * b_cs]
+   *
+   * Args:
+   *   m, n, p: a is m x n, b is n x p, out is m x p
+   *   a_rs, a_cs: row / column strides of a (in elements)
+   *   b_rs, b_cs: row / column strides of b (in elements)
+   *   out: output with row stride ldo and unit column stride
+   *   accumulate: add to the existing contents of out instead of overwriting them
+   */
+  if (m == 0 || p == 0) return;
+  if (n == 0) {
+    if (!accumulate)
+      for (size_t i = 0; i < m; ++i) std::memset(out + i * ldo, 0, p * ELEM_SIZE);
+    return;
+  }
+
+  const GemmKernel& gk = SelectGemmKernel();
+  size_t mr_max = gk.mr, nr_max = gk.nr;
+  size_t kc_max = std::min<size_t>(GEMM_KC, n);
+  size_t nc_max = std::min<size_t>(GEMM_NC, (p + nr_max - 1) / nr_max * nr_max);
+  AlignedArray packed_b(kc_max * nc_max);
+  size_t num_ic = (m + GEMM_MC - 1) / GEMM_MC;
+  size_t num_threads = ThreadPool::Instance().NumThreads();
+
+  for (size_t jc = 0; jc < p; jc += GEMM_NC) {
+    size_t nc = std::min<size_t>(GEMM_NC, p - jc);
+    size_t num_jr = (nc + nr_max - 1) / nr_max;
+    for (size_t pc = 0; pc < n; pc += GEMM_KC) {
+      size_t kc = std::min<size_t>(GEMM_KC, n - pc);
+      bool acc = accumulate || pc > 0;
+
+      ParallelFor(0, num_jr, std::max<size_t>(1, PARALLEL_GRAIN / (kc * nr_max)),
+                  [&](size_t lo, size_t hi) {
+        GemmPackB(b + pc * b_rs + (jc + lo * nr_max) * b_cs, b_rs, b_cs, kc,
+                  std::min(nc, hi * nr_max) - lo * nr_max, nr_max, packed_b.ptr + lo * nr_max * kc);
+      });
+
+      // One task per (MC row block, group of NR-wide panels).  Small m is split along the panels as
+      // well so that every thread gets work; each task packs its own copy of the A block.
+      size_t num_jg = std::min(num_jr, std::max<size_t>(1, (2 * num_threads + num_ic - 1) / num_ic));
+      size_t task_flops = GEMM_MC * kc * (nc / num_jg + 1);
+      size_t grain = std::max<size_t>(1, GEMM_PARALLEL_MIN_FLOPS / task_flops);
+      ParallelFor(0, num_ic * num_jg, grain, [&](size_t t_begin, size_t t_end) {
+        AlignedArray packed_a(GEMM_MC * kc);
+        size_t packed_ic = m;
+        for (size_t t = t_begin; t < t_end; ++t) {
+          size_t ic = t / num_jg * GEMM_MC, g = t % num_jg;
+          size_t mc = std::min<size_t>(GEMM_MC, m - ic);
+          if (packed_ic != ic) {
+            GemmPackA(a + ic * a_rs + pc * a_cs, a_rs, a_cs, mc, kc, mr_max, packed_a.ptr);
+            packed_ic = ic;
+          }
+          for (size_t jp = g * num_jr / num_jg; jp < (g + 1) * num_jr / num_jg; ++jp) {
+            size_t jr = jp * nr_max;
+            size_t nr = std::min<size_t>(nr_max, nc - jr);
+            const scalar_t* bp = packed_b.ptr + jr * kc;
+            for (size_t ir = 0; ir < mc; ir += mr_max) {
+              size_t mr = std::min<size_t>(mr_max, mc - ir);
+              const scalar_t* ap = packed_a.ptr + ir * kc;
+              scalar_t* cp = out + (ic + ir) * ldo + jc + jr;
+              if (mr == mr_max && nr == nr_max) {
+                gk.micro(kc, ap, bp, cp, ldo, acc);
+              } else {
+                GemmEdgeKernel(gk, mr, nr, kc, ap, bp, cp, ldo, acc);
+              }
+            }
+          }
+        }
+      });
+    }
+  }
+}
+
+void Matmul(const AlignedArray& a, const AlignedArray& b, AlignedArray* out, size_t m, size_t n,
+            size_t p) {
+  /**
+   * Multiply two (compact) matrices into an output (also compact) matrix, using the packed GEMM
+   * above for every shape.
+   *
+   * Args:
+   *   a: compact 2D array of size m x n
+   *   b: compact 2D array of size n x p
+   *   out: compact 2D array of size m x p to write the output to
+   *   m: rows of a / out
+   *   n: columns of a / rows of b
+   *   p: columns of b / out
+   */
+  Gemm(m, n, p, a.ptr, n, 1, b.ptr, p, 1, out->ptr, p);
+}
+
+void Bmm(const AlignedArray& a, const AlignedArray& b, AlignedArray* out, size_t batch,
+         size_t m, size_t n, size_t p, size_t a_batch_stride, size_t b_batch_stride,
+         bool transpose_a, bool transpose_b) {
+  /**
+   * Batched matrix multiply out[i] = op(a[i]) @ op(b[i]) over compact operands, where op() is an
+   * optional transpose.  The transposes are folded into the strides handed to Gemm, so neither
+   * operand is ever copied.
+   *
+   * Args:
+   *   a: compact array of batch matrices, each m x n (or n x m if transpose_a)
+   *   b: compact array of batch matrices, each n x p (or p x n if transpose_b)
+   *   out: compact array of batch matrices, each m x p
+   *   batch: number of matrices in out
+   *   m, n, p: sizes of op(a[i]) (m x n) and op(b[i]) (n x p)
+   *   a_batch_stride, b_batch_stride: distance between consecutive matrices of a / b in elements;
+   *     0 broadcasts a single matrix over the whole batch
+   *   transpose_a, transpose_b: whether a[i] / b[i] are stored transposed
+   */
+  ptrdiff_t a_rs = transpose_a ? 1 : n, a_cs = transpose_a ? m : 1;
+  ptrdiff_t b_rs = transpose_b ? 1 : p, b_cs = transpose_b ? n : 1;
+  size_t flops = std::max<size_t>(1, (size_t)m * n * p);
+
+  // Large matrices parallelize inside Gemm; many small ones are spread over the batch instead.
+  ParallelFor(0, batch, std::max<size_t>(1, GEMM_PARALLEL_MIN_FLOPS / flops),
+              [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      Gemm(m, n, p, a.ptr + i * a_batch_stride, a_rs, a_cs, b.ptr + i * b_batch_stride, b_rs, b_cs,
+           out->ptr + i * m * p, p);
+    }
+  });
+}
+
+#define ATTN_BLOCK_Q 64    // query rows per attention tile
+#define ATTN_BLOCK_K 128   // key rows per attention tile
+
+inline bool AttnMasked(bool causal, size_t i, size_t j, size_t n, size_t m) {
+  // Same triangle as MultiHeadAttention.create_causal_mask: key j is hidden from query i when
+  // j > i + (m - n).
+  return causal && j + n > i + m;
+}
+
+void FlashAttention(const AlignedArray& q, const AlignedArray& k, const AlignedArray& v,
+                    const AlignedArray& bias, AlignedArray* out, AlignedArray* lse, size_t batch,
+                    size_t n, size_t m, size_t d, size_t dv, size_t bias_batch, scalar_t scale,
+                    bool has_bias, bool causal) {
+  /**
+   * Fused attention out = softmax(q @ k^T * scale + bias) @ v for every batch entry.  Queries and
+   * keys are processed in ATTN_BLOCK_Q x ATTN_BLOCK_K tiles with an online softmax (running row
+   * max and normalizer), so the n x m score matrix is never stored.  The log-sum-exp of every
+   * score row is written to lse for the backward pass.
+   *
+   * Args:
+   *   q: compact array of size batch x n x d
+   *   k: compact array of size batch x m x d
+   *   v: compact array of size batch x m x dv
+   *   bias: compact array of size bias_batch x n x m added to the scaled scores (read iff
+   *     has_bias); batch entry b uses matrix b % bias_batch, so a bias shared by the leading batch
+   *     axes is not copied out to the full batch
+   *   out: compact array of size batch x n x dv to write the result to
+   *   lse: compact array of size batch x n to write the row log-sum-exp to
+   *   scale: multiplier applied to q @ k^T before the bias is added
+   *   causal: hide key j from query i when j > i + m - n, like MultiHeadAttention's mask
+   */
+  size_t num_qb = (n + ATTN_BLOCK_Q - 1) / ATTN_BLOCK_Q;
+  size_t flops = std::max<size_t>(1, (size_t)ATTN_BLOCK_Q * m * (d + dv));
+
+  ParallelFor(0, (size_t)batch * num_qb, std::max<size_t>(1, GEMM_PARALLEL_MIN_FLOPS / flops),
+              [&](size_t t_begin, size_t t_end) {
+    AlignedArray s(ATTN_BLOCK_Q * ATTN_BLOCK_K), acc(ATTN_BLOCK_Q * std::max<size_t>(dv, 1));
+    scalar_t row_max[ATTN_BLOCK_Q], row_sum[ATTN_BLOCK_Q];
+
+    for (size_t t = t_begin; t < t_end; t++) {
+      size_t b = t / num_qb, i0 = t % num_qb * ATTN_BLOCK_Q;
+      size_t bq = std::min<size_t>(ATTN_BLOCK_Q, n - i0);
+      const scalar_t* qp = q.ptr + (b * n + i0) * d;
+      const scalar_t* kp = k.ptr + b * m * d;
+      const scalar_t* vp = v.ptr + b * m * dv;
+      const scalar_t* biasp = has_bias ? bias.ptr + (b % bias_batch * n + i0) * m : nullptr;
+
+      // Key blocks past the diagonal are skipped when every row of the tile still sees a key.
+      size_t m_end = m;
+      if (causal && i0 + m >= n) m_end = std::min<size_t>(m, i0 + bq + m - n);
+
+      std::fill(row_max, row_max + bq, -INFINITY);
+      std::fill(row_sum, row_sum + bq, 0);
+      std::fill(acc.ptr, acc.ptr + bq * dv, 0);
+
+      for (size_t j0 = 0; j0 < m_end; j0 += ATTN_BLOCK_K) {
+        size_t bk = std::min<size_t>(ATTN_BLOCK_K, m_end - j0);
+        Gemm(bq, d, bk, qp, d, 1, kp + j0 * d, 1, d, s.ptr, bk);
+
+        for (size_t i = 0; i < bq; i++) {
+          scalar_t* si = s.ptr + i * bk;
+          scalar_t mx = row_max[i];
+          for (size_t j = 0; j < bk; j++) {
+            scalar_t x = si[j] * scale;
+            if (has_bias) x += biasp[i * m + j0 + j];
+            if (AttnMasked(causal, i0 + i, j0 + j, n, m)) x = -FLT_MAX;
+            si[j] = x;
+            mx = std::max(mx, x);
+          }
+          scalar_t alpha = std::exp(row_max[i] - mx), sum = 0;
+          for (size_t j = 0; j < bk; j++) {
+            si[j] = std::exp(si[j] - mx);
+            sum += si[j];
+          }
+          row_sum[i] = row_sum[i] * alpha + sum;
+          row_max[i] = mx;
+          for (size_t c = 0; c < dv; c++) acc.ptr[i * dv + c] *= alpha;
+        }
+        Gemm(bq, bk, dv, s.ptr, bk, 1, vp + j0 * dv, dv, 1, acc.ptr, dv, true);
+      }
+
+      for (size_t i = 0; i < bq; i++) {
+        scalar_t inv = row_sum[i] > 0 ? 1 / row_sum[i] : 0;
+        scalar_t* oi = out->ptr + (b * n + i0 + i) * dv;
+        for (size_t c = 0; c < dv; c++) oi[c] = acc.ptr[i * dv + c] * inv;
+        lse->ptr[b * n + i0 + i] = row_max[i] + std::log(row_sum[i]);
+      }
+    }
+  });
+}
+
+void FlashAttentionBackward(const AlignedArray& out_grad, const AlignedArray& q,
+                            const AlignedArray& k, const AlignedArray& v, const AlignedArray& bias,
+                            const AlignedArray& out, const AlignedArray& lse, AlignedArray* q_grad,
+                            AlignedArray* k_grad, AlignedArray* v_grad, AlignedArray* bias_grad,
+                            size_t batch, size_t n, size_t m, size_t d, size_t dv,
+                            size_t bias_batch, scalar_t scale, bool has_bias, bool causal) {
+  /**
+   * Gradients of FlashAttention.  Probabilities are recomputed tile by tile from the saved
+   * log-sum-exp, so, as in the forward pass, no n x m buffer is needed.  The work is split in two
+   * passes whose tasks own disjoint slices of the gradients, so nothing is accumulated across
+   * threads and the result does not depend on the thread count:
+   *   1. one task per (batch entry, key block) sums k_grad and v_grad of its keys over all query
+   *      blocks;
+   *   2. one task per (bias matrix, query block) sums q_grad of its queries over all key blocks,
+   *      and bias_grad over the batch entries that share the bias matrix as well.
+   * The second pass recomputes the probabilities of the first one.
+   *
+   * Args:
+   *   out_grad: compact array of size batch x n x dv
+   *   q, k, v, bias, bias_batch, scale, causal: the forward inputs
+   *   out, lse: the forward outputs
+   *   q_grad, k_grad, v_grad: compact arrays shaped like q, k, v to write the gradients to
+   *   bias_grad: compact array shaped like bias, bias_batch x n x m (written iff has_bias)
+   */
+  size_t num_qb = (n + ATTN_BLOCK_Q - 1) / ATTN_BLOCK_Q;
+  size_t num_kb = (m + ATTN_BLOCK_K - 1) / ATTN_BLOCK_K;
+  size_t groups = has_bias ? bias_batch : batch;  // batch entries b and b + groups share a task
+
+  // delta_i = sum_c out_grad[i, c] * out[i, c] = sum_j p[i, j] * dp[i, j]
+  std::vector<scalar_t> delta(batch * n);
+  ParallelFor(0, batch * n, std::max<size_t>(1, PARALLEL_GRAIN / std::max<size_t>(dv, 1)),
+              [&](size_t begin, size_t end) {
+    for (size_t r = begin; r < end; r++) {
+      scalar_t acc = 0;
+      for (size_t c = 0; c < dv; c++) acc += out_grad.ptr[r * dv + c] * out.ptr[r * dv + c];
+      delta[r] = acc;
+    }
+  });
+
+  // Probabilities p and score gradients ds = p * (dp - delta) of one bq x bk tile of batch entry b.
+  auto tile = [&](size_t b, size_t i0, size_t bq, size_t j0, size_t bk, scalar_t* p,
+                  scalar_t* ds) {
+    const scalar_t* lp = lse.ptr + b * n + i0;
+    const scalar_t* dl = delta.data() + b * n + i0;
+    Gemm(bq, d, bk, q.ptr + (b * n + i0) * d, d, 1, k.ptr + (b * m + j0) * d, 1, d, p, bk);
+    Gemm(bq, dv, bk, out_grad.ptr + (b * n + i0) * dv, dv, 1, v.ptr + (b * m + j0) * dv, 1, dv,
+         ds, bk);
+    for (size_t i = 0; i < bq; i++) {
+      scalar_t* pi = p + i * bk;
+      scalar_t* dsi = ds + i * bk;
+      const scalar_t* biasi =
+          has_bias ? bias.ptr + (b % bias_batch * n + i0 + i) * m + j0 : nullptr;
+      for (size_t j = 0; j < bk; j++) {
+        if (AttnMasked(causal, i0 + i, j0 + j, n, m)) {
+          // A row that hides every key has the uniform softmax of the forward pass; -FLT_MAX
+          // minus its lse is not representable, so write it directly.
+          pi[j] = i0 + i + m < n ? (scalar_t)1 / m : 0;
+        } else {
+          scalar_t x = pi[j] * scale;
+          if (has_bias) x += biasi[j];
+          pi[j] = std::exp(x - lp[i]);
+        }
+        dsi[j] = pi[j] * (dsi[j] - dl[i]);
+      }
+    }
+  };
+  size_t tile_flops = (size_t)ATTN_BLOCK_Q * ATTN_BLOCK_K * (2 * d + 2 * dv);
+
+  ParallelFor(0, batch * num_kb,
+              std::max<size_t>(1, GEMM_PARALLEL_MIN_FLOPS /
+                                      std::max<size_t>(1, num_qb * tile_flops)),
+              [&](size_t t_begin, size_t t_end) {
+    AlignedArray p(ATTN_BLOCK_Q * ATTN_BLOCK_K), ds(ATTN_BLOCK_Q * ATTN_BLOCK_K);
+    for (size_t t = t_begin; t < t_end; t++) {
+      size_t b = t / num_kb, j0 = t % num_kb * ATTN_BLOCK_K;
+      size_t bk = std::min<size_t>(ATTN_BLOCK_K, m - j0);
+      scalar_t* dk = k_grad->ptr + (b * m + j0) * d;
+      scalar_t* dvp = v_grad->ptr + (b * m + j0) * dv;
+      std::fill(dk, dk + bk * d, 0);
+      std::fill(dvp, dvp + bk * dv, 0);
+      for (size_t i0 = 0; i0 < n; i0 += ATTN_BLOCK_Q) {
+        size_t bq = std::min<size_t>(ATTN_BLOCK_Q, n - i0);
+        tile(b, i0, bq, j0, bk, p.ptr, ds.ptr);
+        Gemm(bk, bq, dv, p.ptr, 1, bk, out_grad.ptr + (b * n + i0) * dv, dv, 1, dvp, dv, true);
+        Gemm(bk, bq, d, ds.ptr, 1, bk, q.ptr + (b * n + i0) * d, d, 1, dk, d, true);
+      }
+      for (size_t e = 0; e < bk * d; e++) dk[e] *= scale;
+    }
+  });
+
+  ParallelFor(0, groups * num_qb,
+              std::max<size_t>(1, GEMM_PARALLEL_MIN_FLOPS /
+                                      std::max<size_t>(1, batch / groups * num_kb * tile_flops)),
+              [&](size_t t_begin, size_t t_end) {
+    AlignedArray p(ATTN_BLOCK_Q * ATTN_BLOCK_K), ds(ATTN_BLOCK_Q * ATTN_BLOCK_K);
+    for (size_t t = t_begin; t < t_end; t++) {
+      size_t r = t / num_qb, i0 = t % num_qb * ATTN_BLOCK_Q;
+      size_t bq = std::min<size_t>(ATTN_BLOCK_Q, n - i0);
+      scalar_t* dbias = has_bias ? bias_grad->ptr + (r * n + i0) * m : nullptr;
+      if (has_bias) std::fill(dbias, dbias + bq * m, 0);
+      for (size_t b = r; b < batch; b += groups) {
+        scalar_t* dq = q_grad->ptr + (b * n + i0) * d;
+        std::fill(dq, dq + bq * d, 0);
+        for (size_t j0 = 0; j0 < m; j0 += ATTN_BLOCK_K) {
+          size_t bk = std::min<size_t>(ATTN_BLOCK_K, m - j0);
+          tile(b, i0, bq, j0, bk, p.ptr, ds.ptr);
+          Gemm(bq, bk, d, ds.ptr, bk, 1, k.ptr + (b * m + j0) * d, d, 1, dq, d, true);
+          if (has_bias) {
+            for (size_t i = 0; i < bq; i++) {
+              for (size_t j = 0; j < bk; j++) dbias[i * m + j0 + j] += ds.ptr[i * bk + j];
+            }
+          }
+        }
+        for (size_t e = 0; e < bq * d; e++) dq[e] *= scale;
+      }
+    }
+  });
+}
+
+/**
+ * Convolution.  Images are NHWC and filters K x K x (C_in / groups) x C_out, as in ops.Conv; the
+ * g-th block of output channels only sees the g-th block of input channels.  The im2col matrix
+ * (one row per output pixel holding the K * K * C_in / groups taps of every group in turn) is
+ * built a block of rows at a time, with the zero padding written directly into the block instead
+ * of materializing a padded copy of the input, and each group's columns of the block are
+ * multiplied by its filters with Gemm.  Depthwise convolutions (one input channel per group) skip
+ * im2col and run direct loops that vectorize over the channels.
+ */
+#define CONV_IM2COL_ELEMS (1 << 20)  // im2col elements per block (4MB)
+
+struct ConvShape {
+  ConvShape(size_t N, size_t H, size_t W, size_t C_in, size_t K, size_t C_out, size_t stride,
+            size_t padding, size_t groups)
+      : N(N), H(H), W(W), C_in(C_in), K(K), C_out(C_out), stride(stride), padding(padding),
+        groups(groups), cg_in(C_in / groups), cg_out(C_out / groups), H_out(OutSize(H)),
+        W_out(OutSize(W)), rows(N * H_out * W_out), group_len(K * K * cg_in), row_len(K * K * C_in) {}
+
+  size_t OutSize(size_t in) const {
+    return in + 2 * padding < K ? 0 : (in + 2 * padding - K) / stride + 1;
+  }
+
+  // Input row / column of tap k for output row / column o, or -1 when it falls in the padding.
+  ptrdiff_t InputPos(size_t o, size_t k, size_t in) const {
+    ptrdiff_t i = (ptrdiff_t)(o * stride + k) - (ptrdiff_t)padding;
+    return i >= 0 && i < (ptrdiff_t)in ? i : -1;
+  }
+  // Output row / column that reads input row / column i through tap k, or -1 if there is none.
+  ptrdiff_t OutputPos(size_t i, size_t k, size_t out) const {
+    ptrdiff_t o = (ptrdiff_t)(i + padding) - (ptrdiff_t)k;
+    return o >= 0 && o % stride == 0 && (size_t)o / stride < out ? o / stride : -1;
+  }
+
+  size_t N, H, W, C_in, K, C_out, stride, padding, groups;
+  size_t cg_in, cg_out;            // channels per group
+  size_t H_out, W_out, rows;       // rows = output pixels = rows of the im2col matrix
+  size_t group_len, row_len;       // im2col columns per group / in total
+};
+
+void Conv2dIm2col(const scalar_t* a, const ConvShape& c, size_t row_begin, size_t row_end,
+                  scalar_t* out) {
+  /**
+   * Write im2col rows [row_begin, row_end) (output pixels in NHW order) to out.  The taps of one
+   * kernel row are a contiguous run of the input, so without groups every row is a few memcpys
+   * and zero fills.
+   */
+  ParallelFor(row_begin, row_end, std::max<size_t>(1, PARALLEL_GRAIN / c.row_len),
+              [&](size_t begin, size_t end) {
+    for (size_t r = begin; r < end; r++) {
+      size_t n = r / (c.H_out * c.W_out), oh = r / c.W_out % c.H_out, ow = r % c.W_out;
+      ptrdiff_t iw0 = (ptrdiff_t)(ow * c.stride) - (ptrdiff_t)c.padding;
+      size_t kw0 = std::min<ptrdiff_t>(c.K, std::max<ptrdiff_t>(0, -iw0));  // taps inside the image
+      size_t kw1 = std::max<ptrdiff_t>(kw0, std::min<ptrdiff_t>(c.K, (ptrdiff_t)c.W - iw0));
+      for (size_t kh = 0; kh < c.K; kh++) {
+        ptrdiff_t ih = c.InputPos(oh, kh, c.H);
+        for (size_t g = 0; g < c.groups; g++) {
+          scalar_t* dst = out + (r - row_begin) * c.row_len + g * c.group_len + kh * c.K * c.cg_in;
+          if (ih < 0) {
+            std::fill(dst, dst + c.K * c.cg_in, 0.0f);
+            continue;
+          }
+          std::fill(dst, dst + kw0 * c.cg_in, 0.0f);
+          if (kw1 > kw0) {
+            // input pixel of tap kw0, then one pixel per further tap
+            const scalar_t* src = a + ((n * c.H + ih) * c.W + iw0 + kw0) * c.C_in + g * c.cg_in;
+            if (c.groups == 1) {
+              std::memcpy(dst + kw0 * c.C_in, src, (kw1 - kw0) * c.C_in * ELEM_SIZE);
+            } else {
+              for (size_t kw = kw0; kw < kw1; kw++)
+                std::memcpy(dst + kw * c.cg_in, src + (kw - kw0) * c.C_in, c.cg_in * ELEM_SIZE);
+            }
+          }
+          std::fill(dst + kw1 * c.cg_in, dst + c.K * c.cg_in, 0.0f);
+        }
+      }
+    }
+  });
+}
+
+void Conv2dCol2im(const scalar_t* cols, const ConvShape& c, size_t n_begin, size_t n_end,
+                  scalar_t* out) {
+  /**
+   * Adjoint of Conv2dIm2col for images [n_begin, n_end): every input pixel gathers the column
+   * entries of the (output pixel, tap) pairs that read it, so the work splits over input pixels
+   * without write conflicts.  cols holds the rows of those images only.
+   */
+  ParallelFor(n_begin * c.H * c.W, n_end * c.H * c.W, std::max<size_t>(1, PARALLEL_GRAIN / c.row_len),
+              [&](size_t begin, size_t end) {
+    for (size_t pix = begin; pix < end; pix++) {
+      size_t n = pix / (c.H * c.W), ih = pix / c.W % c.H, iw = pix % c.W;
+      scalar_t* dst = out + pix * c.C_in;
+      std::fill(dst, dst + c.C_in, 0.0f);
+      for (size_t kh = 0; kh < c.K; kh++) {
+        ptrdiff_t oh = c.OutputPos(ih, kh, c.H_out);
+        if (oh < 0) continue;
+        for (size_t kw = 0; kw < c.K; kw++) {
+          ptrdiff_t ow = c.OutputPos(iw, kw, c.W_out);
+          if (ow < 0) continue;
+          size_t row = ((n - n_begin) * c.H_out + oh) * c.W_out + ow;
+          for (size_t g = 0; g < c.groups; g++) {
+            const scalar_t* src = cols + row * c.row_len + g * c.group_len + (kh * c.K + kw) * c.cg_in;
+            scalar_t* d = dst + g * c.cg_in;
+            for (size_t i = 0; i < c.cg_in; i++) d[i] += src[i];
+          }
+        }
+      }
+    }
+  });
+}
+
+void DepthwiseConv2d(const scalar_t* a, const scalar_t* w, const scalar_t* bias,
+                     const ConvShape& c, scalar_t* out) {
+  /**
+   * Depthwise forward: output channel co reads input channel co / m (m = C_out / C_in) only, so
+   * every output pixel is a sum of K * K channel-wise products.
+   */
+  size_t m = c.cg_out;
+  ParallelFor(0, c.rows, std::max<size_t>(1, PARALLEL_GRAIN_HEAVY / (c.K * c.K * c.C_out)),
+              [&](size_t begin, size_t end) {
+    for (size_t r = begin; r < end; r++) {
+      size_t n = r / (c.H_out * c.W_out), oh = r / c.W_out % c.H_out, ow = r % c.W_out;
+      scalar_t* dst = out + r * c.C_out;
+      if (bias != nullptr) {
+        std::memcpy(dst, bias, c.C_out * ELEM_SIZE);
+      } else {
+        std::fill(dst, dst + c.C_out, 0.0f);
+      }
+      for (size_t kh = 0; kh < c.K; kh++) {
+        ptrdiff_t ih = c.InputPos(oh, kh, c.H);
+        if (ih < 0) continue;
+        for (size_t kw = 0; kw < c.K; kw++) {
+          ptrdiff_t iw = c.InputPos(ow, kw, c.W);
+          if (iw < 0) continue;
+          const scalar_t* src = a + ((n * c.H + ih) * c.W + iw) * c.C_in;
+          const scalar_t* wt = w + (kh * c.K + kw) * c.C_out;
+          if (m == 1) {
+            for (size_t co = 0; co < c.C_out; co++) dst[co] += src[co] * wt[co];
+          } else {
+            for (size_t co = 0; co < c.C_out; co++) dst[co] += src[co / m] * wt[co];
+          }
+        }
+      }
+    }
+  });
+}
+
+void DepthwiseConv2dBackward(const scalar_t* out_grad, const scalar_t* a, const scalar_t* w,
+                             const ConvShape& c, scalar_t* a_grad, scalar_t* w_grad) {
+  /**
+   * Depthwise backward.  The input gradient is gathered per input pixel as in Conv2dCol2im; the
+   * filter gradient is split over the K * K taps, each task owning one row of w_grad.
+   */
+  size_t m = c.cg_out;
+  ParallelFor(0, c.N * c.H * c.W, std::max<size_t>(1, PARALLEL_GRAIN_HEAVY / (c.K * c.K * c.C_out)),
+              [&](size_t begin, size_t end) {
+    for (size_t pix = begin; pix < end; pix++) {
+      size_t n = pix / (c.H * c.W), ih = pix / c.W % c.H, iw = pix % c.W;
+      scalar_t* dst = a_grad + pix * c.C_in;
+      std::fill(dst, dst + c.C_in, 0.0f);
+      for (size_t kh = 0; kh < c.K; kh++) {
+        ptrdiff_t oh = c.OutputPos(ih, kh, c.H_out);
+        if (oh < 0) continue;
+        for (size_t kw = 0; kw < c.K; kw++) {
+          ptrdiff_t ow = c.OutputPos(iw, kw, c.W_out);
+          if (ow < 0) continue;
+          const scalar_t* dy = out_grad + ((n * c.H_out + oh) * c.W_out + ow) * c.C_out;
+          const scalar_t* wt = w + (kh * c.K + kw) * c.C_out;
+          if (m == 1) {
+            for (size_t ci = 0; ci < c.C_in; ci++) dst[ci] += dy[ci] * wt[ci];
+          } else {
+            for (size_t co = 0; co < c.C_out; co++) dst[co / m] += dy[co] * wt[co];
+          }
+        }
+      }
+    }
+  });
+
+  ParallelFor(0, c.K * c.K, 1, [&](size_t begin, size_t end) {
+    for (size_t tap = begin; tap < end; tap++) {
+      size_t kh = tap / c.K, kw = tap % c.K;
+      scalar_t* dst = w_grad + tap * c.C_out;
+      std::fill(dst, dst + c.C_out, 0.0f);
+      for (size_t r = 0; r < c.rows; r++) {
+        size_t n = r / (c.H_out * c.W_out), oh = r / c.W_out % c.H_out, ow = r % c.W_out;
+        ptrdiff_t ih = c.InputPos(oh, kh, c.H), iw = c.InputPos(ow, kw, c.W);
+        if (ih < 0 || iw < 0) continue;
+        const scalar_t* src = a + ((n * c.H + ih) * c.W + iw) * c.C_in;
+        const scalar_t* dy = out_grad + r * c.C_out;
+        if (m == 1) {
+          for (size_t co = 0; co < c.C_out; co++) dst[co] += src[co] * dy[co];
+        } else {
+          for (size_t co = 0; co < c.C_out; co++) dst[co] += src[co / m] * dy[co];
+        }
+      }
+    }
+  });
 }
 
-void ScalarMul(const AlignedArray &a, const scalar_t &val, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = a.ptr[i] * val;
+void Conv2d(const AlignedArray& a, const AlignedArray& w, const AlignedArray& bias,
+            AlignedArray* out, size_t N, size_t H, size_t W, size_t C_in, size_t K,
+            size_t C_out, size_t stride, size_t padding, size_t groups, bool has_bias) {
+  /**
+   * out = conv(a, w) (+ bias), with implicit zero padding.
+   *
+   * Args:
+   *   a: compact array of size N x H x W x C_in
+   *   w: compact array of size K x K x (C_in / groups) x C_out
+   *   bias: compact array of size C_out (ignored unless has_bias)
+   *   out: compact array of size N x H_out x W_out x C_out, H_out = (H + 2P - K) / stride + 1
+   *   stride, padding, groups: as in ops.Conv; groups must divide C_in and C_out
+   */
+  ConvShape c(N, H, W, C_in, K, C_out, stride, padding, groups);
+  if (c.cg_in == 1 && groups > 1) {
+    DepthwiseConv2d(a.ptr, w.ptr, has_bias ? bias.ptr : nullptr, c, out->ptr);
+    return;
   }
-}
-
- void EwiseDiv(const AlignedArray &a, const AlignedArray &b, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = a.ptr[i] / b.ptr[i];
+  if (has_bias) {
+    ParallelFor(0, c.rows, std::max<size_t>(1, PARALLEL_GRAIN / C_out), [&](size_t begin, size_t end) {
+      for (size_t r = begin; r < end; r++) std::memcpy(out->ptr + r * C_out, bias.ptr, C_out * ELEM_SIZE);
+    });
   }
-}
 
-void ScalarDiv(const AlignedArray &a, const scalar_t &val, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = a.ptr[i] / val;
+  // A 1x1 convolution without padding or stride is a plain matrix product on the input.
+  bool pointwise = K == 1 && stride == 1 && padding == 0;
+  size_t block = std::max<size_t>(GEMM_MC, CONV_IM2COL_ELEMS / std::max<size_t>(c.row_len, 1));
+  block = std::min(block / GEMM_MC * GEMM_MC, c.rows);
+  AlignedArray cols(pointwise ? 1 : std::max<size_t>(block * c.row_len, 1));
+  for (size_t r0 = 0; r0 < c.rows; r0 += block) {
+    size_t r1 = std::min(c.rows, r0 + block);
+    const scalar_t* rows_ptr = pointwise ? a.ptr + r0 * C_in : cols.ptr;
+    if (!pointwise) Conv2dIm2col(a.ptr, c, r0, r1, cols.ptr);
+    for (size_t g = 0; g < groups; g++) {
+      Gemm(r1 - r0, c.group_len, c.cg_out, rows_ptr + g * c.group_len, c.row_len, 1,
+           w.ptr + g * c.cg_out, C_out, 1, out->ptr + r0 * C_out + g * c.cg_out, C_out, has_bias);
+    }
   }
 }
 
-void ScalarPower(const AlignedArray &a, const scalar_t &val, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = std::pow(a.ptr[i], val);
+void Conv2dBackward(const AlignedArray& out_grad, const AlignedArray& a, const AlignedArray& w,
+                    AlignedArray* a_grad, AlignedArray* w_grad, size_t N, size_t H, size_t W,
+                    size_t C_in, size_t K, size_t C_out, size_t stride, size_t padding,
+                    size_t groups) {
+  /**
+   * Gradients of Conv2d with respect to the input and the filters (the bias gradient is just a
+   * sum of out_grad and is left to the caller).  With cols the im2col matrix of a, per group:
+   *   a_grad = col2im(out_grad @ w^T)    computed a block of whole images at a time
+   *   w_grad = cols^T @ out_grad         accumulated over blocks of output pixels
+   * Both products run through Gemm, which splits them over output pixels and output channels.
+   *
+   * Args:
+   *   out_grad: compact array of size N x H_out x W_out x C_out
+   *   a: compact array of size N x H x W x C_in
+   *   w: compact array of size K x K x (C_in / groups) x C_out
+   *   a_grad: compact array of size N x H x W x C_in
+   *   w_grad: compact array of size K x K x (C_in / groups) x C_out
+   */
+  ConvShape c(N, H, W, C_in, K, C_out, stride, padding, groups);
+  if (c.cg_in == 1 && groups > 1) {
+    DepthwiseConv2dBackward(out_grad.ptr, a.ptr, w.ptr, c, a_grad->ptr, w_grad->ptr);
+    return;
   }
-}
-
-void EwiseMaximum(const AlignedArray &a, const AlignedArray &b, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = std::max(a.ptr[i], b.ptr[i]);
+  if (c.rows == 0) {
+    Fill(a_grad, 0);
+    Fill(w_grad, 0);
+    return;
   }
-}
-
-void ScalarMaximum(const AlignedArray &a, const scalar_t &val, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = std::max(a.ptr[i], val);
+  size_t image_rows = c.H_out * c.W_out;
+  size_t block = std::min(c.rows, std::max<size_t>(GEMM_MC, CONV_IM2COL_ELEMS / std::max<size_t>(c.row_len, 1)));
+  size_t block_images = std::max<size_t>(1, block / image_rows);
+  AlignedArray cols(std::max(block, block_images * image_rows) * c.row_len);
+
+  for (size_t n0 = 0; n0 < N; n0 += block_images) {
+    size_t n1 = std::min<size_t>(N, n0 + block_images);
+    for (size_t g = 0; g < groups; g++) {
+      Gemm((n1 - n0) * image_rows, c.cg_out, c.group_len,
+           out_grad.ptr + n0 * image_rows * C_out + g * c.cg_out, C_out, 1, w.ptr + g * c.cg_out, 1,
+           C_out, cols.ptr + g * c.group_len, c.row_len);
+    }
+    Conv2dCol2im(cols.ptr, c, n0, n1, a_grad->ptr);
   }
-}
 
-void EwiseEq(const AlignedArray &a, const AlignedArray &b, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = (a.ptr[i] == b.ptr[i]);
+  bool pointwise = K == 1 && stride == 1 && padding == 0;
+  for (size_t r0 = 0; r0 < c.rows; r0 += block) {
+    size_t r1 = std::min(c.rows, r0 + block);
+    const scalar_t* rows_ptr = pointwise ? a.ptr + r0 * C_in : cols.ptr;
+    if (!pointwise) Conv2dIm2col(a.ptr, c, r0, r1, cols.ptr);
+    for (size_t g = 0; g < groups; g++) {
+      Gemm(c.group_len, r1 - r0, c.cg_out, rows_ptr + g * c.group_len, 1, c.row_len,
+           out_grad.ptr + r0 * C_out + g * c.cg_out, C_out, 1, w_grad->ptr + g * c.cg_out, C_out,
+           r0 > 0);
+    }
   }
 }
 
-void ScalarEq(const AlignedArray &a, const scalar_t &val, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = (a.ptr[i] == val);
-  }
-}
+/**
+ * Winograd convolution for 3x3 filters with stride 1.  F(M x M, 3 x 3) computes an M x M output
+ * tile from an (M + 2) x (M + 2) input tile d as A^T [(G g G^T) . (B^T d B)] A, so each tile
+ * needs (M + 2)^2 multiplies per channel pair instead of 9 M^2: 2.25x fewer for M = 2 and 4x fewer
+ * for M = 4.  Summed over input channels the elementwise products become (M + 2)^2 independent
+ * matrix products (tiles x C_in) @ (C_in x C_out), which run through Gemm.  The filter transform
+ * G g G^T is done once by WinogradFilterTransform and cached by the caller.
+ */
+template <int M>
+struct Winograd;
 
-void EwiseGe(const AlignedArray &a, const AlignedArray &b, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = (a.ptr[i] >= b.ptr[i]);
-  }
+template <>
+struct Winograd<2> {
+  static const int A = 4;
+  static const scalar_t BT[4][4], G[4][3], AT[2][4];
+};
+const scalar_t Winograd<2>::BT[4][4] = {{1, 0, -1, 0}, {0, 1, 1, 0}, {0, -1, 1, 0}, {0, 1, 0, -1}};
+const scalar_t Winograd<2>::G[4][3] = {{1, 0, 0}, {0.5f, 0.5f, 0.5f}, {0.5f, -0.5f, 0.5f}, {0, 0, 1}};
+const scalar_t Winograd<2>::AT[2][4] = {{1, 1, 1, 0}, {0, 1, -1, -1}};
+
+template <>
+struct Winograd<4> {
+  static const int A = 6;
+  static const scalar_t BT[6][6], G[6][3], AT[4][6];
+};
+const scalar_t Winograd<4>::BT[6][6] = {
+    {4, 0, -5, 0, 1, 0}, {0, -4, -4, 1, 1, 0}, {0, 4, -4, -1, 1, 0},
+    {0, -2, -1, 2, 1, 0}, {0, 2, -1, -2, 1, 0}, {0, 4, 0, -5, 0, 1}};
+const scalar_t Winograd<4>::G[6][3] = {
+    {1 / 4.f, 0, 0}, {-1 / 6.f, -1 / 6.f, -1 / 6.f}, {-1 / 6.f, 1 / 6.f, -1 / 6.f},
+    {1 / 24.f, 1 / 12.f, 1 / 6.f}, {1 / 24.f, -1 / 12.f, 1 / 6.f}, {0, 0, 1}};
+const scalar_t Winograd<4>::AT[4][6] = {
+    {1, 1, 1, 1, 1, 0}, {0, 1, -1, 2, -2, 0}, {0, 1, 1, 4, 4, 0}, {0, 1, -1, 8, -8, 1}};
+
+template <int M>
+void WinogradFilterTransformImpl(const scalar_t* w, scalar_t* u, size_t C_in, size_t C_out) {
+  const int A = Winograd<M>::A;
+  ParallelFor(0, C_in, std::max<size_t>(1, PARALLEL_GRAIN / (A * A * C_out)), [&](size_t begin, size_t end) {
+    std::vector<scalar_t> tmp(A * 3 * C_out);
+    for (size_t ci = begin; ci < end; ci++) {
+      // tmp = G g, then u = tmp G^T, vectorized over the output channels
+      std::fill(tmp.begin(), tmp.end(), 0.0f);
+      for (int i = 0; i < A; i++)
+        for (int k = 0; k < 3; k++) {
+          scalar_t g = Winograd<M>::G[i][k];
+          if (g == 0) continue;
+          for (int j = 0; j < 3; j++) {
+            const scalar_t* src = w + ((k * 3 + j) * C_in + ci) * C_out;
+            scalar_t* dst = tmp.data() + (i * 3 + j) * C_out;
+            for (size_t co = 0; co < C_out; co++) dst[co] += g * src[co];
+          }
+        }
+      for (int i = 0; i < A; i++)
+        for (int j = 0; j < A; j++) {
+          scalar_t* dst = u + ((i * A + j) * C_in + ci) * C_out;
+          std::fill(dst, dst + C_out, 0.0f);
+          for (int k = 0; k < 3; k++) {
+            scalar_t g = Winograd<M>::G[j][k];
+            if (g == 0) continue;
+            const scalar_t* src = tmp.data() + (i * 3 + k) * C_out;
+            for (size_t co = 0; co < C_out; co++) dst[co] += g * src[co];
+          }
+        }
+    }
+  });
 }
 
-void ScalarGe(const AlignedArray &a, const scalar_t &val, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = (a.ptr[i] >= val);
+void WinogradFilterTransform(const AlignedArray& w, AlignedArray* u, size_t C_in, size_t C_out,
+                             size_t tile) {
+  /**
+   * Transform 3 x 3 filters for Conv2dWinograd.
+   *
+   * Args:
+   *   w: compact array of size 3 x 3 x C_in x C_out
+   *   u: compact array of size (tile + 2)^2 x C_in x C_out
+   *   tile: output tile size M, 2 or 4
+   */
+  if (tile == 2) {
+    WinogradFilterTransformImpl<2>(w.ptr, u->ptr, C_in, C_out);
+  } else if (tile == 4) {
+    WinogradFilterTransformImpl<4>(w.ptr, u->ptr, C_in, C_out);
+  } else {
+    throw std::invalid_argument("Winograd tile size must be 2 or 4");
   }
 }
 
-void EwiseLog(const AlignedArray &a, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = std::log(a.ptr[i]);
+// The tile transforms run on all (M + 2)^2 positions of a tile at once, WINOGRAD_LANES channels
+// at a time, so a tile never leaves registers between the two sides of a transform.
+#define WINOGRAD_LANES 8
+typedef SimdVec<WINOGRAD_LANES>::F WinogradVec;
+
+SIMD_INLINE WinogradVec WinogradLoad(const scalar_t* p, size_t c0, size_t len) {
+  WinogradVec x = {};
+  if (p == nullptr) return x;
+  if (len == WINOGRAD_LANES) {
+    std::memcpy(&x, p + c0, sizeof(x));
+  } else {
+    std::memcpy(&x, p + c0, len * ELEM_SIZE);
   }
+  return x;
 }
 
-void EwiseExp(const AlignedArray &a, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = std::exp(a.ptr[i]);
+SIMD_INLINE void WinogradStore(const WinogradVec& x, scalar_t* p, size_t len) {
+  if (len == WINOGRAD_LANES) {
+    std::memcpy(p, &x, sizeof(x));
+  } else {
+    std::memcpy(p, &x, len * ELEM_SIZE);
   }
 }
 
-void EwiseTanh(const AlignedArray &a, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = std::tanh(a.ptr[i]);
+// out = mat @ in (R x A) and out = in @ mat^T (R x R).  Fully unrolled, the coefficients become
+// constants and the zero ones drop out.
+template <int R, int A>
+SIMD_INLINE void WinogradMul(const scalar_t (&mat)[R][A], const WinogradVec (&in)[A][A], WinogradVec (&out)[A][A]) {
+#pragma GCC unroll 8
+  for (int i = 0; i < R; i++) {
+#pragma GCC unroll 8
+    for (int j = 0; j < A; j++) {
+      WinogradVec acc = {};
+#pragma GCC unroll 8
+      for (int k = 0; k < A; k++)
+        if (mat[i][k] != 0) acc += mat[i][k] * in[k][j];
+      out[i][j] = acc;
+    }
   }
 }
 
-void EwiseSign(const AlignedArray &a, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = sign(a.ptr[i]);
+template <int R, int A>
+SIMD_INLINE void WinogradMulT(const WinogradVec (&in)[A][A], const scalar_t (&mat)[R][A], WinogradVec (&out)[A][A]) {
+#pragma GCC unroll 8
+  for (int i = 0; i < R; i++) {
+#pragma GCC unroll 8
+    for (int j = 0; j < R; j++) {
+      WinogradVec acc = {};
+#pragma GCC unroll 8
+      for (int k = 0; k < A; k++)
+        if (mat[j][k] != 0) acc += in[i][k] * mat[j][k];
+      out[i][j] = acc;
+    }
   }
 }
 
-void EwiseAbs(const AlignedArray &a, AlignedArray *out){
-  for (size_t i = 0; i < a.size; i++){
-    out->ptr[i] = std::abs(a.ptr[i]);
+template <int M>
+void Conv2dWinogradImpl(const scalar_t* a, const scalar_t* u, const scalar_t* bias, scalar_t* out,
+                        const ConvShape& c) {
+  const int A = Winograd<M>::A;
+  size_t tiles_h = (c.H_out + M - 1) / M, tiles_w = (c.W_out + M - 1) / M;
+  size_t tiles = c.N * tiles_h * tiles_w;
+  size_t block = std::max<size_t>(GEMM_MC, CONV_IM2COL_ELEMS / (A * A * (c.C_in + c.C_out)));
+  block = std::min(block, tiles);
+  AlignedArray v(std::max<size_t>(A * A * block * c.C_in, 1)), m(std::max<size_t>(A * A * block * c.C_out, 1));
+
+  for (size_t t0 = 0; t0 < tiles; t0 += block) {
+    size_t tb = std::min(block, tiles - t0);
+
+    // Input transform: v[xi][t][ci] = (B^T d B)[xi] for the input tile d of every tile t
+    ParallelFor(0, tb, std::max<size_t>(1, PARALLEL_GRAIN / (A * A * c.C_in)), [&](size_t begin, size_t end) {
+      for (size_t t = begin; t < end; t++) {
+        size_t tile = t0 + t, n = tile / (tiles_h * tiles_w);
+        size_t h0 = tile / tiles_w % tiles_h * M, w0 = tile % tiles_w * M;
+        const scalar_t* px[A][A];  // input pixel of every tile position, nullptr in the padding
+        for (int i = 0; i < A; i++)
+          for (int j = 0; j < A; j++) {
+            ptrdiff_t ih = (ptrdiff_t)(h0 + i) - (ptrdiff_t)c.padding;
+            ptrdiff_t iw = (ptrdiff_t)(w0 + j) - (ptrdiff_t)c.padding;
+            bool inside = ih >= 0 && ih < (ptrdiff_t)c.H && iw >= 0 && iw < (ptrdiff_t)c.W;
+            px[i][j] = inside ? a + ((n * c.H + ih) * c.W + iw) * c.C_in : nullptr;
+          }
+        for (size_t c0 = 0; c0 < c.C_in; c0 += WINOGRAD_LANES) {
+          size_t len = std::min<size_t>(WINOGRAD_LANES, c.C_in - c0);
+          WinogradVec x[A][A], y[A][A];
+          for (int i = 0; i < A; i++)
+            for (int j = 0; j < A; j++) x[i][j] = WinogradLoad(px[i][j], c0, len);
+          WinogradMul<A, A>(Winograd<M>::BT, x, y);
+          WinogradMulT<A, A>(y, Winograd<M>::BT, x);
+          for (int i = 0; i < A; i++)
+            for (int j = 0; j < A; j++) WinogradStore(x[i][j], v.ptr + ((i * A + j) * tb + t) * c.C_in + c0, len);
+        }
+      }
+    });
+
+    for (int xi = 0; xi < A * A; xi++) {
+      Gemm(tb, c.C_in, c.C_out, v.ptr + xi * tb * c.C_in, c.C_in, 1, u + xi * c.C_in * c.C_out,
+           c.C_out, 1, m.ptr + xi * tb * c.C_out, c.C_out);
+    }
+
+    // Output transform: the M x M output tile is A^T m A (+ bias), clipped to the image
+    ParallelFor(0, tb, std::max<size_t>(1, PARALLEL_GRAIN / (A * A * c.C_out)), [&](size_t begin, size_t end) {
+      for (size_t t = begin; t < end; t++) {
+        size_t tile = t0 + t, n = tile / (tiles_h * tiles_w);
+        size_t h0 = tile / tiles_w % tiles_h * M, w0 = tile % tiles_w * M;
+        for (size_t c0 = 0; c0 < c.C_out; c0 += WINOGRAD_LANES) {
+          size_t len = std::min<size_t>(WINOGRAD_LANES, c.C_out - c0);
+          WinogradVec x[A][A], y[A][A];
+          for (int i = 0; i < A; i++)
+            for (int j = 0; j < A; j++) x[i][j] = WinogradLoad(m.ptr + ((i * A + j) * tb + t) * c.C_out, c0, len);
+          WinogradMul<M, A>(Winograd<M>::AT, x, y);
+          WinogradMulT<M, A>(y, Winograd<M>::AT, x);
+          WinogradVec b = WinogradLoad(bias, c0, len);
+          for (int r = 0; r < M && h0 + r < c.H_out; r++)
+            for (int q = 0; q < M && w0 + q < c.W_out; q++)
+              WinogradStore(x[r][q] + b, out + ((n * c.H_out + h0 + r) * c.W_out + w0 + q) * c.C_out + c0, len);
+        }
+      }
+    });
   }
 }
 
-void Matmul(const AlignedArray& a, const AlignedArray& b, AlignedArray* out, uint32_t m, uint32_t n,
-            uint32_t p) {
+void Conv2dWinograd(const AlignedArray& a, const AlignedArray& u, const AlignedArray& bias,
+                    AlignedArray* out, size_t N, size_t H, size_t W, size_t C_in,
+                    size_t C_out, size_t padding, size_t tile, bool has_bias) {
   /**
-   * Multiply two (compact) matrices into an output (also compact) matrix.  For this implementation
-   * you can use the "naive" three-loop algorithm.
+   * out = conv(a, w) (+ bias) for a 3 x 3 filter with stride 1, given u = the filter transform of
+   * w for the same tile size.
    *
    * Args:
-   *   a: compact 2D array of size m x n
-   *   b: compact 2D array of size n x p
-   *   out: compact 2D array of size m x p to write the output to
-   *   m: rows of a / out
-   *   n: columns of a / rows of b
-   *   p: columns of b / out
+   *   a: compact array of size N x H x W x C_in
+   *   u: compact array of size (tile + 2)^2 x C_in x C_out (see WinogradFilterTransform)
+   *   bias: compact array of size C_out (ignored unless has_bias)
+   *   out: compact array of size N x H_out x W_out x C_out, H_out = H + 2P - 2
+   *   tile: output tile size M, 2 or 4
    */
-
-  /// BEGIN SOLUTION
-  for(size_t i = 0; i < m; ++i){
-    for(size_t j = 0; j < p; ++j){
-      out->ptr[i*p + j] = 0;
-      for(size_t k = 0; k < n; ++k){
-        out->ptr[i*p + j] += a.ptr[i*n + k]*b.ptr[k*p + j];
-      }
-    }
+  ConvShape c(N, H, W, C_in, 3, C_out, 1, padding, 1);
+  const scalar_t* b = has_bias ? bias.ptr : nullptr;
+  if (tile == 2) {
+    Conv2dWinogradImpl<2>(a.ptr, u.ptr, b, out->ptr, c);
+  } else if (tile == 4) {
+    Conv2dWinogradImpl<4>(a.ptr, u.ptr, b, out->ptr, c);
+  } else {
+    throw std::invalid_argument("Winograd tile size must be 2 or 4");
   }
-  /// END SOLUTION
 }
 
 inline void AlignedDot(const float* __restrict__ a,
@@ -398,8 +2748,8 @@ inline void AlignedDot(const float* __restrict__ a,
   /// END SOLUTION
 }
 
-void MatmulTiled(const AlignedArray& a, const AlignedArray& b, AlignedArray* out, uint32_t m,
-                 uint32_t n, uint32_t p) {
+void MatmulTiled(const AlignedArray& a, const AlignedArray& b, AlignedArray* out, size_t m,
+                 size_t n, size_t p) {
   /**
    * Matrix multiplication on tiled representations of array.  In this setting, a, b, and out
    * are all *4D* compact arrays of the appropriate size, e.g. a is an array of size
@@ -437,6 +2787,10 @@ void MatmulTiled(const AlignedArray& a, const AlignedArray& b, AlignedArray* out
   /// END SOLUTION
 }
 
+void ReduceStrided(const std::string& op, const AlignedArray& a, std::vector<int64_t> shape,
+                   std::vector<int64_t> strides, size_t offset, std::vector<int64_t> axes,
+                   AlignedArray* out);
+
 void ReduceMax(const AlignedArray& a, AlignedArray* out, size_t reduce_size) {
   /**
    * Reduce by taking maximum over `reduce_size` contiguous blocks.
@@ -448,13 +2802,8 @@ void ReduceMax(const AlignedArray& a, AlignedArray* out, size_t reduce_size) {
    */
 
   /// BEGIN SOLUTION
-  for(size_t i=0; i < out->size; ++i){
-    auto max_element = a.ptr[i*reduce_size + 0];
-    for(size_t j=1; j < reduce_size; ++j){
-      max_element = std::max(max_element, a.ptr[i*reduce_size + j]);
-    }
-    out->ptr[i] = max_element;
-  }
+  ReduceStrided("max", a, {(int64_t)out->size, (int64_t)reduce_size}, {(int64_t)reduce_size, 1}, 0, {1},
+                out);
   /// END SOLUTION
 }
 
@@ -469,100 +2818,872 @@ void ReduceSum(const AlignedArray& a, AlignedArray* out, size_t reduce_size) {
    */
 
   /// BEGIN SOLUTION
-  for(size_t i=0; i < out->size; ++i){
-    auto sum_element = a.ptr[i*reduce_size + 0];
-    for(size_t j=1; j < reduce_size; ++j){
-      sum_element += a.ptr[i*reduce_size + j];
+  ReduceStrided("sum", a, {(int64_t)out->size, (int64_t)reduce_size}, {(int64_t)reduce_size, 1}, 0, {1},
+                out);
+  /// END SOLUTION
+}
+
+/**
+ * Strided reductions.
+ *
+ * ReduceStrided reduces any set of axes of a strided view in one pass, without permuting or
+ * compacting it first.  The dims are split into kept dims (the output, compact in their original
+ * order) and reduced dims, each described by a StridedShape; the reduced dims are ordered by
+ * decreasing stride first so that they merge into as few runs as possible.  Two layouts:
+ *   - columns: the innermost kept dim is the input's unit-stride dim (leading-axis reductions such
+ *     as axis 0 of an N x D activation, or axes (0, 1, 2) of NHWC).  A block of outputs is
+ *     accumulated with the SIMD elementwise kernel, one input row per reduced position.
+ *   - rows: otherwise every output folds its own runs of input, which are contiguous when the
+ *     input's unit-stride dim is reduced (last-axis reductions, or axes (0, 2, 3) of NCHW).
+ * Sums add contiguous runs with SimdSum and column blocks REDUCE_COLUMN_BLOCK rows at a time, or
+ * carry Neumaier corrections throughout when compensated sums are on (see SetCompensatedSum).
+ * When there are few outputs the reduced positions are also split into chunks whose partial
+ * results are combined in chunk order.  The split depends only on the shapes, so the result does
+ * not depend on the number of threads.
+ */
+#define REDUCE_CHUNK_WORK (1 << 18)  // input elements per reduction chunk
+#define REDUCE_MAX_TASKS 64          // (output block, chunk) tasks to aim for when splitting
+#define REDUCE_COLUMN_BLOCK 64       // rows summed separately before joining a column total
+
+inline scalar_t ReduceRun(SimdOp op, const scalar_t* p, ptrdiff_t stride, size_t n, scalar_t acc,
+                          scalar_t* comp) {
+  // fold p[0], p[stride], ..., p[(n - 1) * stride] into acc (and *comp for compensated sums)
+  if (op == kSimdAdd) {
+    static thread_local scalar_t buf[STRIDED_BLOCK];
+    SimdSumKernel sum = simd_isa->sum;
+    size_t piece = stride == 1 ? n : STRIDED_BLOCK;  // contiguous runs are summed in one call
+    for (size_t i = 0; i < n; i += piece) {
+      size_t len = std::min(piece, n - i);
+      scalar_t run = sum(StridedBlock(p + (ptrdiff_t)i * stride, stride, len, buf), len, compensated_sum);
+      if (compensated_sum) {
+        NeumaierAdd(&acc, comp, run);
+      } else {
+        acc += run;
+      }
     }
-    out->ptr[i] = sum_element;
+  } else {
+    for (size_t j = 0; j < n; ++j) acc = std::max(acc, p[(ptrdiff_t)j * stride]);
   }
-  /// END SOLUTION
+  return acc;
+}
+
+void ReduceStrided(const std::string& op, const AlignedArray& a, std::vector<int64_t> shape,
+                   std::vector<int64_t> strides, size_t offset, std::vector<int64_t> axes,
+                   AlignedArray* out) {
+  /**
+   * Reduce a strided view with "sum" or "max" over any subset of its axes.
+   *
+   * Args:
+   *   a, shape, strides, offset: the view to reduce
+   *   axes: dimensions to reduce over, in any order
+   *   out: compact array of the kept dimensions in their original order
+   */
+  SimdOp simd_op;
+  if (op == "sum") {
+    simd_op = kSimdAdd;
+  } else if (op == "max") {
+    simd_op = kSimdMaximum;
+  } else {
+    throw std::invalid_argument("unknown reduction: " + op);
+  }
+  scalar_t init = simd_op == kSimdAdd ? 0 : -INFINITY;
+
+  std::vector<bool> reduced(shape.size(), false);
+  for (int64_t ax : axes) reduced[ax] = true;
+  std::vector<int64_t> k_shape, k_strides, r_shape, r_strides;
+  std::vector<std::pair<int64_t, int64_t>> r_dims;  // (stride, size)
+  for (size_t d = 0; d < shape.size(); d++) {
+    if (reduced[d]) {
+      r_dims.push_back(std::make_pair(strides[d], shape[d]));
+    } else {
+      k_shape.push_back(shape[d]);
+      k_strides.push_back(strides[d]);
+    }
+  }
+  std::sort(r_dims.rbegin(), r_dims.rend());
+  for (const auto& dim : r_dims) {
+    r_strides.push_back(dim.first);
+    r_shape.push_back(dim.second);
+  }
+  StridedShape ks(k_shape, k_strides, offset), rs(r_shape, r_strides, 0);
+
+  size_t n_out = out->size, n_red = rs.Rows() * rs.Inner();
+  if (n_out == 0) return;
+  if (n_red == 0) {
+    Fill(out, init);
+    return;
+  }
+  ptrdiff_t k_in = ks.strides[0].back(), r_in = rs.strides[0].back();
+  bool columns = n_out > 1 && (k_in == 1 || r_in != 1);
+  size_t k_tasks = ks.Rows() * ((ks.Inner() + STRIDED_BLOCK - 1) / STRIDED_BLOCK);
+  size_t r_tasks = rs.Rows() * ((rs.Inner() + STRIDED_BLOCK - 1) / STRIDED_BLOCK);
+  size_t chunks = std::min(r_tasks, std::max<size_t>(1, std::min(n_out * n_red / REDUCE_CHUNK_WORK,
+                                                                 REDUCE_MAX_TASKS / k_tasks)));
+  bool single_run = rs.dims.size() == 1;
+  bool compensated = simd_op == kSimdAdd && compensated_sum;
+  std::vector<scalar_t> partial(chunks > 1 ? chunks * n_out : 0);
+  SimdKernel kernel = simd_isa->kernel;
+  SimdAccumulateKernel accumulate = simd_isa->accumulate;
+
+  size_t task_work = std::max<size_t>(1, std::min<size_t>(STRIDED_BLOCK, ks.Inner()) * (n_red / chunks));
+  ParallelFor(0, chunks * k_tasks, std::max<size_t>(1, PARALLEL_GRAIN / task_work),
+              [&](size_t t_begin, size_t t_end) {
+    for (size_t t = t_begin; t < t_end; ++t) {
+      size_t chunk = t / k_tasks, kt = t % k_tasks;
+      size_t rt0 = r_tasks * chunk / chunks, rt1 = r_tasks * (chunk + 1) / chunks;
+      scalar_t* dst_base = chunks > 1 ? partial.data() + chunk * n_out : out->ptr;
+      auto out_block = [&](size_t i, ptrdiff_t pos_a, ptrdiff_t, size_t len) {
+        scalar_t* dst = dst_base + i;
+        if (columns) {
+          // sums add REDUCE_COLUMN_BLOCK rows at a time into part before adding them to dst, or
+          // carry per-column corrections in comp
+          static thread_local scalar_t buf[STRIDED_BLOCK], part[STRIDED_BLOCK], comp[STRIDED_BLOCK];
+          size_t pending = 0;
+          std::fill(dst, dst + len, init);
+          if (compensated) std::fill(comp, comp + len, 0.0f);
+          auto rows = [&](size_t, ptrdiff_t pos_r, ptrdiff_t, size_t len_r) {
+            for (size_t q = 0; q < len_r; ++q) {
+              const scalar_t* row = StridedBlock(a.ptr + pos_a + pos_r + (ptrdiff_t)q * r_in, k_in, len, buf);
+              if (simd_op != kSimdAdd) {
+                kernel(simd_op, dst, row, 0, dst, len);
+              } else if (compensated) {
+                accumulate(row, dst, comp, len);
+              } else {
+                if (pending == 0) {
+                  std::memcpy(part, row, len * ELEM_SIZE);
+                } else {
+                  kernel(kSimdAdd, part, row, 0, part, len);
+                }
+                if (++pending == REDUCE_COLUMN_BLOCK) {
+                  kernel(kSimdAdd, dst, part, 0, dst, len);
+                  pending = 0;
+                }
+              }
+            }
+          };
+          StridedBlocksSerial(rs, STRIDED_BLOCK, rt0, rt1, rows);
+          if (pending > 0) kernel(kSimdAdd, dst, part, 0, dst, len);
+          if (compensated) kernel(kSimdAdd, dst, comp, 0, dst, len);
+        } else {
+          for (size_t j = 0; j < len; ++j) {
+            const scalar_t* base = a.ptr + pos_a + (ptrdiff_t)j * k_in;
+            scalar_t acc = init, comp = 0;
+            if (single_run) {
+              // this chunk's blocks of the one reduced dim form a single run
+              size_t r0 = rt0 * STRIDED_BLOCK, r1 = std::min(rt1 * STRIDED_BLOCK, rs.Inner());
+              acc = ReduceRun(simd_op, base + rs.offset[0] + (ptrdiff_t)r0 * r_in, r_in, r1 - r0, acc, &comp);
+            } else {
+              auto runs = [&](size_t, ptrdiff_t pos_r, ptrdiff_t, size_t len_r) {
+                acc = ReduceRun(simd_op, base + pos_r, r_in, len_r, acc, &comp);
+              };
+              StridedBlocksSerial(rs, STRIDED_BLOCK, rt0, rt1, runs);
+            }
+            dst[j] = acc + comp;
+          }
+        }
+      };
+      StridedBlocksSerial(ks, STRIDED_BLOCK, kt, kt + 1, out_block);
+    }
+  });
+
+  if (chunks > 1) {
+    ParallelFor(0, n_out, std::max<size_t>(1, PARALLEL_GRAIN / chunks), [&](size_t begin, size_t end) {
+      std::memcpy(out->ptr + begin, partial.data() + begin, (end - begin) * ELEM_SIZE);
+      if (compensated) {
+        std::vector<scalar_t> comp(end - begin, 0.0f);
+        for (size_t c = 1; c < chunks; ++c)
+          accumulate(partial.data() + c * n_out + begin, out->ptr + begin, comp.data(), end - begin);
+        kernel(kSimdAdd, out->ptr + begin, comp.data(), 0, out->ptr + begin, end - begin);
+      } else {
+        for (size_t c = 1; c < chunks; ++c)
+          kernel(simd_op, out->ptr + begin, partial.data() + c * n_out + begin, 0, out->ptr + begin, end - begin);
+      }
+    });
+  }
+}
+
+/**
+ * Index reductions.
+ *
+ * ArgReduce and TopK work along one axis of a strided view.  The remaining dims are walked like
+ * the kept dims of ReduceStrided: when the axis is not the unit-stride one but the innermost kept
+ * dim is, a block of outputs scans the axis row by row; otherwise every output scans its own run.
+ * Indices are written as floats (exact below 2^24, arrays being float32 only).  Ties go to the
+ * lower index and NaN ranks above every number, as in numpy.
+ */
+template <bool Largest>
+inline bool ArgBetter(scalar_t x, scalar_t y) {
+  // x strictly ranks before y
+  return (Largest ? x > y : x < y) || (x != x && y == y);
+}
+
+template <bool Largest>
+void ArgReduceImpl(const AlignedArray& a, std::vector<int64_t> shape, std::vector<int64_t> strides,
+                   size_t offset, int64_t axis, AlignedArray* out) {
+  size_t n = shape[axis];
+  ptrdiff_t r_in = strides[axis];
+  shape.erase(shape.begin() + axis);
+  strides.erase(strides.begin() + axis);
+  StridedShape ks(shape, strides, offset);
+  ptrdiff_t k_in = ks.strides[0].back();
+  bool columns = out->size > 1 && k_in == 1 && r_in != 1;
+
+  StridedBlocks(ks, STRIDED_BLOCK, std::max<size_t>(1, PARALLEL_GRAIN / n),
+                [&](size_t i, ptrdiff_t pos_a, ptrdiff_t, size_t len) {
+    scalar_t* dst = out->ptr + i;
+    if (columns) {
+      static thread_local scalar_t best[STRIDED_BLOCK];
+      std::memcpy(best, a.ptr + pos_a, len * ELEM_SIZE);
+      std::fill(dst, dst + len, 0.0f);
+      for (size_t r = 1; r < n; ++r) {
+        const scalar_t* row = a.ptr + pos_a + (ptrdiff_t)r * r_in;
+        for (size_t j = 0; j < len; ++j) {
+          if (ArgBetter<Largest>(row[j], best[j])) {
+            best[j] = row[j];
+            dst[j] = r;
+          }
+        }
+      }
+    } else {
+      for (size_t j = 0; j < len; ++j) {
+        const scalar_t* p = a.ptr + pos_a + (ptrdiff_t)j * k_in;
+        scalar_t best = p[0];
+        size_t best_r = 0;
+        for (size_t r = 1; r < n; ++r) {
+          if (ArgBetter<Largest>(p[(ptrdiff_t)r * r_in], best)) {
+            best = p[(ptrdiff_t)r * r_in];
+            best_r = r;
+          }
+        }
+        dst[j] = best_r;
+      }
+    }
+  });
+}
+
+void ArgReduce(const std::string& op, const AlignedArray& a, std::vector<int64_t> shape,
+               std::vector<int64_t> strides, size_t offset, int64_t axis, AlignedArray* out) {
+  /**
+   * Index of the largest ("argmax") or smallest ("argmin") element along one axis of a strided
+   * view.
+   *
+   * Args:
+   *   a, shape, strides, offset: the view to reduce
+   *   axis: dimension to reduce over
+   *   out: compact array of the remaining dimensions, receiving the indices
+   */
+  if (op != "argmax" && op != "argmin") throw std::invalid_argument("unknown index reduction: " + op);
+  if (out->size == 0) return;
+  if (shape[axis] == 0) throw std::invalid_argument(op + " of an empty axis");
+  if (op == "argmax") {
+    ArgReduceImpl<true>(a, shape, strides, offset, axis, out);
+  } else {
+    ArgReduceImpl<false>(a, shape, strides, offset, axis, out);
+  }
+}
+
+template <bool Largest>
+void TopKImpl(const AlignedArray& a, std::vector<int64_t> shape, std::vector<int64_t> strides,
+              size_t offset, int64_t axis, size_t k, AlignedArray* values, AlignedArray* indices) {
+  size_t n = shape[axis];
+  ptrdiff_t r_in = strides[axis];
+  shape.erase(shape.begin() + axis);
+  strides.erase(strides.begin() + axis);
+  StridedShape ks(shape, strides, offset);
+  ptrdiff_t k_in = ks.strides[0].back();
+
+  StridedBlocks(ks, STRIDED_BLOCK, std::max<size_t>(1, PARALLEL_GRAIN / n),
+                [&](size_t i, ptrdiff_t pos_a, ptrdiff_t, size_t len) {
+    std::vector<scalar_t> run(n);
+    std::vector<uint32_t> order(n);
+    for (size_t j = 0; j < len; ++j) {
+      const scalar_t* p = StridedBlock(a.ptr + pos_a + (ptrdiff_t)j * k_in, r_in, n, run.data());
+      for (size_t r = 0; r < n; ++r) order[r] = r;
+      // the k best in rank order, lower index first among equals
+      std::partial_sort(order.begin(), order.begin() + k, order.end(), [p](uint32_t x, uint32_t y) {
+        return ArgBetter<Largest>(p[x], p[y]) || (!ArgBetter<Largest>(p[y], p[x]) && x < y);
+      });
+      scalar_t* v = values->ptr + (i + j) * k;
+      scalar_t* idx = indices->ptr + (i + j) * k;
+      for (size_t t = 0; t < k; ++t) {
+        v[t] = p[order[t]];
+        idx[t] = order[t];
+      }
+    }
+  });
+}
+
+void TopK(const AlignedArray& a, std::vector<int64_t> shape, std::vector<int64_t> strides,
+          size_t offset, int64_t axis, size_t k, bool largest, AlignedArray* values,
+          AlignedArray* indices) {
+  /**
+   * The k largest (or smallest) elements along one axis of a strided view, in rank order, and
+   * their indices.
+   *
+   * Args:
+   *   a, shape, strides, offset: the view to select from
+   *   axis: dimension to select along
+   *   k: number of elements to keep, at most shape[axis]
+   *   largest: select the largest elements rather than the smallest
+   *   values, indices: compact arrays of the remaining dimensions followed by one of size k
+   */
+  if (k > (size_t)shape[axis]) throw std::invalid_argument("topk: k is larger than the axis");
+  if ((size_t)shape[axis] > UINT32_MAX) throw std::invalid_argument("topk: axis is too long");
+  if (values->size == 0) return;
+  if (largest) {
+    TopKImpl<true>(a, shape, strides, offset, axis, k, values, indices);
+  } else {
+    TopKImpl<false>(a, shape, strides, offset, axis, k, values, indices);
+  }
+}
+
+std::vector<size_t> ReadIndices(const AlignedArray& index, size_t n, const std::string& op) {
+  /**
+   * The entries of index (integers stored as floats) as size_t, checking that each is in [0, n).
+   */
+  std::vector<size_t> idx(index.size);
+  for (size_t j = 0; j < index.size; ++j) {
+    scalar_t v = index.ptr[j];
+    if (!(v >= 0) || v >= (scalar_t)n || v != std::floor(v))
+      throw std::invalid_argument(op + ": index out of range");
+    idx[j] = (size_t)v;
+  }
+  return idx;
+}
+
+void Gather(const AlignedArray& a, const AlignedArray& index, AlignedArray* out, size_t outer, size_t n,
+            size_t inner) {
+  /**
+   * Select slices of a compact outer x n x inner array along its middle axis:
+   * out[o, j, :] = a[o, index[j], :] for every entry j of index (numpy.take).
+   *
+   * Args:
+   *   index: compact array of integer positions in [0, n), stored as floats
+   *   out: compact outer x index.size x inner array
+   */
+  std::vector<size_t> idx = ReadIndices(index, n, "gather");
+  size_t m = idx.size();
+  ParallelFor(0, outer * m, std::max<size_t>(1, PARALLEL_GRAIN / std::max<size_t>(inner, 1)),
+              [&](size_t begin, size_t end) {
+    for (size_t t = begin; t < end; ++t) {
+      size_t o = t / m, j = t % m;
+      std::memcpy(out->ptr + t * inner, a.ptr + (o * n + idx[j]) * inner, inner * ELEM_SIZE);
+    }
+  });
+}
+
+void ScatterAdd(const AlignedArray& src, const AlignedArray& index, AlignedArray* out, size_t outer,
+                size_t n, size_t inner) {
+  /**
+   * The adjoint of Gather: out[o, i, :] = sum of src[o, j, :] over the entries j with index[j] == i,
+   * for a compact outer x index.size x inner src and outer x n x inner out.
+   *
+   * The entries are stably sorted by target so that every run of equal indices is added by one
+   * task, in index order: there are no write conflicts and the result does not depend on the
+   * number of threads.
+   */
+  std::vector<size_t> idx = ReadIndices(index, n, "scatter_add");
+  size_t m = idx.size();
+  std::vector<size_t> order(m);
+  for (size_t j = 0; j < m; ++j) order[j] = j;
+  std::stable_sort(order.begin(), order.end(), [&idx](size_t x, size_t y) { return idx[x] < idx[y]; });
+  std::vector<size_t> runs;
+  for (size_t j = 0; j < m; ++j)
+    if (j == 0 || idx[order[j]] != idx[order[j - 1]]) runs.push_back(j);
+  runs.push_back(m);
+
+  Fill(out, 0.0f);
+  size_t groups = runs.size() - 1;
+  SimdKernel add = simd_isa->kernel;
+  ParallelFor(0, groups, std::max<size_t>(1, PARALLEL_GRAIN * groups / std::max<size_t>(outer * m * inner, 1)),
+              [&](size_t begin, size_t end) {
+    for (size_t g = begin; g < end; ++g) {
+      for (size_t o = 0; o < outer; ++o) {
+        scalar_t* dst = out->ptr + (o * n + idx[order[runs[g]]]) * inner;
+        for (size_t r = runs[g]; r < runs[g + 1]; ++r)
+          add(kSimdAdd, dst, src.ptr + (o * m + order[r]) * inner, 0, dst, inner);
+      }
+    }
+  });
+}
+
+void Softmax(const AlignedArray& a, AlignedArray* out, size_t cols, bool log) {
+  /**
+   * Softmax (or log-softmax when log is set) of every row of a compact a.size / cols x cols
+   * array, one SimdSoftmax pass per row.
+   */
+  if (cols == 0) return;
+  SimdSoftmaxKernel kernel = simd_isa->softmax;
+  ParallelFor(0, a.size / cols, std::max<size_t>(1, PARALLEL_GRAIN_HEAVY / cols), [&](size_t begin, size_t end) {
+    for (size_t r = begin; r < end; ++r) kernel(a.ptr + r * cols, out->ptr + r * cols, cols, log);
+  });
+}
+
+void SoftmaxBackward(const AlignedArray& out_grad, const AlignedArray& out, AlignedArray* a_grad,
+                     size_t cols, bool log) {
+  /**
+   * Gradient of Softmax with respect to its input, given the output gradient and the forward
+   * output, for compact a.size / cols x cols arrays.
+   */
+  if (cols == 0) return;
+  SimdSoftmaxGradKernel kernel = simd_isa->softmax_grad;
+  ParallelFor(0, out.size / cols, std::max<size_t>(1, PARALLEL_GRAIN_HEAVY / cols), [&](size_t begin, size_t end) {
+    for (size_t r = begin; r < end; ++r)
+      kernel(out.ptr + r * cols, out_grad.ptr + r * cols, a_grad->ptr + r * cols, cols, log);
+  });
+}
+
+void SoftmaxCrossEntropy(const AlignedArray& logits, const AlignedArray& labels, AlignedArray* loss,
+                         AlignedArray* grad, size_t cols) {
+  /**
+   * Mean softmax cross-entropy of the rows of a compact logits.size / cols x cols array against
+   * integer class labels (one per row, stored as floats), together with its gradient
+   * (softmax - onehot) / rows.  Each row's log-softmax is written straight into grad, the label's
+   * entry is read off as that row's loss, and the row is then turned into the gradient while it
+   * is still in cache; no one-hot matrix is built.
+   *
+   * Args:
+   *   loss: receives the mean loss (1 element)
+   *   grad: receives the gradient of the mean loss with respect to logits
+   */
+  size_t rows = cols == 0 ? 0 : logits.size / cols;
+  if (labels.size != rows) throw std::invalid_argument("cross entropy: expected one label per row");
+  for (size_t r = 0; r < rows; ++r) {
+    scalar_t y = labels.ptr[r];
+    if (!(y >= 0) || y >= (scalar_t)cols || y != std::floor(y))
+      throw std::invalid_argument("cross entropy: label out of range");
+  }
+  std::vector<scalar_t> row_loss(rows);
+  scalar_t inv_rows = 1.0f / std::max<size_t>(rows, 1);
+  SimdSoftmaxKernel log_softmax = simd_isa->softmax;
+  SimdKernel kernel = simd_isa->kernel;
+  ParallelFor(0, rows, std::max<size_t>(1, PARALLEL_GRAIN_HEAVY / std::max<size_t>(cols, 1)),
+              [&](size_t begin, size_t end) {
+    for (size_t r = begin; r < end; ++r) {
+      scalar_t* g = grad->ptr + r * cols;
+      size_t y = (size_t)labels.ptr[r];
+      log_softmax(logits.ptr + r * cols, g, cols, true);
+      row_loss[r] = -g[y];
+      kernel(kSimdExp, g, nullptr, 0, g, cols);
+      kernel(kSimdMul, g, nullptr, inv_rows, g, cols);
+      g[y] -= inv_rows;
+    }
+  });
+  loss->ptr[0] = simd_isa->sum(row_loss.data(), rows, compensated_sum) * inv_rows;
+}
+
+void LayerNorm(const AlignedArray& a, const AlignedArray& weight, const AlignedArray& bias, AlignedArray* out,
+               AlignedArray* mean, AlignedArray* rstd, size_t cols, scalar_t eps) {
+  /**
+   * Normalize every row of a compact a.size / cols x cols array to zero mean and unit variance,
+   * then scale by weight and shift by bias (cols elements each).
+   *
+   * Args:
+   *   mean, rstd: receive each row's mean and 1 / sqrt(var + eps) for LayerNormBackward
+   */
+  if (cols == 0) return;
+  SimdLayerNormKernel kernel = simd_isa->layer_norm;
+  ParallelFor(0, a.size / cols, std::max<size_t>(1, PARALLEL_GRAIN / cols), [&](size_t begin, size_t end) {
+    for (size_t r = begin; r < end; ++r)
+      kernel(a.ptr + r * cols, weight.ptr, bias.ptr, out->ptr + r * cols, cols, eps, mean->ptr + r, rstd->ptr + r);
+  });
+}
+
+void LayerNormBackward(const AlignedArray& out_grad, const AlignedArray& a, const AlignedArray& weight,
+                       const AlignedArray& mean, const AlignedArray& rstd, AlignedArray* a_grad,
+                       AlignedArray* weight_grad, AlignedArray* bias_grad, size_t cols) {
+  /**
+   * Gradients of LayerNorm with respect to its input, weight and bias, from the output gradient
+   * and the saved row statistics.  Rows are split into chunks that each sum their own weight /
+   * bias gradients; the chunk count depends only on the shape and the partial sums are added in
+   * chunk order, so the result does not depend on the number of threads.
+   */
+  if (cols == 0) return;
+  size_t rows = a.size / cols;
+  size_t chunks = std::max<size_t>(1, std::min<size_t>(std::min<size_t>(rows, REDUCE_MAX_TASKS),
+                                                       a.size / REDUCE_CHUNK_WORK));
+  std::vector<scalar_t> partial(chunks * 2 * cols, 0.0f);
+  SimdLayerNormGradKernel kernel = simd_isa->layer_norm_grad;
+  ParallelFor(0, chunks, 1, [&](size_t c_begin, size_t c_end) {
+    for (size_t c = c_begin; c < c_end; ++c) {
+      scalar_t* dw = partial.data() + c * 2 * cols;
+      for (size_t r = rows * c / chunks; r < rows * (c + 1) / chunks; ++r)
+        kernel(a.ptr + r * cols, out_grad.ptr + r * cols, weight.ptr, mean.ptr[r], rstd.ptr[r],
+               a_grad->ptr + r * cols, dw, dw + cols, cols);
+    }
+  });
+  SimdKernel add = simd_isa->kernel;
+  std::memcpy(weight_grad->ptr, partial.data(), cols * ELEM_SIZE);
+  std::memcpy(bias_grad->ptr, partial.data() + cols, cols * ELEM_SIZE);
+  for (size_t c = 1; c < chunks; ++c) {
+    const scalar_t* dw = partial.data() + c * 2 * cols;
+    add(kSimdAdd, weight_grad->ptr, dw, 0, weight_grad->ptr, cols);
+    add(kSimdAdd, bias_grad->ptr, dw + cols, 0, bias_grad->ptr, cols);
+  }
+}
+
+#define GRID_SAMPLE_BLOCK 256  // output pixels whose taps are resolved together
+#define GRID_SAMPLE_CHANNELS 16  // channels per GridSampleBackward task
+
+enum GridSampleMode { kGridBilinear, kGridNearest };
+enum GridSamplePadding { kGridZeros, kGridBorder, kGridReflection };
+
+GridSampleMode GridSampleModeByName(const std::string& name) {
+  if (name == "bilinear") return kGridBilinear;
+  if (name == "nearest") return kGridNearest;
+  throw std::invalid_argument("unknown grid_sample mode: " + name);
+}
+
+GridSamplePadding GridSamplePaddingByName(const std::string& name) {
+  if (name == "zeros") return kGridZeros;
+  if (name == "border") return kGridBorder;
+  if (name == "reflection") return kGridReflection;
+  throw std::invalid_argument("unknown grid_sample padding_mode: " + name);
 }
 
-void GridSample(const AlignedArray& a, const AlignedArray& grid, AlignedArray* out, std::vector<int32_t> a_shape, std::vector<int32_t> grid_shape) {
+template<int Padding, bool AlignCorners>
+inline scalar_t GridSampleCoord(scalar_t x, size_t size, scalar_t* dcoord) {
   /**
-   * Compute grid sample
-   * 
+   * Map a normalized grid coordinate to pixel space and apply the padding
+   * mode (same conventions as torch). *dcoord receives d(coord)/d(x), which
+   * is 0 wherever border/reflection clipping saturates.
+   */
+  scalar_t coord, mult;
+  if (AlignCorners) {
+    coord = (x + 1) / 2 * (size - 1);
+    mult = (size - 1) / 2.0f;
+  } else {
+    coord = ((x + 1) * size - 1) / 2;
+    mult = size / 2.0f;
+  }
+  if (Padding == kGridReflection) {
+    // reflect about the image edges: pixel centers for align_corners, pixel borders otherwise
+    scalar_t low = AlignCorners ? 0 : -0.5f;
+    scalar_t span = AlignCorners ? size - 1.0f : size;
+    if (span <= 0) {
+      coord = 0;
+      mult = 0;
+    } else {
+      scalar_t in = coord - low;
+      if (in < 0) {
+        in = -in;
+        mult = -mult;
+      }
+      scalar_t extra = std::fmod(in, span);
+      if (std::fmod(std::floor(in / span), 2.0f) == 0) {
+        coord = extra + low;
+      } else {
+        coord = span - extra + low;
+        mult = -mult;
+      }
+    }
+  }
+  if (Padding != kGridZeros) {
+    scalar_t high = size - 1.0f;
+    if (coord <= 0) {
+      coord = 0;
+      mult = 0;
+    } else if (coord >= high) {
+      coord = high;
+      mult = 0;
+    }
+  }
+  *dcoord = mult;
+  return coord;
+}
+
+template<int Mode, typename Index>
+struct GridSampleTaps {
+  /**
+   * Sampling taps for a block of output pixels of one batch element, stored
+   * SoA so the per-channel loop is a plain weighted gather (4 taps for
+   * bilinear, 1 for nearest). Taps that fall outside the image get weight 0
+   * and point at element 0 of the plane, which removes every bounds check
+   * from the channel loop. Offsets are relative to one channel plane, so
+   * Index is int32_t unless a single plane exceeds 2^31 elements.
+   */
+  static const int kTaps = Mode == kGridBilinear ? 4 : 1;
+  Index off[kTaps][GRID_SAMPLE_BLOCK];
+  scalar_t wt[kTaps][GRID_SAMPLE_BLOCK];
+  // d(weight_k)/d(grid x) and d(weight_k)/d(grid y), filled only when Grad is set.
+  scalar_t gx[kTaps][GRID_SAMPLE_BLOCK];
+  scalar_t gy[kTaps][GRID_SAMPLE_BLOCK];
+
+  template<int Padding, bool AlignCorners, bool Grad>
+  void Resolve(const scalar_t* grid, size_t len, size_t h, size_t w) {
+    for (size_t j = 0; j < len; ++j) {
+      scalar_t mx, my;
+      scalar_t x = GridSampleCoord<Padding, AlignCorners>(grid[2 * j], w, &mx);
+      scalar_t y = GridSampleCoord<Padding, AlignCorners>(grid[2 * j + 1], h, &my);
+      if (Mode == kGridNearest) {
+        ptrdiff_t xi = (ptrdiff_t)std::nearbyint(x), yi = (ptrdiff_t)std::nearbyint(y);
+        bool inside = xi >= 0 && xi < (ptrdiff_t)w && yi >= 0 && yi < (ptrdiff_t)h;
+        off[0][j] = inside ? (Index)(yi * (ptrdiff_t)w + xi) : 0;
+        wt[0][j] = inside ? 1 : 0;
+        if (Grad) gx[0][j] = gy[0][j] = 0;
+        continue;
+      }
+      scalar_t x0 = std::floor(x), y0 = std::floor(y);
+      scalar_t dx = x - x0, dy = y - y0;
+      ptrdiff_t xi = (ptrdiff_t)x0, yi = (ptrdiff_t)y0;
+      for (int k = 0; k < kTaps; ++k) {
+        ptrdiff_t xk = xi + (k & 1), yk = yi + (k >> 1);
+        bool inside = xk >= 0 && xk < (ptrdiff_t)w && yk >= 0 && yk < (ptrdiff_t)h;
+        scalar_t fx = (k & 1) ? dx : 1 - dx;
+        scalar_t fy = (k >> 1) ? dy : 1 - dy;
+        off[k][j] = inside ? (Index)(yk * (ptrdiff_t)w + xk) : 0;
+        wt[k][j] = inside ? fx * fy : 0;
+        if (Grad) {
+          gx[k][j] = inside ? ((k & 1) ? fy : -fy) * mx : 0;
+          gy[k][j] = inside ? ((k >> 1) ? fx : -fx) * my : 0;
+        }
+      }
+    }
+  }
+};
+
+inline bool GridSampleHardwareGather() {
+  // AVX2 gathers follow the selected instruction set, so a portable build still uses them
+#ifdef NEEDLE_X86
+  return std::strcmp(simd_isa->name, "avx2") == 0 || std::strcmp(simd_isa->name, "avx512") == 0;
+#else
+  return false;
+#endif
+}
+
+#ifdef NEEDLE_X86
+template<int Mode, typename Index>
+SIMD_TARGET("avx2")
+size_t GridSampleGatherAvx2(const GridSampleTaps<Mode, Index>& taps, const scalar_t* plane, size_t len,
+                            scalar_t* dst) {
+  // the first len / 8 * 8 elements of GridSampleGather, for 32-bit offsets; returns that count
+  typedef GridSampleTaps<Mode, Index> Taps;
+  size_t j = 0;
+  for (; j + 8 <= len; j += 8) {
+    __m256 v = _mm256_setzero_ps();
+    for (int k = 0; k < Taps::kTaps; ++k) {
+      __m256i idx = _mm256_loadu_si256((const __m256i*)(taps.off[k] + j));
+      v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_loadu_ps(taps.wt[k] + j), _mm256_i32gather_ps(plane, idx, 4)));
+    }
+    _mm256_storeu_ps(dst + j, v);
+  }
+  return j;
+}
+
+template<int Mode, typename Index>
+SIMD_TARGET("avx2")
+size_t GridSampleGatherGradAvx2(const GridSampleTaps<Mode, Index>& taps, const scalar_t* plane,
+                                const scalar_t* og, size_t len, scalar_t* sum_x, scalar_t* sum_y) {
+  // the first len / 8 * 8 elements of GridSampleGatherGrad, for 32-bit offsets; returns that count
+  typedef GridSampleTaps<Mode, Index> Taps;
+  size_t j = 0;
+  for (; j + 8 <= len; j += 8) {
+    __m256 sx = _mm256_setzero_ps(), sy = _mm256_setzero_ps();
+    for (int k = 0; k < Taps::kTaps; ++k) {
+      __m256i idx = _mm256_loadu_si256((const __m256i*)(taps.off[k] + j));
+      __m256 v = _mm256_i32gather_ps(plane, idx, 4);
+      sx = _mm256_add_ps(sx, _mm256_mul_ps(_mm256_loadu_ps(taps.gx[k] + j), v));
+      sy = _mm256_add_ps(sy, _mm256_mul_ps(_mm256_loadu_ps(taps.gy[k] + j), v));
+    }
+    __m256 g = _mm256_loadu_ps(og + j);
+    _mm256_storeu_ps(sum_x + j, _mm256_add_ps(_mm256_loadu_ps(sum_x + j), _mm256_mul_ps(g, sx)));
+    _mm256_storeu_ps(sum_y + j, _mm256_add_ps(_mm256_loadu_ps(sum_y + j), _mm256_mul_ps(g, sy)));
+  }
+  return j;
+}
+#endif
+
+template<int Mode, typename Index>
+inline void GridSampleGather(const GridSampleTaps<Mode, Index>& taps, const scalar_t* plane, size_t len,
+                             scalar_t* dst, bool hardware_gather) {
+  // dst[j] = sum_k wt[k][j] * plane[off[k][j]]; 32-bit offsets use hardware gathers.
+  typedef GridSampleTaps<Mode, Index> Taps;
+  size_t j = 0;
+#ifdef NEEDLE_X86
+  if (sizeof(Index) == 4 && hardware_gather) j = GridSampleGatherAvx2(taps, plane, len, dst);
+#endif
+  for (; j < len; ++j) {
+    scalar_t v = 0;
+    for (int k = 0; k < Taps::kTaps; ++k) v += taps.wt[k][j] * plane[taps.off[k][j]];
+    dst[j] = v;
+  }
+}
+
+template<int Mode, int Padding, bool AlignCorners, typename Index>
+void GridSampleImpl(const AlignedArray& a, const AlignedArray& grid, AlignedArray* out,
+                    size_t b, size_t c, size_t h, size_t w, size_t howo) {
+  size_t hw = h * w;
+  size_t blocks = (howo + GRID_SAMPLE_BLOCK - 1) / GRID_SAMPLE_BLOCK;
+  size_t grain = std::max<size_t>(1, PARALLEL_GRAIN_HEAVY / (GRID_SAMPLE_BLOCK * c));
+  typedef GridSampleTaps<Mode, Index> Taps;
+  bool hardware_gather = GridSampleHardwareGather();
+
+  ParallelFor(0, b * blocks, grain, [&](size_t begin, size_t end) {
+    Taps taps;
+    for (size_t t = begin; t < end; ++t) {
+      size_t bb = t / blocks;
+      size_t p0 = (t % blocks) * GRID_SAMPLE_BLOCK;
+      size_t len = std::min<size_t>(GRID_SAMPLE_BLOCK, howo - p0);
+      taps.template Resolve<Padding, AlignCorners, false>(grid.ptr + (bb * howo + p0) * 2, len, h, w);
+      for (size_t cc = 0; cc < c; ++cc) {
+        GridSampleGather(taps, a.ptr + (bb * c + cc) * hw, len, out->ptr + (bb * c + cc) * howo + p0,
+                         hardware_gather);
+      }
+    }
+  });
+}
+
+template<int Mode, typename Index>
+inline void GridSampleGatherGrad(const GridSampleTaps<Mode, Index>& taps, const scalar_t* plane,
+                                 const scalar_t* og, size_t len, scalar_t* sum_x, scalar_t* sum_y,
+                                 bool hardware_gather) {
+  // sum_x[j] += og[j] * sum_k gx[k][j] * plane[off[k][j]], likewise for y.
+  typedef GridSampleTaps<Mode, Index> Taps;
+  size_t j = 0;
+#ifdef NEEDLE_X86
+  if (sizeof(Index) == 4 && hardware_gather) j = GridSampleGatherGradAvx2(taps, plane, og, len, sum_x, sum_y);
+#endif
+  for (; j < len; ++j) {
+    scalar_t sx = 0, sy = 0;
+    for (int k = 0; k < Taps::kTaps; ++k) {
+      scalar_t v = plane[taps.off[k][j]];
+      sx += taps.gx[k][j] * v;
+      sy += taps.gy[k][j] * v;
+    }
+    sum_x[j] += og[j] * sx;
+    sum_y[j] += og[j] * sy;
+  }
+}
+
+template<int Mode, int Padding, bool AlignCorners, typename Index>
+void GridSampleBackwardImpl(const AlignedArray& out_grad, const AlignedArray& a, const AlignedArray& grid,
+                            AlignedArray* a_grad, AlignedArray* grid_grad, size_t b, size_t c, size_t h,
+                            size_t w, size_t howo) {
+  size_t hw = h * w;
+  size_t chunks = std::max<size_t>(1, (c + GRID_SAMPLE_CHANNELS - 1) / GRID_SAMPLE_CHANNELS);
+  std::vector<scalar_t> partial(chunks > 1 ? chunks * b * howo * 2 : 0);
+  typedef GridSampleTaps<Mode, Index> Taps;
+  bool hardware_gather = GridSampleHardwareGather();
+
+  ParallelFor(0, b * chunks, 1, [&](size_t begin, size_t end) {
+    Taps taps;
+    scalar_t sum_x[GRID_SAMPLE_BLOCK], sum_y[GRID_SAMPLE_BLOCK];
+    for (size_t t = begin; t < end; ++t) {
+      size_t bb = t / chunks, ch = t % chunks;
+      size_t c0 = ch * GRID_SAMPLE_CHANNELS, c1 = std::min(c, c0 + GRID_SAMPLE_CHANNELS);
+      scalar_t* gg = chunks > 1 ? partial.data() + (ch * b + bb) * howo * 2 : grid_grad->ptr + bb * howo * 2;
+      std::fill(a_grad->ptr + (bb * c + c0) * hw, a_grad->ptr + (bb * c + c1) * hw, scalar_t(0));
+      for (size_t p0 = 0; p0 < howo; p0 += GRID_SAMPLE_BLOCK) {
+        size_t len = std::min<size_t>(GRID_SAMPLE_BLOCK, howo - p0);
+        taps.template Resolve<Padding, AlignCorners, true>(grid.ptr + (bb * howo + p0) * 2, len, h, w);
+        std::fill(sum_x, sum_x + len, scalar_t(0));
+        std::fill(sum_y, sum_y + len, scalar_t(0));
+        for (size_t cc = c0; cc < c1; ++cc) {
+          const scalar_t* plane = a.ptr + (bb * c + cc) * hw;
+          const scalar_t* og = out_grad.ptr + (bb * c + cc) * howo + p0;
+          if (Mode == kGridBilinear)  // nearest sampling has a zero grid gradient
+            GridSampleGatherGrad(taps, plane, og, len, sum_x, sum_y, hardware_gather);
+          scalar_t* plane_grad = a_grad->ptr + (bb * c + cc) * hw;
+          for (size_t j = 0; j < len; ++j) {
+            for (int k = 0; k < Taps::kTaps; ++k) plane_grad[taps.off[k][j]] += og[j] * taps.wt[k][j];
+          }
+        }
+        for (size_t j = 0; j < len; ++j) {
+          gg[(p0 + j) * 2] = sum_x[j];
+          gg[(p0 + j) * 2 + 1] = sum_y[j];
+        }
+      }
+    }
+  });
+
+  if (chunks > 1) {
+    size_t slab = b * howo * 2;
+    ParallelFor(0, slab, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        scalar_t sum = partial[i];
+        for (size_t ch = 1; ch < chunks; ++ch) sum += partial[ch * slab + i];
+        grid_grad->ptr[i] = sum;
+      }
+    });
+  }
+}
+
+// [mode][padding][align_corners] table of the specializations of a grid sample kernel template
+#define GRID_SAMPLE_KERNELS(F, I)                                                                        \
+  {{{F<kGridBilinear, kGridZeros, false, I>, F<kGridBilinear, kGridZeros, true, I>},                    \
+    {F<kGridBilinear, kGridBorder, false, I>, F<kGridBilinear, kGridBorder, true, I>},                  \
+    {F<kGridBilinear, kGridReflection, false, I>, F<kGridBilinear, kGridReflection, true, I>}},         \
+   {{F<kGridNearest, kGridZeros, false, I>, F<kGridNearest, kGridZeros, true, I>},                      \
+    {F<kGridNearest, kGridBorder, false, I>, F<kGridNearest, kGridBorder, true, I>},                    \
+    {F<kGridNearest, kGridReflection, false, I>, F<kGridNearest, kGridReflection, true, I>}}}
+
+void GridSample(const AlignedArray& a, const AlignedArray& grid, AlignedArray* out, std::vector<int64_t> a_shape,
+                std::vector<int64_t> grid_shape, const std::string& mode, const std::string& padding_mode,
+                bool align_corners) {
+  /**
+   * Compute grid sample.
+   *
+   * Output pixels are processed in blocks of GRID_SAMPLE_BLOCK within one batch
+   * element: the sampling position and the tap weights are resolved once per
+   * output pixel, then every channel reuses them. Since each channel plane of
+   * `out` is contiguous over the output pixels, the channel loop is a
+   * vectorizable weighted gather. Blocks run in parallel. Every combination of
+   * mode / padding_mode / align_corners is its own specialization, selected
+   * once per call together with 32-bit tap offsets whenever a channel plane
+   * has fewer than 2^31 elements.
+   *
    * Args:
    *    a: A flattened image. Compact array of size a.size = B * C * H * W
    *    grid: compact array of grid.size = B * H_out * W_out * 2
    *    out: compact array to write into. out.size = B * C * H_out * W_out
-   *    shape: B, C, H, W
-   */
-  int32_t b = a_shape[0], c = a_shape[1], h = a_shape[2], w = a_shape[3];
-  int32_t ho = grid_shape[1], wo = grid_shape[2];
-  scalar_t offset_x = (w - 1) / 2.0;
-  scalar_t offset_y = (h - 1) / 2.0;
-  int32_t xx[4] = {0, 1, 0, 1};
-  int32_t yy[4] = {0, 0, 1, 1};
-  int32_t hw = h * w;
-  int32_t howo = ho * wo;
-  int32_t chowo = c * howo;
-  int32_t bchowo = b * chowo;
-
-  for (int32_t i=0; i<bchowo; ++i) {
-    int32_t grid_ptr = ((i / chowo) * howo + i % howo) << 1;
-    scalar_t x = grid.ptr[grid_ptr];
-    scalar_t y = grid.ptr[grid_ptr + 1];
-    scalar_t x_trans = x * w / 2.0 + offset_x;
-    scalar_t y_trans = y * h / 2.0 + offset_y;
-    int32_t x_ind = floor(x_trans);
-    int32_t y_ind = floor(y_trans);
-    scalar_t dx = x_trans - x_ind;
-    scalar_t dy = y_trans - y_ind;
-    for (int k = 0; k < 4; ++k) {
-      if (y_ind + yy[k] < 0 || y_ind + yy[k] >= h || x_ind + xx[k] < 0 || x_ind + xx[k] >= w) continue;
-      int32_t a_ptr = i / howo * hw + (y_ind + yy[k]) * w + (x_ind + xx[k]);
-      out->ptr[i] += a.ptr[a_ptr] * (dx * ((xx[k] << 1) - 1) + 1 - xx[k]) * (dy * ((yy[k] << 1) - 1) + 1 - yy[k]);
-    }
-  }
-}
- 
+   *    a_shape: B, C, H, W
+   *    grid_shape: B, H_out, W_out, 2
+   *    mode: "bilinear" or "nearest"
+   *    padding_mode: "zeros", "border" or "reflection"
+   *    align_corners: whether -1 / 1 refer to the centers of the corner pixels
+   */
+  typedef void (*Kernel)(const AlignedArray&, const AlignedArray&, AlignedArray*, size_t, size_t, size_t, size_t,
+                         size_t);
+  static const Kernel kernels32[2][3][2] = GRID_SAMPLE_KERNELS(GridSampleImpl, int32_t);
+  static const Kernel kernels64[2][3][2] = GRID_SAMPLE_KERNELS(GridSampleImpl, int64_t);
+  const Kernel (&kernels)[2][3][2] = (size_t)a_shape[2] * a_shape[3] <= INT32_MAX ? kernels32 : kernels64;
+  Kernel kernel = kernels[GridSampleModeByName(mode)][GridSamplePaddingByName(padding_mode)][align_corners];
+  kernel(a, grid, out, a_shape[0], a_shape[1], a_shape[2], a_shape[3], (size_t)grid_shape[1] * grid_shape[2]);
+}
+
 void GridSampleBackward(const AlignedArray& out_grad, const AlignedArray& a, const AlignedArray& grid,
-                        AlignedArray* a_grad, AlignedArray* grid_grad, std::vector<int32_t> a_shape, std::vector<int32_t> grid_shape) {
+                        AlignedArray* a_grad, AlignedArray* grid_grad, std::vector<int64_t> a_shape,
+                        std::vector<int64_t> grid_shape, const std::string& mode, const std::string& padding_mode,
+                        bool align_corners) {
   /**
-   * Compute grid sample
-   * 
+   * Compute grid sample gradients.
+   *
+   * Work is split into (batch, chunk of GRID_SAMPLE_CHANNELS channels) tasks.
+   * A task owns the a_grad planes of its channels, so the scatter needs no
+   * atomics, and it resolves the taps once per pixel block for all its
+   * channels. The grid gradient sums over every channel; each chunk writes
+   * its partial sums to its own slab, and the slabs are reduced in chunk order.
+   * The work split depends only on the shapes, so results are bitwise
+   * identical for any number of threads.
+   *
    * Args:
    *    out_grad: compact array of size = B * C * H_out * W_out
    *    a: A flattened image. Compact array of size a.size = B * C * H * W
    *    grid: compact array of grid.size = B * H_out * W_out * 2
-   *    a_grid: compact array of a_grid.size = B * C * H * W
-   *    grid_grid: compact array of grid_grad.size = B * H_out * W_out * 2
+   *    a_grad: compact array of a_grad.size = B * C * H * W, fully overwritten
+   *    grid_grad: compact array of grid_grad.size = B * H_out * W_out * 2, fully overwritten
    *    a_shape: B, C, H, W
-   *    grid_shape: B * H_out * W_out * 2
-   */
-  int32_t b = a_shape[0], c = a_shape[1], h = a_shape[2], w = a_shape[3];
-  int32_t ho = grid_shape[1], wo = grid_shape[2];
-  scalar_t offset_x = (w - 1) / 2.0;
-  scalar_t offset_y = (h - 1) / 2.0;
-  int32_t xx[4] = {0, 1, 0, 1};
-  int32_t yy[4] = {0, 0, 1, 1};
-  int32_t hw = h * w;
-  int32_t howo = ho * wo;
-  int32_t chowo = c * howo;
-  int32_t bchowo = b * chowo;
-
-  for (int32_t i=0; i<bchowo; ++i) {
-    int32_t grid_ptr = ((i / chowo) * howo + i % howo) << 1;
-    scalar_t x = grid.ptr[grid_ptr];
-    scalar_t y = grid.ptr[grid_ptr + 1];
-    scalar_t x_trans = x * w / 2.0 + offset_x;
-    scalar_t y_trans = y * h / 2.0 + offset_y;
-    int32_t x_ind = floor(x_trans);
-    int32_t y_ind = floor(y_trans);
-    scalar_t dx = x_trans - x_ind;
-    scalar_t dy = y_trans - y_ind;
-    for (int k = 0; k < 4; ++k) {
-      if (y_ind + yy[k] < 0 || y_ind + yy[k] >= h || x_ind + xx[k] < 0 || x_ind + xx[k] >= w) continue;
-      scalar_t frac_x = dx * ((xx[k] << 1) - 1) + 1 - xx[k];
-      scalar_t frac_y = dy * ((yy[k] << 1) - 1) + 1 - yy[k];
-      int32_t a_ptr = i / howo * hw + (y_ind + yy[k]) * w + (x_ind + xx[k]);
-      grid_grad->ptr[grid_ptr] += out_grad.ptr[i] * a.ptr[a_ptr] * (w / 2.0) * ((xx[k] << 1) - 1) * frac_y;
-      grid_grad->ptr[grid_ptr + 1] += out_grad.ptr[i] * a.ptr[a_ptr] * (h / 2.0) * ((yy[k] << 1) - 1) * frac_x;
-      a_grad->ptr[a_ptr] += out_grad.ptr[i] * frac_x * frac_y;
-    }
-  }
+   *    grid_shape: B, H_out, W_out, 2
+   *    mode, padding_mode, align_corners: as in GridSample
+   */
+  typedef void (*Kernel)(const AlignedArray&, const AlignedArray&, const AlignedArray&, AlignedArray*,
+                         AlignedArray*, size_t, size_t, size_t, size_t, size_t);
+  static const Kernel kernels32[2][3][2] = GRID_SAMPLE_KERNELS(GridSampleBackwardImpl, int32_t);
+  static const Kernel kernels64[2][3][2] = GRID_SAMPLE_KERNELS(GridSampleBackwardImpl, int64_t);
+  const Kernel (&kernels)[2][3][2] = (size_t)a_shape[2] * a_shape[3] <= INT32_MAX ? kernels32 : kernels64;
+  Kernel kernel = kernels[GridSampleModeByName(mode)][GridSamplePaddingByName(padding_mode)][align_corners];
+  kernel(out_grad, a, grid, a_grad, grid_grad, a_shape[0], a_shape[1], a_shape[2], a_shape[3],
+         (size_t)grid_shape[1] * grid_shape[2]);
 }
 
 std::ostream & operator << (std::ostream &out, const std::vector<long unsigned int> &in){
@@ -644,12 +3765,27 @@ PYBIND11_MODULE(ndarray_backend_cpu, m) {
     std::memcpy(out->ptr, a.request().ptr, out->size * ELEM_SIZE);
   });
 
+  m.def("set_num_threads", SetNumThreads);
+  m.def("get_num_threads", GetNumThreads);
+  m.def("set_simd_isa", SetSimdIsa);
+  m.def("get_simd_isa", GetSimdIsa);
+  m.def("set_compensated_sum", SetCompensatedSum);
+  m.def("get_compensated_sum", GetCompensatedSum);
+  m.def("set_random_seed", SetRandomSeed);
+  m.def("get_random_seed", GetRandomSeed);
+  m.def("set_native_random", SetNativeRandom);
+  m.def("get_native_random", GetNativeRandom);
+  m.def("seed_random_stream", SeedRandomStream);
+
   m.def("fill", Fill);
+  m.def("random_fill", RandomFill);
   m.def("compact", Compact);
   m.def("ewise_setitem", EwiseSetitem);
   m.def("scalar_setitem", ScalarSetitem);
   m.def("ewise_add", EwiseAdd);
   m.def("scalar_add", ScalarAdd);
+  m.def("ewise_strided", EwiseStrided);
+  m.def("scalar_strided", ScalarStrided);
 
   m.def("ewise_mul", EwiseMul);
   m.def("scalar_mul", ScalarMul);
@@ -667,14 +3803,33 @@ PYBIND11_MODULE(ndarray_backend_cpu, m) {
   m.def("ewise_log", EwiseLog);
   m.def("ewise_exp", EwiseExp);
   m.def("ewise_tanh", EwiseTanh);
+  m.def("ewise_gelu", EwiseGelu);
+  m.def("ewise_gelu_grad", EwiseGeluGrad);
   m.def("ewise_sign", EwiseSign);
   m.def("ewise_abs", EwiseAbs);
 
   m.def("matmul", Matmul);
   m.def("matmul_tiled", MatmulTiled);
+  m.def("bmm", Bmm);
+  m.def("flash_attention", FlashAttention);
+  m.def("flash_attention_backward", FlashAttentionBackward);
+  m.def("conv2d", Conv2d);
+  m.def("conv2d_backward", Conv2dBackward);
+  m.def("winograd_filter_transform", WinogradFilterTransform);
+  m.def("conv2d_winograd", Conv2dWinograd);
 
   m.def("reduce_max", ReduceMax);
   m.def("reduce_sum", ReduceSum);
+  m.def("reduce_strided", ReduceStrided);
+  m.def("arg_reduce", ArgReduce);
+  m.def("topk", TopK);
+  m.def("gather", Gather);
+  m.def("scatter_add", ScatterAdd);
+  m.def("softmax", Softmax);
+  m.def("softmax_backward", SoftmaxBackward);
+  m.def("softmax_cross_entropy", SoftmaxCrossEntropy);
+  m.def("layer_norm", LayerNorm);
+  m.def("layer_norm_backward", LayerNormBackward);
   m.def("grid_sample", GridSample);
   m.def("grid_sample_backward", GridSampleBackward);
 }
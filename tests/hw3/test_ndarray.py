@@ -1,3 +1,5 @@
+import os
+import time
 import numpy as np
 import pytest
 import mugrade
@@ -70,6 +72,21 @@ def check_same_memory(original, view):
             "np_fn": lambda X: X.transpose()[3:7, 2:5],
             "nd_fn": lambda X: X.permute((1, 0))[3:7, 2:5],
         },
+        {
+            "shape": (3, 64, 48, 40),  # multi-block, multi-threaded gather
+            "np_fn": lambda X: X.transpose(0, 2, 3, 1)[:, 1:, ::3],
+            "nd_fn": lambda X: X.permute((0, 2, 3, 1))[:, 1:, ::3],
+        },
+        {
+            "shape": (2, 35, 9, 41),  # NCHW -> NHWC, blocked transpose with partial tiles
+            "np_fn": lambda X: X.transpose(0, 2, 3, 1),
+            "nd_fn": lambda X: X.permute((0, 2, 3, 1)),
+        },
+        {
+            "shape": (2, 9, 41, 35),  # NHWC -> NCHW
+            "np_fn": lambda X: X.transpose(0, 3, 1, 2),
+            "nd_fn": lambda X: X.permute((0, 3, 1, 2)),
+        },
     ],
     ids=[
         "transpose",
@@ -80,6 +97,9 @@ def check_same_memory(original, view):
         "getitem1",
         "getitem2",
         "transposegetitem",
+        "permutegetitem",
+        "nchw2nhwc",
+        "nhwc2nchw",
     ],
 )
 @pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
@@ -100,6 +120,11 @@ reduce_params = [
     {"dims": (4, 5, 6), "axis": 0},
     {"dims": (4, 5, 6), "axis": 1},
     {"dims": (4, 5, 6), "axis": 2},
+    {"dims": (4, 5, 6), "axis": (0, 2)},
+    {"dims": (4, 5, 6), "axis": None},
+    {"dims": (2, 3, 4, 5), "axis": (0, 2, 3)},
+    {"dims": (2, 3, 4, 5), "axis": (0, 1, 2)},
+    {"dims": (300, 70), "axis": 0},
 ]
 
 
@@ -125,6 +150,114 @@ def test_reduce_max(params, device):
     )
 
 
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+@pytest.mark.parametrize("dims, axis", [((10,), 0), ((4, 5), (0, 1)), ((4, 5, 6), (0, 2)), ((4, 5), 1)])
+def test_reduce_shape(dims, axis, device):
+    _A = np.random.randn(*dims).astype(np.float32)
+    A = nd.array(_A, device=device)
+    assert A.sum(axis=axis).shape == _A.sum(axis=axis).shape
+    assert A.max(axis=axis).shape == _A.max(axis=axis).shape
+    assert A.sum(axis=axis, keepdims=True).shape == _A.sum(axis=axis, keepdims=True).shape
+    # axis=None keeps the needle convention of a (1,) result
+    assert A.sum().shape == (1,)
+    x = ndl.Tensor(_A, device=device)
+    y = ndl.summation(x, axes=axis if isinstance(axis, tuple) else (axis,))
+    assert y.shape == _A.sum(axis=axis).shape
+    out_grad = ndl.Tensor(np.ones(y.shape, dtype=np.float32), device=device)
+    assert y.op.gradient(out_grad, y).shape == dims
+
+
+reduce_view_params = [
+    {"dims": (4, 5, 6), "np_fn": lambda X: X.transpose((2, 0, 1)), "nd_fn": lambda X: X.permute((2, 0, 1)), "axis": (0, 2)},
+    {"dims": (4, 5, 6), "np_fn": lambda X: X.transpose((1, 2, 0)), "nd_fn": lambda X: X.permute((1, 2, 0)), "axis": 1},
+    {"dims": (1, 5, 6), "np_fn": lambda X: np.broadcast_to(X, (4, 5, 6)), "nd_fn": lambda X: X.broadcast_to((4, 5, 6)), "axis": (0, 1)},
+    {"dims": (8, 10, 6), "np_fn": lambda X: X[1:7:2, 2:9, 1:5], "nd_fn": lambda X: X[1:7:2, 2:9, 1:5], "axis": (0, 2)},
+]
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+@pytest.mark.parametrize("params", reduce_view_params)
+def test_reduce_view(params, device):
+    dims, np_fn, nd_fn, axis = params["dims"], params["np_fn"], params["nd_fn"], params["axis"]
+    _A = np.random.randn(*dims).astype(np.float32)
+    A = nd_fn(nd.array(_A, device=device))
+    np.testing.assert_allclose(np_fn(_A).sum(axis=axis), A.sum(axis=axis).numpy(), atol=1e-5, rtol=1e-5)
+    np.testing.assert_allclose(
+        np_fn(_A).max(axis=axis, keepdims=True), A.max(axis=axis, keepdims=True).numpy(), atol=1e-5, rtol=1e-5
+    )
+
+
+arg_reduce_params = [
+    {"dims": (10,), "axis": None},
+    {"dims": (32, 10), "axis": 1},
+    {"dims": (32, 10), "axis": 0},
+    {"dims": (4, 5, 6), "axis": 1},
+    {"dims": (4, 5, 6), "axis": None},
+]
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+@pytest.mark.parametrize("params", arg_reduce_params)
+def test_arg_reduce(params, device):
+    dims, axis = params["dims"], params["axis"]
+    # small integers, so there are ties
+    _A = np.random.randint(0, 5, size=dims).astype(np.float32)
+    A = nd.array(_A, device=device)
+    np.testing.assert_array_equal(A.argmax(axis=axis).numpy().reshape(-1), _A.argmax(axis=axis).reshape(-1))
+    np.testing.assert_array_equal(A.argmin(axis=axis).numpy().reshape(-1), _A.argmin(axis=axis).reshape(-1))
+    if axis is not None:
+        # same data through a permuted view
+        perm = tuple(reversed(range(len(dims))))
+        _B = _A.transpose(perm)
+        np.testing.assert_array_equal(
+            A.permute(perm).argmax(axis=perm.index(axis), keepdims=True).numpy(),
+            _B.argmax(axis=perm.index(axis), keepdims=True),
+        )
+
+
+topk_params = [
+    {"dims": (32, 10), "k": 3, "axis": -1},
+    {"dims": (32, 10), "k": 5, "axis": 0},
+    {"dims": (4, 5, 6), "k": 5, "axis": 1},
+]
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+@pytest.mark.parametrize("params", topk_params)
+@pytest.mark.parametrize("largest", [True, False])
+def test_topk(params, largest, device):
+    dims, k, axis = params["dims"], params["k"], params["axis"]
+    _A = np.random.randn(*dims).astype(np.float32)
+    A = nd.array(_A, device=device)
+    values, indices = A.topk(k, axis=axis, largest=largest)
+    order = np.argsort(-_A if largest else _A, axis=axis, kind="stable")
+    order = np.take(order, np.arange(k), axis=axis)
+    np.testing.assert_array_equal(indices.numpy(), order)
+    np.testing.assert_array_equal(values.numpy(), np.take_along_axis(_A, order, axis=axis))
+
+
+gather_params = [
+    {"dims": (10, 4), "index": (7,), "axis": 0},
+    {"dims": (10, 4), "index": (3, 5), "axis": 0},
+    {"dims": (3, 6, 5), "index": (2, 4), "axis": 1},
+    {"dims": (3, 6, 5), "index": (9,), "axis": -1},
+]
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+@pytest.mark.parametrize("params", gather_params)
+def test_gather_scatter_add(params, device):
+    dims, axis = params["dims"], params["axis"] % len(params["dims"])
+    _A = np.random.randn(*dims).astype(np.float32)
+    _I = np.random.randint(0, dims[axis], size=params["index"])
+    A = nd.array(_A, device=device)
+    I = nd.array(_I.astype(np.float32), device=device)
+    out = A.gather(I, axis=axis)
+    np.testing.assert_array_equal(out.numpy(), np.take(_A, _I, axis=axis))
+    expected = np.zeros_like(_A)
+    np.add.at(expected, (slice(None),) * axis + (_I,), out.numpy())
+    np.testing.assert_allclose(out.scatter_add(I, dims[axis], axis=axis).numpy(), expected, atol=1e-5, rtol=1e-5)
+
+
 """ For converting slice notation to slice objects to make some proceeding tests easier to read """
 
 
@@ -262,6 +395,35 @@ def test_ewise_max(shape, device):
     )
 
 
+# (shape of A, shape of B, shape both are broadcast to, permutation applied to A)
+strided_ewise_params = [
+    ((4, 1, 6), (1, 5, 6), (4, 5, 6), None),
+    ((4, 5, 1), (4, 5, 6), (4, 5, 6), None),
+    ((1, 1, 1), (3, 4, 3000), (3, 4, 3000), None),
+    ((6, 5, 4), (4, 5, 6), (4, 5, 6), (2, 1, 0)),
+    ((5, 1, 4), (4, 5, 1), (4, 5, 7), (2, 0, 1)),
+]
+
+
+@pytest.mark.parametrize("fn", OP_FNS, ids=OP_NAMES)
+@pytest.mark.parametrize("a_shape,b_shape,shape,axes", strided_ewise_params)
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_ewise_fn_strided(fn, a_shape, b_shape, shape, axes, device):
+    _A = np.random.randn(*a_shape)
+    _B = np.random.randn(*b_shape)
+    A = nd.array(_A, device=device)
+    B = nd.array(_B, device=device)
+    if axes is not None:
+        _A, A = np.transpose(_A, axes), A.permute(axes)
+    _A, A = np.broadcast_to(_A, shape), A.broadcast_to(shape)
+    _B, B = np.broadcast_to(_B, shape), B.broadcast_to(shape)
+    np.testing.assert_allclose(fn(_A, _B), fn(A, B).numpy(), atol=1e-5, rtol=1e-5)
+    np.testing.assert_allclose(fn(_A, 0.5), fn(A, 0.5).numpy(), atol=1e-5, rtol=1e-5)
+    np.testing.assert_allclose(np.exp(_A), A.exp().numpy(), atol=1e-5, rtol=1e-5)
+    np.testing.assert_allclose(np.abs(_A[..., 1:]) ** 1.5, (A[:, :, 1:].abs() ** 1.5).numpy(),
+                               atol=1e-5, rtol=1e-5)
+
+
 permute_params = [
     {"dims": (4, 5, 6), "axes": (0, 1, 2)},
     {"dims": (4, 5, 6), "axes": (1, 0, 2)},
@@ -354,6 +516,8 @@ matmul_dims = [
     (72, 73, 74),
     (74, 73, 72),
     (128, 128, 128),
+    (97, 17, 40),
+    (7, 300, 33),
 ]
 
 
@@ -444,6 +608,191 @@ def test_ewise_tanh(device):
     np.testing.assert_allclose(np.tanh(A), (B.tanh()).numpy(), atol=1e-5, rtol=1e-5)
 
 
+@pytest.mark.parametrize("num_threads", [1, 3])
+def test_cpu_num_threads(num_threads):
+    device = nd.cpu()
+    _A = np.random.randn(130, 257)
+    _B = np.random.randn(257, 65)
+    device.set_num_threads(num_threads)
+    try:
+        assert device.get_num_threads() == num_threads
+        A = nd.array(_A, device=device)
+        B = nd.array(_B, device=device)
+        np.testing.assert_allclose((A @ B).numpy(), _A @ _B, rtol=1e-4, atol=1e-4)
+        np.testing.assert_allclose(A.permute((1, 0)).compact().numpy(), _A.T, rtol=1e-6)
+        np.testing.assert_allclose(A.sum(axis=1).numpy(), _A.sum(axis=1), rtol=1e-4, atol=1e-4)
+        np.testing.assert_allclose(A.exp().numpy(), np.exp(_A), rtol=1e-5, atol=1e-5)
+    finally:
+        device.set_num_threads(0)
+
+
+@pytest.mark.parametrize("mode", ["bilinear", "nearest"])
+@pytest.mark.parametrize("padding_mode", ["zeros", "border", "reflection"])
+def test_cpu_grid_sample_backward_num_threads(mode, padding_mode):
+    # a_grad scatters from many grid points into the same pixels and grid_grad sums over channel
+    # blocks (40 channels span several tasks); neither may depend on how the work is split
+    device = nd.cpu()
+    _A = np.random.randn(2, 40, 24, 20).astype(np.float32)
+    _grid = np.random.uniform(-1.1, 1.1, (2, 40, 33, 2)).astype(np.float32)
+    _out_grad = np.random.randn(2, 40, 40, 33).astype(np.float32)
+    A, grid, out_grad = (nd.array(x, device=device) for x in (_A, _grid, _out_grad))
+    grads = []
+    try:
+        for num_threads in (1, 4):
+            device.set_num_threads(num_threads)
+            grads.append([x.numpy() for x in out_grad.grid_sample_backward(
+                A, grid, mode=mode, padding_mode=padding_mode, align_corners=False)])
+    finally:
+        device.set_num_threads(0)
+    np.testing.assert_array_equal(grads[0][0], grads[1][0])
+    np.testing.assert_array_equal(grads[0][1], grads[1][1])
+
+
+@pytest.mark.parametrize("isa", ["sse2", "sse4", "avx2", "avx512", "generic"])
+def test_cpu_simd_isa(isa):
+    device = nd.cpu()
+    try:
+        device.set_simd_isa(isa)
+    except ValueError:
+        pytest.skip("%s is not supported on this CPU" % isa)
+    try:
+        assert device.get_simd_isa() == isa
+        # odd length, so every kernel also runs its zero-padded tail
+        _A = np.random.randn(1037).astype(np.float32) * 10
+        _B = np.random.randn(1037).astype(np.float32)
+        _A[:6] = [0.0, -0.0, 88.0, -88.0, -110.0, 1e-3]
+        A = nd.array(_A, device=device)
+        B = nd.array(_B, device=device)
+        np.testing.assert_allclose((A + B).numpy(), _A + _B, rtol=1e-6)
+        np.testing.assert_allclose((A / B).numpy(), _A / _B, rtol=1e-6)
+        np.testing.assert_allclose(A.maximum(B).numpy(), np.maximum(_A, _B), rtol=1e-6)
+        np.testing.assert_allclose((A >= B).numpy(), _A >= _B)
+        np.testing.assert_allclose(A.exp().numpy(), np.exp(_A), rtol=1e-5)
+        np.testing.assert_allclose(A.tanh().numpy(), np.tanh(_A), rtol=1e-5, atol=1e-6)
+        np.testing.assert_allclose(A.abs().log().numpy(), np.log(np.abs(_A)), rtol=1e-5, atol=1e-6)
+        np.testing.assert_allclose((A ** 3).numpy(), _A ** 3, rtol=1e-5)
+        np.testing.assert_allclose((A.abs() ** 1.5).numpy(), np.abs(_A) ** 1.5, rtol=1e-5)
+        # the GEMM micro-kernel follows the instruction set; odd sizes exercise the edge tiles
+        _M = np.random.randn(37, 53).astype(np.float32)
+        _N = np.random.randn(53, 41).astype(np.float32)
+        M = nd.array(_M, device=device)
+        N = nd.array(_N, device=device)
+        np.testing.assert_allclose((M @ N).numpy(), _M @ _N, rtol=1e-4, atol=1e-4)
+    finally:
+        device.set_simd_isa("auto")
+
+
+@pytest.mark.parametrize("compensated", [False, True])
+def test_cpu_sum_accuracy(compensated):
+    device = nd.cpu()
+    device.set_compensated_sum(compensated)
+    try:
+        assert device.get_compensated_sum() == compensated
+        # a serial float32 sum drifts by ~1e-4 relative here
+        _A = (np.random.rand(1 << 22) + 0.1).astype(np.float32)
+        A = nd.array(_A, device=device)
+        np.testing.assert_allclose(A.sum().numpy(), _A.astype(np.float64).sum(), rtol=1e-6)
+        np.testing.assert_allclose(
+            A.reshape((1 << 14, 256)).sum(axis=0).numpy(),
+            _A.reshape(1 << 14, 256).astype(np.float64).sum(axis=0),
+            rtol=1e-6,
+        )
+    finally:
+        device.set_compensated_sum(False)
+
+
+def test_cpu_random():
+    device = nd.cpu()
+    threads = device.get_num_threads()
+    try:
+        # by default the device draws from np.random, so np.random.seed still applies
+        device.set_native_random(False)
+        np.random.seed(11)
+        _A = np.random.rand(5, 3).astype(np.float32)
+        np.random.seed(11)
+        np.testing.assert_array_equal(device.rand(5, 3).numpy(), _A)
+
+        device.set_random_seed(3)
+        assert device.get_native_random()
+        device.set_num_threads(1)
+        first = [device.rand(1000, 7).numpy(), device.randn(7001).numpy(), device.randb(999, p=0.25).numpy()]
+        # the same seed replays the same draws, whatever the number of threads
+        device.set_random_seed(3)
+        device.set_num_threads(4)
+        again = [device.rand(1000, 7).numpy(), device.randn(7001).numpy(), device.randb(999, p=0.25).numpy()]
+        for x, y in zip(first, again):
+            np.testing.assert_array_equal(x, y)
+        # successive draws and separate streams differ
+        assert not np.array_equal(device.rand(1000, 7).numpy(), first[0])
+        device.set_random_seed(3)
+        assert not np.array_equal(device.rand(1000, 7, stream=1).numpy(), first[0])
+        device.seed_random_stream(1, 5)
+        np.testing.assert_array_equal(device.rand(1000, 7).numpy(), first[0])
+
+        u, z, b = device.rand(1 << 20).numpy(), device.randn(1 << 20).numpy(), device.randb(1 << 20, p=0.25).numpy()
+        assert u.min() >= 0 and u.max() < 1 and abs(u.mean() - 0.5) < 5e-3
+        assert abs(z.mean()) < 5e-3 and abs(z.std() - 1) < 5e-3
+        assert set(np.unique(b)) <= {0.0, 1.0} and abs(b.mean() - 0.25) < 5e-3
+    finally:
+        device.set_num_threads(threads)
+        device.set_random_seed(0)
+        device.set_native_random(False)
+
+
+# Stress runs over tensors with more than 2^31 elements (8 GiB each). They need ~24 GiB of RAM,
+# so they are opt-in:  NEEDLE_LARGE_TENSORS=1 pytest -s -k large_tensor tests/hw3/test_ndarray.py
+large_tensor = pytest.mark.skipif(
+    not os.environ.get("NEEDLE_LARGE_TENSORS"), reason="set NEEDLE_LARGE_TENSORS=1 to run"
+)
+LARGE_ROWS, LARGE_COLS = (1 << 15) + 3, 1 << 16  # 2^31 + 3 * 2^16 elements
+
+
+def large_arange_rows(device):
+    """A compact (LARGE_ROWS, LARGE_COLS) array with x[i, j] = j."""
+    row = nd.array(np.arange(LARGE_COLS, dtype=np.float32), device=device)
+    return row.reshape((1, LARGE_COLS)).broadcast_to((LARGE_ROWS, LARGE_COLS)).compact()
+
+
+@large_tensor
+def test_large_tensor_compact():
+    start = time.perf_counter()
+    x = large_arange_rows(nd.cpu())
+    broadcast = time.perf_counter()
+    y = x.permute((1, 0)).compact()
+    transpose = time.perf_counter()
+    print("compact broadcast %.2fs, transpose %.2fs" % (broadcast - start, transpose - broadcast))
+    np.testing.assert_array_equal(x[LARGE_ROWS - 1 :, LARGE_COLS - 4 :].numpy(), [np.arange(LARGE_COLS - 4, LARGE_COLS)])
+    np.testing.assert_array_equal(y[LARGE_COLS - 1 :, LARGE_ROWS - 4 :].numpy(), np.full((1, 4), LARGE_COLS - 1))
+    np.testing.assert_array_equal(y[7:8, LARGE_ROWS - 4 :].numpy(), np.full((1, 4), 7))
+
+
+@large_tensor
+def test_large_tensor_reduce():
+    x = large_arange_rows(nd.cpu())
+    start = time.perf_counter()
+    s = x.sum(axis=1)
+    summed = time.perf_counter()
+    m = x.max(axis=1)
+    print("reduce sum %.2fs, max %.2fs" % (summed - start, time.perf_counter() - summed))
+    tail = slice(LARGE_ROWS - 4, LARGE_ROWS)
+    np.testing.assert_allclose(s[tail].numpy(), np.full(4, LARGE_COLS * (LARGE_COLS - 1) / 2), rtol=1e-5)
+    np.testing.assert_array_equal(m[tail].numpy(), np.full(4, LARGE_COLS - 1))
+
+
+@large_tensor
+def test_large_tensor_grid_sample():
+    c, h, w = 8193, 512, 512  # 2^31 + 2^18 elements
+    channel = nd.array(np.arange(c, dtype=np.float32), device=nd.cpu())
+    a = channel.reshape((1, c, 1, 1)).broadcast_to((1, c, h, w)).compact()
+    np.random.seed(0)
+    grid = nd.array(np.random.uniform(-0.9, 0.9, (1, 4, 4, 2)).astype(np.float32), device=nd.cpu())
+    start = time.perf_counter()
+    out = a.grid_sample(grid)
+    print("grid_sample %.2fs" % (time.perf_counter() - start))
+    expected = np.broadcast_to(np.arange(c - 4, c, dtype=np.float32).reshape(1, 4, 1, 1), (1, 4, 4, 4))
+    np.testing.assert_allclose(out[:, c - 4 :, :, :].numpy(), expected, rtol=1e-5)
+
+
 ######################    |    ######################
 ###################### MUGRADE ######################
 ######################    v    ######################
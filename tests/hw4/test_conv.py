@@ -469,6 +469,105 @@ def test_op_conv(Z_shape, W_shape, stride, padding, backward, device):
     assert err3 < 1e-1, "outputs match %s, %s" % (y2, out2)
 
 
+op_conv_bias_shapes = [
+    ( (3, 14, 14, 8), (3, 3, 8, 16), 1, 1 ),
+    ( (2, 12, 12, 16), (3, 3, 16, 8), 1, 1 ),  # Winograd, whole tiles
+    ( (1, 13, 11, 8), (3, 3, 8, 8), 1, 0 ),    # Winograd, partial tiles
+    ( (2, 6, 7, 8), (3, 3, 8, 12), 1, 1 ),     # Winograd F(2x2), small output
+    ( (3, 15, 15, 8), (3, 3, 8, 16), 2, 0 ),
+    ( (2, 9, 7, 3), (3, 3, 3, 5), 3, 4 ),
+    ( (3, 17, 17, 16), (1, 1, 16, 4), 1, 0 ),
+]
+@pytest.mark.parametrize("Z_shape, W_shape, stride, padding", op_conv_bias_shapes)
+@pytest.mark.parametrize("device", _DEVICES)
+def test_op_conv_bias_backward(Z_shape, W_shape, stride, padding, device):
+    np.random.seed(0)
+    import torch
+    _Z = np.random.randn(*Z_shape).astype(np.float32)
+    _W = np.random.randn(*W_shape).astype(np.float32)
+    _b = np.random.randn(W_shape[3]).astype(np.float32)
+    Z, W, b = (ndl.Tensor(x, device=device) for x in (_Z, _W, _b))
+    y = ndl.conv(Z, W, stride=stride, padding=padding, bias=b)
+    (y * y).sum().backward()
+    Ztch, Wtch, btch = (torch.tensor(x, requires_grad=True) for x in (_Z, _W, _b))
+    out = torch.nn.functional.conv2d(Ztch.permute(0, 3, 1, 2), Wtch.permute(3, 2, 0, 1),
+                                     bias=btch, padding=padding, stride=stride)
+    (out * out).sum().backward()
+    np.testing.assert_allclose(y.numpy(), out.permute(0, 2, 3, 1).detach().numpy(), atol=1e-3, rtol=1e-4)
+    np.testing.assert_allclose(Z.grad.numpy(), Ztch.grad.numpy(), atol=1e-2, rtol=1e-3)
+    np.testing.assert_allclose(W.grad.numpy(), Wtch.grad.numpy(), atol=1e-2, rtol=1e-3)
+    np.testing.assert_allclose(b.grad.numpy(), btch.grad.numpy(), atol=1e-2, rtol=1e-3)
+
+
+@pytest.mark.parametrize("Z_shape, padding, tile", [
+    ((2, 10, 9, 8), 1, 4), ((2, 10, 9, 8), 1, 2), ((1, 7, 5, 16), 0, 2), ((1, 6, 6, 8), 1, 2)])
+def test_conv2d_winograd(Z_shape, padding, tile):
+    np.random.seed(0)
+    import torch
+    device = nd.cpu()
+    C_in, C_out = Z_shape[3], 12
+    _Z = np.random.randn(*Z_shape).astype(np.float32)
+    _W = np.random.randn(3, 3, C_in, C_out).astype(np.float32)
+    _b = np.random.randn(C_out).astype(np.float32)
+    Z, W, b = (nd.array(x, device=device) for x in (_Z, _W, _b))
+    N, H, Wd = Z_shape[:3]
+    H_out, W_out = H + 2 * padding - 2, Wd + 2 * padding - 2
+    out = nd.NDArray.make((N, H_out, W_out, C_out), device=device)
+    device.conv2d_winograd(Z._handle, W.winograd_filters(tile)._handle, b._handle, out._handle,
+                           N, H, Wd, C_in, C_out, padding, tile, True)
+    ref = torch.nn.functional.conv2d(torch.tensor(_Z).permute(0, 3, 1, 2),
+                                     torch.tensor(_W).permute(3, 2, 0, 1), bias=torch.tensor(_b),
+                                     padding=padding).permute(0, 2, 3, 1).numpy()
+    np.testing.assert_allclose(out.numpy(), ref, atol=1e-3, rtol=1e-4)
+
+
+def test_conv2d_winograd_filters_update():
+    # the transformed filters are cached; writing to the weights in place must invalidate them
+    np.random.seed(0)
+    import torch
+    device = nd.cpu()
+    _Z = np.random.randn(2, 10, 10, 8).astype(np.float32)
+    _W = np.random.randn(3, 3, 8, 8).astype(np.float32)
+    Z, W = nd.array(_Z, device=device), nd.array(np.zeros_like(_W), device=device)
+    def check(_W):
+        ref = torch.nn.functional.conv2d(torch.tensor(_Z).permute(0, 3, 1, 2),
+                                         torch.tensor(_W).permute(3, 2, 0, 1),
+                                         padding=1).permute(0, 2, 3, 1).numpy()
+        np.testing.assert_allclose(Z.conv2d(W, padding=1).numpy(), ref, atol=1e-3, rtol=1e-4)
+    check(np.zeros_like(_W))
+    W[:, :, :, :] = nd.array(_W, device=device)
+    check(_W)
+    W.fill(0.5)
+    check(np.full_like(_W, 0.5))
+
+
+op_conv_groups_shapes = [
+    ( (3, 14, 14, 8), (3, 3, 2, 16), 1, 1, 4 ),
+    ( (3, 9, 9, 8), (1, 1, 4, 6), 1, 0, 2 ),
+    ( (2, 20, 20, 16), (5, 5, 1, 16), 4, 2, 16 ),  # depthwise, as in the deformable attention offsets
+    ( (2, 11, 11, 4), (3, 3, 1, 12), 2, 1, 4 ),    # depthwise with a channel multiplier
+]
+@pytest.mark.parametrize("Z_shape, W_shape, stride, padding, groups", op_conv_groups_shapes)
+@pytest.mark.parametrize("device", _DEVICES)
+def test_op_conv_groups_backward(Z_shape, W_shape, stride, padding, groups, device):
+    np.random.seed(0)
+    import torch
+    _Z = np.random.randn(*Z_shape).astype(np.float32)
+    _W = np.random.randn(*W_shape).astype(np.float32)
+    _b = np.random.randn(W_shape[3]).astype(np.float32)
+    Z, W, b = (ndl.Tensor(x, device=device) for x in (_Z, _W, _b))
+    y = ndl.conv(Z, W, stride=stride, padding=padding, bias=b, groups=groups)
+    (y * y).sum().backward()
+    Ztch, Wtch, btch = (torch.tensor(x, requires_grad=True) for x in (_Z, _W, _b))
+    out = torch.nn.functional.conv2d(Ztch.permute(0, 3, 1, 2), Wtch.permute(3, 2, 0, 1),
+                                     bias=btch, padding=padding, stride=stride, groups=groups)
+    (out * out).sum().backward()
+    np.testing.assert_allclose(y.numpy(), out.permute(0, 2, 3, 1).detach().numpy(), atol=1e-3, rtol=1e-4)
+    np.testing.assert_allclose(Z.grad.numpy(), Ztch.grad.numpy(), atol=1e-2, rtol=1e-3)
+    np.testing.assert_allclose(W.grad.numpy(), Wtch.grad.numpy(), atol=1e-2, rtol=1e-3)
+    np.testing.assert_allclose(b.grad.numpy(), btch.grad.numpy(), atol=1e-2, rtol=1e-3)
+
+
 @pytest.mark.parametrize("device", _DEVICES)
 def test_train_cifar10(device):
     np.random.seed(0)
@@ -93,6 +93,95 @@ def test_matmul(m, n, p, device):
     np.testing.assert_allclose(_A @ _B, (A @ B).numpy(), atol=1e-5, rtol=1e-5)
 
 
+BMM_SHAPES = [
+    ((2, 3, 4, 5), (2, 3, 5, 6)),
+    ((3, 17, 9), (3, 9, 33)),
+    ((2, 3, 4, 5), (5, 6)),
+    ((4, 5), (2, 3, 5, 6)),
+    ((2, 1, 4, 5), (1, 3, 5, 6))]
+@pytest.mark.parametrize("a_shape,b_shape", BMM_SHAPES)
+@pytest.mark.parametrize("transpose_a", [False, True])
+@pytest.mark.parametrize("transpose_b", [False, True])
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_bmm(a_shape, b_shape, transpose_a, transpose_b, device):
+    _A = np.random.randn(*a_shape).astype(np.float32)
+    _B = np.random.randn(*b_shape).astype(np.float32)
+    _A = np.swapaxes(_A, -1, -2).copy() if transpose_a else _A
+    _B = np.swapaxes(_B, -1, -2).copy() if transpose_b else _B
+    A = ndl.Tensor(nd.array(_A), device=device)
+    B = ndl.Tensor(nd.array(_B), device=device)
+    _opA = np.swapaxes(_A, -1, -2) if transpose_a else _A
+    _opB = np.swapaxes(_B, -1, -2) if transpose_b else _B
+    out = ndl.ops.bmm(A, B, transpose_a=transpose_a, transpose_b=transpose_b)
+    np.testing.assert_allclose(_opA @ _opB, out.numpy(), atol=1e-5, rtol=1e-5)
+
+
+BMM_BACKWARD_SHAPES = [
+    ((2, 3, 4, 5), (2, 3, 5, 6)),
+    ((2, 3, 4, 5), (5, 6)),
+    ((4, 5), (2, 3, 5, 6)),
+    ((2, 1, 4, 5), (1, 3, 5, 6))]
+@pytest.mark.parametrize("a_shape,b_shape", BMM_BACKWARD_SHAPES)
+@pytest.mark.parametrize("transpose_a", [False, True])
+@pytest.mark.parametrize("transpose_b", [False, True])
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_bmm_backward(a_shape, b_shape, transpose_a, transpose_b, device):
+    _A = np.random.randn(*a_shape).astype(np.float32)
+    _B = np.random.randn(*b_shape).astype(np.float32)
+    _A = np.swapaxes(_A, -1, -2).copy() if transpose_a else _A
+    _B = np.swapaxes(_B, -1, -2).copy() if transpose_b else _B
+    A = ndl.Tensor(nd.array(_A), device=device)
+    B = ndl.Tensor(nd.array(_B), device=device)
+    backward_check(ndl.ops.bmm, A, B, transpose_a=transpose_a, transpose_b=transpose_b)
+
+
+def _attention_reference(q, k, v, bias, scale, causal):
+    n, m = q.shape[-2], k.shape[-2]
+    logits = q @ np.swapaxes(k, -1, -2) * scale
+    if bias is not None:
+        logits = logits + bias
+    if causal:
+        logits = logits - np.finfo(np.float32).max * np.triu(np.ones((n, m), dtype=np.float32), m - n + 1)
+    logits = logits - logits.max(axis=-1, keepdims=True)
+    probs = np.exp(logits)
+    return (probs / probs.sum(axis=-1, keepdims=True)) @ v
+
+
+ATTENTION_SHAPES = [
+    ((2, 3, 31, 16), (2, 3, 31, 16), (2, 3, 31, 16)),
+    ((2, 70, 8), (2, 150, 8), (2, 150, 12)),
+    ((1, 2, 130, 33), (1, 2, 90, 33), (1, 2, 90, 7))]
+@pytest.mark.parametrize("q_shape,k_shape,v_shape", ATTENTION_SHAPES)
+@pytest.mark.parametrize("use_bias", [False, True])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_flash_attention(q_shape, k_shape, v_shape, use_bias, causal, device):
+    _Q = np.random.randn(*q_shape).astype(np.float32)
+    _K = np.random.randn(*k_shape).astype(np.float32)
+    _V = np.random.randn(*v_shape).astype(np.float32)
+    _bias = np.random.randn(*q_shape[:-1], k_shape[-2]).astype(np.float32) if use_bias else None
+    scale = q_shape[-1] ** -0.5
+    args = [ndl.Tensor(nd.array(x), device=device) for x in (_Q, _K, _V)]
+    if use_bias:
+        args.append(ndl.Tensor(nd.array(_bias), device=device))
+    out = ndl.ops.flash_attention(*args, scale=scale, causal=causal)
+    np.testing.assert_allclose(_attention_reference(_Q, _K, _V, _bias, scale, causal),
+                               out.numpy(), atol=1e-5, rtol=1e-5)
+
+
+@pytest.mark.parametrize("n,m", [(5, 5), (4, 7), (7, 4)])
+@pytest.mark.parametrize("bias_batch", [None, (2, 3), (), (3,), (2, 1)])
+@pytest.mark.parametrize("causal", [False, True])
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_flash_attention_backward(n, m, bias_batch, causal, device):
+    args = [ndl.Tensor(nd.array(np.random.randn(2, 3, x, 4).astype(np.float32)), device=device)
+            for x in (n, m, m)]
+    if bias_batch is not None:
+        _bias = np.random.randn(*bias_batch, n, m).astype(np.float32)
+        args.append(ndl.Tensor(nd.array(_bias), device=device))
+    backward_check(ndl.ops.flash_attention, *args, scale=0.5, causal=causal)
+
+
 @pytest.mark.parametrize("shape", GENERAL_SHAPES)
 @pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
 def test_power(shape, device):
@@ -142,6 +231,23 @@ def test_tanh_backward(shape, device):
     backward_check(ndl.tanh, A)
 
 
+@pytest.mark.parametrize("shape", GENERAL_SHAPES)
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_gelu(shape, device):
+    _A = 3 * np.random.randn(*shape).astype(np.float32)
+    A = ndl.Tensor(nd.array(_A), device=device)
+    _B = 0.5 * _A * (1 + np.tanh(np.sqrt(2 / np.pi) * (_A + 0.044715 * _A ** 3)))
+    np.testing.assert_allclose(_B, ndl.gelu(A).numpy(), atol=1e-5, rtol=1e-5)
+
+
+@pytest.mark.parametrize("shape", GENERAL_SHAPES)
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_gelu_backward(shape, device):
+    _A = np.random.randn(*shape).astype(np.float32)
+    A = ndl.Tensor(nd.array(_A), device=device)
+    backward_check(ndl.gelu, A)
+
+
 STACK_PARAMETERS = [((5, 5), 0, 1),
     ((5, 5), 0, 2),
     ((1,5,7), 2, 5)]
@@ -239,6 +345,80 @@ def test_logsumexp(shape, axes, device):
     np.testing.assert_allclose(torch.logsumexp(A_t, dim=t_axes).numpy(), ndl.logsumexp(A, axes=axes).numpy(), atol=1e-5, rtol=1e-5)
 
 
+SOFTMAX_PARAMETERS = [((5, 3), -1), ((4, 33), 1), ((2, 3, 7, 40), -1), ((2, 3, 7, 5), 1)]
+@pytest.mark.parametrize("shape, axis", SOFTMAX_PARAMETERS)
+@pytest.mark.parametrize("log", [False, True])
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_softmax(shape, axis, log, device):
+    _A = (np.random.randn(*shape) * 5).astype(np.float32)
+    A = ndl.Tensor(nd.array(_A), device=device)
+    A_t = torch.Tensor(_A)
+    if log:
+        expected, out = torch.log_softmax(A_t, dim=axis), ndl.ops.logsoftmax(A, axis=axis)
+    else:
+        expected, out = torch.softmax(A_t, dim=axis), ndl.ops.softmax(A, axis=axis)
+    np.testing.assert_allclose(expected.numpy(), out.numpy(), atol=1e-5, rtol=1e-5)
+
+
+@pytest.mark.parametrize("shape, axis", SOFTMAX_PARAMETERS)
+@pytest.mark.parametrize("log", [False, True])
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_softmax_backward(shape, axis, log, device):
+    A = ndl.Tensor(nd.array(np.random.randn(*shape).astype(np.float32)), device=device)
+    backward_check(ndl.ops.logsoftmax if log else ndl.ops.softmax, A, axis=axis)
+
+
+@pytest.mark.parametrize("rows, classes", [(1, 1), (5, 3), (16, 10), (7, 1000)])
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_softmax_loss(rows, classes, device):
+    _Z = (np.random.randn(rows, classes) * 5).astype(np.float32)
+    _y = np.random.randint(0, classes, size=rows)
+    Z = ndl.Tensor(nd.array(_Z), device=device)
+    y = ndl.Tensor(nd.array(_y.astype(np.float32)), device=device, requires_grad=False)
+    loss = ndl.nn.SoftmaxLoss()(Z, y)
+    loss.backward()
+    Z_t = torch.tensor(_Z, requires_grad=True)
+    loss_t = torch.nn.functional.cross_entropy(Z_t, torch.tensor(_y))
+    loss_t.backward()
+    np.testing.assert_allclose(loss_t.detach().numpy().reshape(1), loss.numpy().reshape(1), atol=1e-5, rtol=1e-5)
+    np.testing.assert_allclose(Z_t.grad.numpy(), Z.grad.numpy(), atol=1e-5, rtol=1e-5)
+
+
+LAYER_NORM_SHAPES = [(5, 3), (4, 33), (2, 7, 40)]
+@pytest.mark.parametrize("shape", LAYER_NORM_SHAPES)
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_layer_norm(shape, device):
+    _X = (np.random.randn(*shape) * 3 + 10).astype(np.float32)
+    _W = np.random.randn(1, shape[-1]).astype(np.float32)
+    _B = np.random.randn(1, shape[-1]).astype(np.float32)
+    X, W, B = (ndl.Tensor(nd.array(x), device=device) for x in (_X, _W, _B))
+    mean = _X.mean(axis=-1, keepdims=True)
+    var = ((_X - mean) ** 2).mean(axis=-1, keepdims=True)
+    expected = (_X - mean) / np.sqrt(var + 1e-5) * _W.reshape(-1) + _B.reshape(-1)
+    np.testing.assert_allclose(expected, ndl.ops.layer_norm(X, W, B).numpy(), atol=1e-4, rtol=1e-4)
+
+
+@pytest.mark.parametrize("shape", LAYER_NORM_SHAPES)
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_layer_norm_backward(shape, device):
+    args = [ndl.Tensor(nd.array(np.random.randn(*s).astype(np.float32)), device=device)
+            for s in (shape, (1, shape[-1]), (1, shape[-1]))]
+    backward_check(ndl.ops.layer_norm, *args)
+
+
+@pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
+def test_embedding_backward(device):
+    _I = np.random.randint(0, 6, size=(5, 3))
+    emb = ndl.nn.Embedding(6, 4, device=device)
+    out = emb(ndl.Tensor(nd.array(_I.astype(np.float32)), device=device, requires_grad=False))
+    np.testing.assert_allclose(out.numpy(), emb.weight.numpy()[_I], atol=1e-5, rtol=1e-5)
+    _C = np.random.randn(5, 3, 4).astype(np.float32)
+    (out * ndl.Tensor(nd.array(_C), device=device)).sum().backward()
+    expected = np.zeros((6, 4), dtype=np.float32)
+    np.add.at(expected, _I, _C)
+    np.testing.assert_allclose(emb.weight.grad.numpy(), expected, atol=1e-5, rtol=1e-5)
+
+
 
 ### MUGRADE ###
 
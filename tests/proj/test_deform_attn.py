@@ -1222,6 +1222,7 @@ grid_sample_params = [
     (1, 3, 32, 16, 1, 1),
     (2, 3, 32, 32, 15, 18),
     (4, 1, 64, 64, 128, 1),
+    (2, 40, 20, 24, 17, 19),
 ]
 
 # @pytest.mark.parametrize("N,C,H,W,H_out,W_out", grid_sample_params)
@@ -1230,9 +1231,9 @@ grid_sample_params = [
 # @pytest.mark.parametrize("align_corners", [True, False])
 # @pytest.mark.parametrize("device", _DEVICES, ids=["cpu", "cuda"])
 @pytest.mark.parametrize("N,C,H,W,H_out,W_out", grid_sample_params)
-@pytest.mark.parametrize("mode", ['bilinear'])
-@pytest.mark.parametrize("padding_mode", ['zeros'])
-@pytest.mark.parametrize("align_corners", [False])
+@pytest.mark.parametrize("mode", ['bilinear', 'nearest'])
+@pytest.mark.parametrize("padding_mode", ['zeros', 'border', 'reflection'])
+@pytest.mark.parametrize("align_corners", [True, False])
 @pytest.mark.parametrize("device", _DEVICES_ATTN)
 def test_nn_grid_sample(N, C, H, W, H_out, W_out, mode, padding_mode, align_corners, device):
     np.random.seed(0)